@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <libprep.hpp>
+
+// prep_bench, runs prep over generated workloads through the library interface and reports the per phase wall time.
+// every workload lives in memory, so the numbers measure the preprocessor and not the filesystem.
+// the output is one line per workload of key=value pairs, times are the fastest of all iterations in milliseconds, and is meant to be diffed and parsed:
+//     prep_bench 1 iterations=5 scale=1 calibration=...
+//     includes bytes=... lines=... tokens=... expansions=... total=... lex=... directive=... eval=... expand=... include=... output=...
+// with -baseline it reruns the workloads of an earlier report and exits with failure when lexing or expansion got slower.
+
+static constexpr size_t DEFAULT_ITERATIONS { 5 };
+static constexpr int    FORMAT_VERSION { 1 };     // bump when the meaning of a reported figure changes
+static constexpr double DEFAULT_THRESHOLD { 30 }; // percent a timing may grow before -baseline calls it a regression
+static constexpr double NOISE_FLOOR_MS { 0.5 };   // growth below this is never a regression, small timings are mostly noise
+static constexpr size_t CALIBRATION_BYTES { 1 << 20 };
+static constexpr size_t CALIBRATION_BLOCKS { 1 << 16 };
+static constexpr size_t CALIBRATION_CHAIN { 1 << 22 }; // 32 MiB of slots
+static constexpr size_t CALIBRATION_ROUNDS { 5 };
+
+static constexpr const char* phase_keys[PREP_NPHASES] = { "other", "lex", "directive", "eval", "expand", "include", "output" };
+
+struct workload final {
+        std::string              input;
+        std::vector<std::string> names; // in-memory headers
+        std::vector<std::string> files;
+        std::vector<std::string> defines;
+        bool                     cplusplus;
+};
+
+using generator = void (*)(workload&, int scale);
+
+// scale trees of guarded headers, fanout wide and depth deep, where every header includes all its children twice
+static void gen_includes(workload& w, const int scale) {
+    static constexpr int depth { 5 }, fanout { 4 };
+    int                  pertree { 1 };
+    char                 line[256];
+
+    for (int d = 0; d < depth; d++) pertree *= fanout;
+    pertree = (pertree - 1) / (fanout - 1); // nodes of one tree
+    for (int t = 0; t < scale; t++) {
+        for (int n = 0; n < pertree; n++) {
+            const int   id = t * pertree + n;
+            std::string h {};
+            std::snprintf(line, sizeof(line), "#ifndef HEADER_%d_H\n#define HEADER_%d_H\n", id, id);
+            h += line;
+            for (int pass = 0; pass < 2; pass++)
+                for (int c = 1; c <= fanout && n * fanout + c < pertree; c++) {
+                    std::snprintf(line, sizeof(line), "#include \"h%d.h\"\n", t * pertree + n * fanout + c);
+                    h += line;
+                }
+            for (int j = 0; j < 20; j++) {
+                std::snprintf(line, sizeof(line), "#define H%d_VALUE_%d (%d + H%d_OFFSET)\nextern int h%d_symbol_%d(int, char*, unsigned long);\n", id, j, j, id, id, j);
+                h += line;
+            }
+            h += "#endif\n";
+            std::snprintf(line, sizeof(line), "h%d.h", id);
+            w.names.push_back(line);
+            w.files.push_back(h);
+        }
+        std::snprintf(line, sizeof(line), "#include \"h%d.h\"\n", t * pertree);
+        w.input += line;
+    }
+    w.input += "int main(void) { return 0; }\n";
+}
+
+// Boost.PP style arithmetic and repetition, every step is a token paste and a rescan
+static void gen_recursion(workload& w, const int scale) {
+    static constexpr int limit { 256 };
+    char                 line[256];
+
+    w.input += "#define PP_CAT(a, b) PP_CAT_I(a, b)\n#define PP_CAT_I(a, b) a ## b\n";
+    for (int i = 0; i < limit; i++) {
+        std::snprintf(line, sizeof(line), "#define PP_INC_%d %d\n#define PP_DEC_%d %d\n", i, i + 1, i + 1, i);
+        w.input += line;
+    }
+    w.input += "#define PP_INC(n) PP_CAT(PP_INC_, n)\n#define PP_DEC(n) PP_CAT(PP_DEC_, n)\n";
+    w.input += "#define PP_REPEAT_0(m, d)\n";
+    for (int i = 1; i <= 64; i++) {
+        std::snprintf(line, sizeof(line), "#define PP_REPEAT_%d(m, d) PP_REPEAT_%d(m, d) m(PP_DEC(%d), d)\n", i, i - 1, i);
+        w.input += line;
+    }
+    w.input += "#define PP_REPEAT(n, m, d) PP_CAT(PP_REPEAT_, n)(m, d)\n";
+    w.input += "#define FIELD(n, type) type PP_CAT(field_, n);\n";
+    w.input += "#define PARAM(n, d) , PP_CAT(d, n)\n";
+    for (int i = 0; i < 16 * scale; i++) {
+        std::snprintf(line, sizeof(line), "struct s%d { PP_REPEAT(%d, FIELD, int) };\n", i, 1 + i % 64);
+        w.input += line;
+        std::snprintf(line, sizeof(line), "void f%d(int first PP_REPEAT(%d, PARAM, arg));\n", i, 1 + (i * 7) % 64);
+        w.input += line;
+    }
+}
+
+// large blocks skipped by conditionals, with the nesting and directives the skipping code still has to track
+static void gen_skipped(workload& w, const int scale) {
+    char line[256];
+
+    for (int b = 0; b < 10 * scale; b++) {
+        w.input += "#if 0\n";
+        for (int i = 0; i < 2000; i++) {
+            if (i % 100 == 0) w.input += "#ifdef SOMETHING\n#define NOT_REALLY 1\n#elif defined(OTHER) && OTHER > 3\n#else\n#endif\n";
+            std::snprintf(line, sizeof(line), "static const char* dead_%d_%d = \"a string with a ' quote and an /* opener\"; /* comment */\n", b, i);
+            w.input += line;
+        }
+        w.input += "#else\n";
+        std::snprintf(line, sizeof(line), "int live_%d;\n", b);
+        w.input += line;
+        w.input += "#endif\n";
+    }
+}
+
+// an X-macro table expanded into several different shapes
+static void gen_xmacros(workload& w, const int scale) {
+    char line[256];
+
+    w.input += "#define COLOR_TABLE(X) \\\n";
+    for (int i = 0; i < 500 * scale; i++) {
+        std::snprintf(line, sizeof(line), "    X(color_%d, 0x%06x, \"color number %d\") \\\n", i, (i * 2654435761u) & 0xffffff, i);
+        w.input += line;
+    }
+    w.input += "\n";
+    w.input += "#define AS_ENUM(name, value, text) name,\nenum color { COLOR_TABLE(AS_ENUM) color_count };\n";
+    w.input += "#define AS_VALUE(name, value, text) value,\nstatic const unsigned values[] = { COLOR_TABLE(AS_VALUE) };\n";
+    w.input += "#define AS_TEXT(name, value, text) text,\nstatic const char* texts[] = { COLOR_TABLE(AS_TEXT) };\n";
+    w.input += "#define AS_CASE(name, value, text) case name: return #name;\n";
+    w.input += "const char* color_name(enum color c) { switch (c) { COLOR_TABLE(AS_CASE) default: return 0; } }\n";
+}
+
+// files that are mostly block and line comments, as generated or heavily documented headers are
+static void gen_comments(workload& w, const int scale) {
+    char line[256];
+
+    w.cplusplus = true;
+    for (int i = 0; i < 3000 * scale; i++) {
+        w.input += "/**\n * Returns the thing, after checking the other thing.\n * @param a the first argument, which must not be null\n";
+        w.input += " * @param b the second argument\n * @return the result, or a negative error code\n */\n";
+        std::snprintf(line, sizeof(line), "int documented_%d(const char* a, int b); // see the comment above\n", i);
+        w.input += line;
+        w.input += "// a line comment\n// and another one\n";
+    }
+}
+
+// thousands of -D arguments, most of them referenced once
+static void gen_defines(workload& w, const int scale) {
+    char line[256];
+
+    for (int i = 0; i < 2000 * scale; i++) {
+        std::snprintf(line, sizeof(line), "CONFIG_OPTION_%d=%d", i, i * 3);
+        w.defines.push_back(line);
+        std::snprintf(line, sizeof(line), "#if CONFIG_OPTION_%d > %d\nint option_%d = CONFIG_OPTION_%d;\n#endif\n", i, i, i, i);
+        w.input += line;
+    }
+}
+
+struct benchmark final {
+        const char* name;
+        generator   generate;
+};
+
+static constexpr benchmark benchmarks[] = {
+    { "includes",  gen_includes  },
+    { "recursion", gen_recursion },
+    { "skipped",   gen_skipped   },
+    { "xmacros",   gen_xmacros   },
+    { "comments",  gen_comments  },
+    { "defines",   gen_defines   },
+};
+
+// the best of several runs, anything slower than that is interference from the rest of the machine
+static double fastest(const std::vector<double>& v) { return *std::min_element(v.begin(), v.end()); }
+
+/*
+ * milliseconds a fixed, prep independent mix of table driven byte scanning, small allocations and a pointer chase
+ * through a buffer larger than the caches takes, the fastest of CALIBRATION_ROUNDS. a report records it so -baseline
+ * can tell a slower build from a machine that is slower or busier than the one that wrote the report.
+ */
+static double calibrate(void) {
+    static std::vector<unsigned char> text;
+    static std::vector<size_t>        chain;
+    unsigned char                     table[256];
+    std::vector<double>               times;
+    std::vector<void*>                blocks(CALIBRATION_BLOCKS);
+    volatile size_t                   sink {};
+
+    if (text.empty()) {
+        for (size_t i = 0; i < CALIBRATION_BYTES; i++) text.push_back(static_cast<unsigned char>((i * 2654435761u) >> 13));
+        // one cycle through every slot, with a stride that defeats the prefetcher
+        chain.resize(CALIBRATION_CHAIN);
+        for (size_t i = 0; i < CALIBRATION_CHAIN; i++) chain[i] = (i + 40503) % CALIBRATION_CHAIN;
+    }
+    for (size_t i = 0; i < sizeof(table); i++) table[i] = static_cast<unsigned char>(i * 7 + 1);
+    for (size_t r = 0; r < CALIBRATION_ROUNDS; r++) {
+        const auto start = std::chrono::steady_clock::now();
+        size_t     state {};
+        for (const unsigned char c : text) state = table[(state ^ c) & 0xFF] + (state << 1);
+        for (size_t i = 0; i < CALIBRATION_BLOCKS; i++) blocks[i] = std::malloc(16 + (i * 37) % 200);
+        for (size_t i = 0; i < CALIBRATION_BLOCKS; i += 2) std::free(blocks[i]);
+        for (size_t i = 0; i < CALIBRATION_BLOCKS; i += 2) blocks[i] = std::malloc(16 + (i * 53) % 200);
+        for (void* const p : blocks) std::free(p);
+        for (size_t i = 0, at = 0; i < CALIBRATION_CHAIN / 64; i++) at = chain[at], state += at;
+        sink = state;
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    (void) sink;
+    return fastest(times);
+}
+
+struct measurement final {
+        prep_stats stats;               // counters of the last run, they are the same on every run
+        double     total;               // fastest milliseconds
+        double     phase[PREP_NPHASES]; // fastest milliseconds per phase
+};
+
+// runs one workload iterations times and keeps the fastest of every timing
+static bool run(const benchmark& b, const size_t iterations, const int scale, measurement& m) {
+    workload                 w {};
+    std::vector<prep_file>   files {};
+    std::vector<const char*> defines {};
+    std::vector<double>      phases[PREP_NPHASES], totals {};
+    prep_options             options {};
+    prep_result              result {};
+
+    b.generate(w, scale);
+    for (size_t i = 0; i < w.files.size(); i++) files.push_back({ w.names[i].c_str(), w.files[i].c_str(), w.files[i].size() });
+    for (const std::string& d : w.defines) defines.push_back(d.c_str());
+    options.filename   = "bench.c";
+    options.files      = files.data();
+    options.nfiles     = files.size();
+    options.defines    = defines.data();
+    options.ndefines   = defines.size();
+    options.nolineinfo = true;
+    options.cplusplus  = w.cplusplus;
+    options.timephases = true;
+
+    for (size_t i = 0; i < iterations; i++) {
+        if (preprocess(w.input.c_str(), w.input.size(), &options, &result)) {
+            std::fprintf(stderr, "prep_bench: %s: %s", b.name, result.diagnostics);
+            prep_freeresult(&result);
+            return false;
+        }
+        m.stats = result.stats;
+        for (size_t p = 0; p < PREP_NPHASES; p++) phases[p].push_back(result.stats.phase[p] * 1e3);
+        totals.push_back(result.stats.total * 1e3);
+        prep_freeresult(&result);
+    }
+    m.total = fastest(totals);
+    for (size_t p = 0; p < PREP_NPHASES; p++) m.phase[p] = fastest(phases[p]);
+    return true;
+}
+
+static void report(const char* const name, const measurement& m) {
+    std::printf(
+        "%s bytes=%llu lines=%llu tokens=%llu expansions=%llu total=%.3f", name, m.stats.bytes, m.stats.lines, m.stats.tokens, m.stats.expansions, m.total
+    );
+    for (size_t p = 0; p < PREP_NPHASES; p++) std::printf(" %s=%.3f", phase_keys[p], m.phase[p]);
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+// the value of key in a report line, negative when it is not there
+static double reported(const char* const line, const char* const key) {
+    const size_t len = std::strlen(key);
+
+    for (const char* p = std::strchr(line, ' '); p; p = std::strchr(p + 1, ' '))
+        if (std::strncmp(p + 1, key, len) == 0 && p[len + 1] == '=') return std::atof(p + len + 2);
+    return -1;
+}
+
+// a timing regressed when it grew by more than threshold percent and by more than the noise floor, after the baseline
+// was scaled by how much slower the machine is now
+static bool regressed(
+    const char* const name, const char* const key, const double now, const double then, const double slowdown, const double threshold
+) {
+    const double expected = then * slowdown;
+
+    if (then < 0 || now <= expected * (1 + threshold / 100) + NOISE_FLOOR_MS) return false;
+    std::fprintf(
+        stderr, "prep_bench: %s: %s regressed from %.3f ms to %.3f ms (%+.1f%%, machine %.2fx slower)\n", name, key, then, now, (now / expected - 1) * 100, slowdown
+    );
+    return true;
+}
+
+/*
+ * runs every workload listed in a stored report, with the same scale, and fails when lexing, expansion or the
+ * whole run got slower than threshold percent. the baseline is an earlier output of prep_bench redirected to a file.
+ */
+static bool compare(const char* const path, const size_t iterations, const double threshold) {
+    FILE*       file = std::fopen(path, "r");
+    char        line[1024];
+    int         version {}, scale {};
+    size_t      runs {};
+    double      calibration {};
+    bool        ok { true };
+    measurement m {};
+
+    if (!file) {
+        std::fprintf(stderr, "prep_bench: can't open baseline %s\n", path);
+        return false;
+    }
+    if (!std::fgets(line, sizeof(line), file) || std::sscanf(line, "prep_bench %d iterations=%zu scale=%d calibration=%lf", &version, &runs, &scale, &calibration) != 4 ||
+        version != FORMAT_VERSION) {
+        std::fprintf(stderr, "prep_bench: %s is not a format %d prep_bench report\n", path, FORMAT_VERSION);
+        std::fclose(file);
+        return false;
+    }
+    std::printf("prep_bench %d iterations=%zu scale=%d calibration=%.3f\n", FORMAT_VERSION, iterations ? iterations : runs, scale, calibrate());
+    while (std::fgets(line, sizeof(line), file)) {
+        const benchmark* b {};
+        for (const benchmark& candidate : benchmarks)
+            if (std::strncmp(line, candidate.name, std::strlen(candidate.name)) == 0 && line[std::strlen(candidate.name)] == ' ') b = &candidate;
+        if (!b) continue;
+        // a busy machine can slow one round down, so a workload only fails when a second round agrees
+        for (int round = 0; round < 2; round++) {
+            // a machine that got faster is not allowed to hide a regression
+            const double slowdown = std::max(1.0, calibrate() / calibration);
+            bool         slower {};
+            if (!run(*b, iterations ? iterations : runs, scale, m)) {
+                ok = false;
+                break;
+            }
+            report(b->name, m);
+            slower |= regressed(b->name, "lex", m.phase[PREP_PHASE_LEX], reported(line, "lex"), slowdown, threshold);
+            slower |= regressed(b->name, "expand", m.phase[PREP_PHASE_EXPAND], reported(line, "expand"), slowdown, threshold);
+            slower |= regressed(b->name, "total", m.total, reported(line, "total"), slowdown, threshold);
+            if (!slower) break;
+            if (round) ok = false;
+        }
+    }
+    std::fclose(file);
+    return ok;
+}
+
+static void usage(void) {
+    std::fprintf(stderr, "usage: prep_bench [-n iterations] [-s scale] [workload ...]\n");
+    std::fprintf(stderr, "       prep_bench -baseline report [-threshold percent] [-n iterations]\nworkloads:");
+    for (const benchmark& b : benchmarks) std::fprintf(stderr, " %s", b.name);
+    std::fprintf(stderr, "\n");
+    std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    size_t      iterations {};
+    int         scale { 1 }, i {};
+    double      threshold { DEFAULT_THRESHOLD };
+    const char* baseline {};
+    bool        ok { true }, selected {};
+    measurement m {};
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            iterations = std::strtoul(argv[++i], nullptr, 10);
+        else if (std::strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            scale = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "-baseline") == 0 && i + 1 < argc)
+            baseline = argv[++i];
+        else if (std::strcmp(argv[i], "-threshold") == 0 && i + 1 < argc)
+            threshold = std::atof(argv[++i]);
+        else
+            usage();
+    }
+    if (scale <= 0 || threshold < 0) usage();
+    if (baseline) {
+        if (i != argc) usage();
+        return compare(baseline, iterations, threshold) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (iterations == 0) iterations = DEFAULT_ITERATIONS;
+    for (int j = i; j < argc; j++) {
+        selected = false;
+        for (const benchmark& b : benchmarks) selected |= std::strcmp(argv[j], b.name) == 0;
+        if (!selected) usage();
+    }
+
+    std::printf("prep_bench %d iterations=%zu scale=%d calibration=%.3f\n", FORMAT_VERSION, iterations, scale, calibrate());
+    for (const benchmark& b : benchmarks) {
+        selected = i == argc;
+        for (int j = i; j < argc; j++) selected |= std::strcmp(argv[j], b.name) == 0;
+        if (!selected) continue;
+        if (run(b, iterations, scale, m))
+            report(b.name, m);
+        else
+            ok = false;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
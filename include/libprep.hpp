@@ -0,0 +1,164 @@
+#pragma once
+#include <cstddef>
+
+// the public interface for embedding prep, preprocesses a buffer that already lives in memory into another buffer
+
+// token kinds, the same values the preprocessor uses internally
+enum prep_tokentype : unsigned char {
+    PREP_END,
+    PREP_UNCLASS,
+    PREP_NAME,
+    PREP_NUMBER,
+    PREP_STRING,
+    PREP_CCON,
+    PREP_NL,      // newline
+    PREP_WS,      // whitespace
+    PREP_DSHARP,  // ##
+    PREP_EQ,      // ==
+    PREP_NEQ,     // !=
+    PREP_LEQ,     // <=
+    PREP_GEQ,     // >=
+    PREP_LSH,     // <<
+    PREP_RSH,     // >>
+    PREP_LAND,    // &&
+    PREP_LOR,     // ||
+    PREP_PPLUS,
+    PREP_MMINUS,
+    PREP_ARROW,   // ->
+    PREP_SBRA,    // [
+    PREP_SKET,    // ]
+    PREP_LP,      // (
+    PREP_RP,      // )
+    PREP_DOT,     // .
+    PREP_AND,     // &
+    PREP_STAR,    // *
+    PREP_PLUS,    // +
+    PREP_MINUS,   // -
+    PREP_TILDE,   // ~
+    PREP_NOT,     // !
+    PREP_SLASH,   // /
+    PREP_PCT,     // %
+    PREP_LT,      // <
+    PREP_GT,      // >
+    PREP_CIRC,    // ^
+    PREP_OR,      // |
+    PREP_QUEST,   // ?
+    PREP_COLON,   // :
+    PREP_ASGN,    // =
+    PREP_COMMA,   // ,
+    PREP_SHARP,   // #
+    PREP_SEMIC,   // ;
+    PREP_CBRA,    // {
+    PREP_CKET,    // }
+    PREP_ASPLUS,  // +=
+    PREP_ASMINUS, // -=
+    PREP_ASSTAR,  // *=
+    PREP_ASSLASH, // /=
+    PREP_ASPCT,   // %=
+    PREP_ASCIRC,
+    PREP_ASLSH,   // <<=
+    PREP_ASRSH,   // >>=
+    PREP_ASOR,    // |=
+    PREP_ASAND,   // &=
+    PREP_ELLIPS,  // ...
+    PREP_DSHARP1,
+    PREP_NAME1,
+    PREP_DEFINED,
+    PREP_UMINUS,  // unary -
+};
+
+// one token of an output line, spelling points into the preprocessor's own buffers and is not null terminated
+struct prep_token final {
+        prep_tokentype type;
+        unsigned int   wslen; // number of whitespace characters preceding the token, they sit right before spelling
+        unsigned int   len;   // length of the spelling
+        const char*    spelling;
+};
+
+/*
+ * receives every output line as its final token row, after macro expansion, without the trailing newline.
+ * tokens and spellings are only valid for the duration of the call; empty lines are not reported.
+ * filename and line locate the line in the source it came from.
+ */
+using prep_token_sink = void (*)(void* context, const prep_token* tokens, size_t ntokens, const char* filename, int line);
+
+// the phases wall time is attributed to, time spent in a nested phase is only charged to the innermost one
+enum prep_phase : unsigned { // NOLINT(performance-enum-size)
+    PREP_PHASE_OTHER,
+    PREP_PHASE_LEX,       // gettokens()
+    PREP_PHASE_DIRECTIVE, // control lines, except the parts below
+    PREP_PHASE_EVAL,      // #if and #elif expressions, including their macro expansion
+    PREP_PHASE_EXPAND,    // macro expansion of text lines
+    PREP_PHASE_INCLUDE,   // resolving and opening #include files
+    PREP_PHASE_OUTPUT,    // serializing and writing the output
+    PREP_NPHASES
+};
+
+// counters collected during a run, see -stats
+struct prep_stats final {
+        unsigned long long bytes;           // bytes handed to the lexer
+        unsigned long long lines;           // lines lexed
+        unsigned long long tokens;          // tokens produced by the lexer
+        unsigned long long skippedlines;    // lines dropped by false conditionals
+        unsigned long long lookups;         // symbol table lookups
+        unsigned long long chainwalks;      // hash chains searched, by those lookups and by the lexer for names it interns
+        unsigned long long chainsteps;      // hash chain entries visited by those searches
+        unsigned long long filterchecks;    // names tested against the prefilter before a lookup for expansion
+        unsigned long long filterpasses;    // of those, names the prefilter let through
+        unsigned long long filtermisses;    // of those, names the lookup did not find
+        unsigned long long expansions;      // macro expansions
+        unsigned long long hidesets;        // distinct hidesets created
+        unsigned long long hidesetlookups;  // hidesets asked for
+        unsigned long long hidesethits;     // hidesets asked for that already existed
+        unsigned long long includes;        // files entered through #include
+        unsigned long long includefailures; // #include directives that found no file
+        unsigned long long includeprobes;   // candidate paths tried while resolving includes
+        double             phase[PREP_NPHASES]; // wall seconds per phase, only measured when asked for
+        double             total;               // wall seconds of the whole run, only measured when asked for
+};
+
+// a file that lives in memory, #include directives resolve to these before looking at the filesystem
+struct prep_file final {
+        const char* name; // the name as it would appear after the include directories were searched, e.g. "gen/config.h"
+        const char* data;
+        size_t      len;
+};
+
+struct prep_options final {
+        const char*        filename;     // name of the input buffer, used in diagnostics, #line and __FILE__, defaults to "<memory>"
+        const char* const* includedirs;  // -I directories, searched in the given order
+        size_t             nincludedirs;
+        const char* const* defines;      // -D arguments, "NAME" or "NAME=VALUE"
+        size_t             ndefines;
+        const char* const* undefines;    // -U arguments, applied after all the defines
+        size_t             nundefines;
+        const prep_file*   files;        // in-memory headers
+        size_t             nfiles;
+        bool               nolineinfo;   // -P, do not emit #line directives
+        bool               cplusplus;    // -+, recognize // comments
+        prep_token_sink    tokensink;    // when set, lines go here as tokens instead of being serialized into prep_result::output
+        void*              sinkcontext;  // passed back to tokensink
+        bool               timephases;   // fill in prep_stats::phase and prep_stats::total, the counters are always maintained
+};
+
+// everything a run produced, owned by the caller and released with prep_freeresult()
+struct prep_result final {
+        char*      output;        // the preprocessed text, null terminated
+        size_t     outlen;
+        char*      diagnostics;   // warnings and errors, one per line, null terminated
+        size_t     diaglen;
+        char**     dependencies;  // paths of every file entered through #include, in order of inclusion
+        size_t     ndependencies;
+        int        nerrors;       // number of errors (not warnings) reported
+        prep_stats stats;
+};
+
+/*
+ * preprocess len bytes at data with the given options (may be nullptr) and store the outcome in result.
+ * returns the number of errors, a fatal error stops the run but never terminates the calling process.
+ * the symbol table, lexer tables and buffers are kept between calls, so repeated calls are cheap.
+ * not reentrant, calls must not overlap.
+ */
+int preprocess(const char* data, size_t len, const prep_options* options, prep_result* result) noexcept;
+
+void prep_freeresult(prep_result* result) noexcept;
@@ -1,13 +1,42 @@
 #pragma once
+#include <csetjmp>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <io.h>
+    #include <direct.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #ifndef O_BINARY // only windows tells binary files from text
+        #define O_BINARY 0
+    #endif
+#endif
+
+#include <libprep.hpp>
+
+#ifndef _MSC_VER // SAL annotations and calling conventions only mean something to MSVC
+    #define _In_
+    #define _In_opt_
+    #define _In_z_
+    #define _In_reads_(count)
+    #define _Inout_
+    #define _Inout_opt_
+    #define _Out_
+    #define __cdecl
+#endif
+
 static constexpr size_t INPUT_BUFFER_SIZE { 32768 };
+static constexpr size_t WHOLE_FILE_MAX { 0x4000000 }; // larger files stream through the input window, never read whole
+static constexpr size_t STREAM_WINDOW_MAX { 0x400000 }; // the most of a file that is in its input window at once
 static constexpr size_t OUTPUT_BUFFER_SIZE { 4096 };
-static constexpr size_t MAX_MACRO_ARGS { 128 };     // max number arguments to a function like macro
+static constexpr size_t MACRO_ARGS_INLINE { 8 };    // arguments of a macro call kept on the stack before they move to the heap
 static constexpr size_t MAX_INCLUDE_DIRS { 64 };    // max number of include directories (-I)
 static constexpr size_t MAX_NESTED_IF_DEPTH { 32 }; // maximum allowed depth for nesting #if preprocessor directives
+static constexpr int    MAX_EXPANSION_SIZE { 1 << 24 }; // tokens the macro calls being expanded may hold, -max-expansion-size
 
 static constexpr int _UCRT_ALLOC_ERROR { 0xEE }; // an error code to indicate that a UCRT memory allocation routine failed
 
@@ -17,7 +46,7 @@ static constexpr long long EOF { -1 }; // end of file
 #endif
 
 // token kinds recognized as valid inside a macro definition
-enum TKNTYPE : unsigned { // NOLINT(performance-enum-size)
+enum TKNTYPE : unsigned char {
     END,
     UNCLASS,
     NAME,
@@ -115,19 +144,26 @@ enum KWPROPS : unsigned {                                     // NOLINT(performa
     DEFINED_UNCHANGEABLE /* DEFINED_VALUE + UNCHANGEABLE */ = 0x05 // a builtin unchangeable macro
 };
 
+static constexpr int MEMORY_SOURCE { -2 };  // source::fd of a source whose whole contents were handed over in memory
+static constexpr int IO_UNAVAILABLE { -2 }; // loadinclude() could not use io_uring, the files are to be opened as usual
+
 static constexpr size_t EOB { 0xFE };  // sentinel for end of input buffer
 static constexpr size_t EOFC { 0xFD }; // sentinel for end of input file
 static constexpr size_t XPWS { 0x01 }; // token flag: white space to assure token separator
 
 enum { NOT_IN_MACRO, IN_MACRO };
 
+// source::ahead, what -pipeline made of a source
+enum AHEADKIND { NOT_AHEAD, AHEAD_LEXED, AHEAD_TAKEN };
+
 struct token final {
         TKNTYPE        type;
         unsigned char  flag;
         unsigned short hideset;
         unsigned int   wslen;
         unsigned int   len;
-        char*          t;
+        unsigned int   sym; // symbol id of a NAME, 0 when the name was not in the table; its hash while it waits in a -pipeline batch
+        unsigned char* t;
 };
 
 struct token_row final {
@@ -137,124 +173,339 @@ struct token_row final {
         long long max; // number of allocated tokens in the token row
 };
 
+// the arguments of one macro call, every argument is a view of the tokens in the row the call was gathered from
+struct macro_args final {
+        token_row* views;
+        int        max;
+        token_row  inlined[MACRO_ARGS_INLINE];
+};
+
+// an input buffer the text moved out of while tokens of the row being lexed still pointed into it
+struct retired_buffer final {
+        retired_buffer* next;
+        unsigned char*  data;
+};
+
 struct source final {
-        char*          filename; // name of file of the source
-        int            line;     // current line number
-        int            lineinc;  // adjustment for \\n lines
-        unsigned char* inb;      // input buffer
-        unsigned char* inp;      // input pointer
-        unsigned char* inl;      // end of input
-        int            ins;      // input buffer size
-        int            fd;       // input source
-        int            ifdepth;  // conditional nesting in include
-        source*        next;     // stack for #include
+        const char*     filename; // name of file of the source
+        int             line;     // current line number
+        int             lineinc;  // adjustment for \\n lines
+        unsigned char*  inb;      // input buffer
+        unsigned char*  inp;      // input pointer
+        unsigned char*  inl;      // end of input
+        size_t          ins;      // input buffer size
+        size_t          inw;      // the size a grown buffer goes back to
+        int             fd;       // input source
+        int             ifdepth;  // conditional nesting in include
+        size_t          shifted;  // bytes dropped from the buffer ahead of inp, inp - inb + shifted is the offset in the input
+        retired_buffer* retired;  // freed once the row that still needs them is put out
+        int             ahead;    // AHEAD_LEXED on the -pipeline thread, AHEAD_TAKEN where its rows are taken
+        source*         next;     // stack for #include
 };
 
+struct macro_cost;
+struct macro_template;
+
 struct nlist {
-        nlist*         next;
-        unsigned char* name;
-        int            len;
-        token_row*     vp;   // value as macro
-        token_row*     ap;   // list of argument names, if any
-        char           val;  // value as preprocessor name
-        char           flag; // is defined, is pp name
+        nlist*           next;
+        unsigned char*   name;
+        int              len;
+        token_row*       vp;      // value as macro
+        token_row*       ap;      // list of argument names, if any
+        char             val;     // value as preprocessor name
+        char             flag;    // is defined, is pp name
+        bool             varies;  // defined differently by the -config configurations preprocessed together
+        unsigned long    nexpand; // times expanded, for -stats
+        const char*      deffile; // where it was last #defined, for -macro-profile
+        int              defline;
+        macro_cost*      cost;    // -macro-profile figures, allocated on its first expansion while profiling
+        macro_template*  tpl;     // vp compiled for substargs(), function-like macros only
+        unsigned         hash;    // of the name
+        unsigned         sym;     // its index in symbols[]
+        const token_row* inertvp; // the body inert was worked out for, at namefiltergen inertgen
+        unsigned         inertgen;
+        int              inert;   // leading tokens of an expansion the rescan can pass over, no name there may expand
 };
 
-struct include_list {
-        char  deleted;
-        char  always;
-        char* file;
+// what an entry stood for before a #define or #undef replaced it, or stands for in another -config configuration
+struct macro_version final {
+        nlist*      np;
+        token_row*  vp;
+        token_row*  ap;
+        const char* deffile;
+        int         defline;
+        char        flag;
+};
+
+/*
+ * a replacement list or parameter list of a #define, and its text in one block. it is held by the symbol table, the
+ * undo trail and the -config versions that point at it, and freed when the last of them lets it go.
+ */
+struct macro_definition final {
+        token_row      row; // first, so a definition is its row
+        unsigned char* text;
+        unsigned       refs;
+};
+
+enum SLOTKIND : unsigned char {
+    SLOT_TEXT,      // a run of replacement tokens, copied as they are
+    SLOT_ARG,       // a parameter, replaced by its argument, macro expanded unless it is an operand of ##
+    SLOT_STRINGIFY, // # and a parameter, replaced by the argument as a string
+    SLOT_SHARP      // a # not followed by a parameter, an error each time the macro is expanded
+};
+
+struct macro_slot final {
+        SLOTKIND kind;
+        bool     pasted; // SLOT_ARG: a ## follows
+        int      arg;    // the parameter's index, for SLOT_TEXT and SLOT_SHARP the first token's in vp
+        int      count;  // SLOT_TEXT: how many tokens
+};
+
+// a function-like macro's replacement list with the parameters resolved, built by dodefine() or on first use
+struct macro_template final {
+        const token_row* vp; // compiled from, a template for an older definition is rebuilt
+        int              nslots;
+        macro_slot*      slots;
+};
+
+// what -macro-profile charges to a macro
+struct macro_cost final {
+        unsigned long long calls;
+        unsigned long long tokens;     // tokens its replacement lists came to, after substitution and ##
+        int                maxdepth;   // deepest nesting it was expanded at
+        double             time;       // seconds spent in expand() for it, nested expansions included
+        double             selftime;   // the same, nested expansions excluded
+        double             gathertime; // the parts of time spent in gatherargs(), substargs() and doconcat()
+        double             substtime;
+        double             concattime;
 };
 
-template<typename _Ty> [[nodiscard]] static inline _Ty* _new_obj() noexcept { return _checked_malloc(sizeof(_Ty)); }
+struct include_list {
+        char        deleted;
+        char        always;
+        const char* file;
+};
 
-#define quicklook(a, b) (namebit[(a) & 077] & (1 << ((b) & 037)))
-#define quickset(a, b)  namebit[(a) & 077] |= (1 << ((b) & 037))
+// a growable byte buffer, used to collect output and diagnostics in memory
+struct strbuf final {
+        char*  data;
+        size_t len;
+        size_t cap;
+};
 
-extern unsigned long namebit[077 + 1]; //64
+// reads back what putnumber(), putbytes() and putrow() wrote
+struct byte_reader final {
+        const char* p;
+        const char* end;
+        bool        bad; // ran past the end
+};
 
-enum class ERRKIND : unsigned char { WARNING, ERROR, FATAL };
+enum ERRKIND : unsigned char { WARNING, ERROR, FATAL };
 
 #pragma region __FORWARD_DECLARATIONS__
 
 void expandlex(void);
 void fixlex(void);
-void setup(int, char**);
+void setup(int, char**) noexcept;
+void initkeywords(void) noexcept;
+void resetmacros(void) noexcept;
+void definearg(char*, int) noexcept;
+void loaddefines(const char*) noexcept;
+void savedefines(const char*) noexcept;
+void settime(void) noexcept;
+void __cdecl error(ERRKIND, const char*, ...) noexcept;
 
 #define gettokens cpp_gettokens
 int     gettokens(token_row*, int);
-int     comparetokens(token_row*, token_row*);
-source* setsource(char*, int, char*);
-void    unsetsource(void);
+int     lexrow(source*, token_row*, int) noexcept;
+int     comparetokens(token_row*, token_row*) noexcept;
+source* setsource(const char*, int, const char*) noexcept;
+source* setmemsource(const char*, const char*, size_t) noexcept;
+source* setbuffersource(const char*, unsigned char*, size_t) noexcept;
+void    unsetsource(void) noexcept;
 void    puttokens(token_row*);
-void    process(token_row*);
+void    process(token_row*) noexcept;
+void    processinclude(token_row*) noexcept;
+void    processrow(token_row*, int) noexcept;
 
 void           flushout(void);
-int            fillbuf(source*);
-int            trigraph(source*);
-int            foldline(source*);
-nlist*         lookup(token*, int);
-void           control(token_row*);
+void           writeout(const char*, size_t) noexcept;
+void           strbuf_append(strbuf*, const char*, size_t) noexcept;
+void           putnumber(strbuf*, long long) noexcept;
+void           putbytes(strbuf*, const void*, size_t) noexcept;
+void           putrow(strbuf*, const token_row*) noexcept;
+long long      getnumber(byte_reader*) noexcept;
+const char*    getbytes(byte_reader*, size_t*) noexcept;
+token_row*     getrow(byte_reader*) noexcept;
+void           cleardependencies(void) noexcept;
+int            fillbuf(source*, token*, const unsigned char**) noexcept;
+void           readwhole(source*) noexcept;
+int            trigraph(source*, token*, const unsigned char**) noexcept;
+int            foldline(source*, token*, const unsigned char**) noexcept;
+nlist*         lookup(token*, int) noexcept;
+nlist*         findname(const unsigned char*, unsigned, unsigned) noexcept;
+unsigned       hashname(const unsigned char*, unsigned) noexcept;
+void           passallnames(void) noexcept;
+void           control(token_row*) noexcept;
 void           dodefine(token_row*);
 void           doadefine(token_row*, int);
 void           doinclude(token_row*);
 void           doif(token_row*, enum KWTYPE);
-void           expand(token_row*, nlist*, int);
+bool           expand(token_row*, nlist*, int);
 void           builtin(token_row*, int);
-int            gatherargs(token_row*, token_row**, int, int*);
-void           substargs(nlist*, token_row*, token_row**);
-void           expandrow(token_row*, char*, int);
-void           maketokenrow(int, token_row*);
+int            gatherargs(token_row*, macro_args*, int, int*);
+void           expandrow(token_row*, const char*, int);
+void           expansionlabels(strbuf*, const source*) noexcept;
+void           resetexpansion(void) noexcept;
+void           maketokenrow(long long, token_row*) noexcept;
 token_row*     copytokenrow(token_row*, token_row*);
-token*         growtokenrow(token_row*);
+token*         growtokenrow(token_row*) noexcept;
 token_row*     normtokenrow(token_row*);
+token_row*     newdefinition(const token_row*) noexcept;
+token_row*     holddefinition(token_row*) noexcept;
+void           dropdefinition(nlist*, token_row*) noexcept;
+void           normargument(token_row*);
 void           adjustrow(token_row*, int);
 void           movetokenrow(token_row*, token_row*);
 void           insertrow(token_row*, int, token_row*);
-void           peektokens(token_row*, char*);
+void           peektokens(token_row*, const char*);
 void           doconcat(token_row*);
 token_row*     stringify(token_row*);
 int            lookuparg(nlist*, token*);
-long           eval(token_row*, int);
+long           eval(token_row*, int) noexcept;
 void           genline(void);
-void           setempty(token_row*);
+void           setempty(token_row*) noexcept;
 void           makespace(token_row*);
 char*          outnum(char*, int);
 int            digit(int);
-unsigned char* newstring(unsigned char*, int, int);
-int            check_hideset(int, nlist*);
-void           print_hideset(int);
-int            new_hideset(int, nlist*);
-int            unionhideset(int, int);
-void           init_hideset(void);
-void           setobjname(char*);
+unsigned char* newstring(const unsigned char*, size_t, size_t) noexcept;
+unsigned char* linespace(size_t) noexcept;
+void           resetlinespace(void) noexcept;
+bool           check_hideset(int, nlist*) noexcept;
+void           print_hideset(int) noexcept;
+int            new_hideset(int, nlist*) noexcept;
+int            unionhideset(int, int) noexcept;
+void           init_hideset(void) noexcept;
+void           setobjname(const char*);
 void           clearwstab(void);
+void           forallnames(void (*)(nlist*, void*), void*) noexcept;
+void           startstats(void) noexcept;
+void           switchphase(prep_phase) noexcept;
+void           stopstats(void) noexcept;
+void           writestats(FILE*) noexcept;
+void           enterinclude(const source*) noexcept;
+void           leaveinclude(void) noexcept;
+void           writeincludeprofile(FILE*) noexcept;
+double         profileclock(void) noexcept;
+macro_cost*    macrocost(nlist*) noexcept;
+void           writemacroprofile(FILE*) noexcept;
+int            sizeof_hideset(int) noexcept;
+void           changemacro(nlist*) noexcept;
+void           setdefinition(nlist*, token_row*, token_row*) noexcept;
+size_t         savemacros(void) noexcept;
+void           restoremacros(size_t) noexcept;
+void           freemacros(size_t) noexcept;
+int            servedaemon(token_row*) noexcept;
+void           changedmacros(size_t, void (*)(nlist*, void*), void*) noexcept;
+bool           speculateinclude(token_row*) noexcept;
+bool           joinincludes(const token_row*) noexcept;
+void           startprefetch(void) noexcept;
+void           stopprefetch(void) noexcept;
+void           prefetchincludes(const source*, const unsigned char*, const unsigned char*) noexcept;
+unsigned char* sourcebuffer(size_t) noexcept;
+int            loadinclude(const char* const*, int, unsigned char**, size_t*) noexcept;
+void           closeuring(void) noexcept;
+void           startpipeline(source*) noexcept;
+void           stoppipeline(void) noexcept;
+int            takerow(token_row*, int) noexcept;
+void           aheaderror(ERRKIND, const char*) noexcept;
+bool           emitoutput(const char*, size_t) noexcept;
+void           drainoutput(void) noexcept;
+void           addconfig(char*) noexcept;
+void           startconfigs(void) noexcept;
+void           steprow(token_row*, int) noexcept;
+void           gatherline(token_row*) noexcept;
+int            pendingrow(token_row*) noexcept;
+void           finishconfigs(void) noexcept;
+bool           replaycache(void) noexcept;
+void           storecache(void) noexcept;
 
 #pragma endregion
 
 // #define rowlen(tokrow) ((tokrow)->lp - (tokrow)->bp)
 [[nodiscard]] static inline ptrdiff_t tokenrow_len(_In_ const token_row* const tknrow) noexcept { return tknrow->lp - tknrow->bp; }
 
-extern char*        outp;
-extern token        nltoken;
-extern source*      cursource;
-extern char         current_time[];
-extern int          incdepth;
-extern int          ifdepth;
-extern int          ifsatisfied[MAX_NESTED_IF_DEPTH];
-extern int          Mflag;
-extern int          nolineinfo;
-extern int          skipping;
-extern int          verbose;
-extern int          Cplusplus;
-extern nlist*       kwdefined;
-extern include_list includelist[MAX_INCLUDE_DIRS];
-extern char         wd[];
+extern token            nltoken;
+extern source*          cursource;
+extern char             current_time[];
+extern int              incdepth;
+extern int              ifdepth;
+extern int              ifsatisfied[MAX_NESTED_IF_DEPTH];
+extern int              Mflag;
+extern int              nolineinfo;
+extern int              skipping;
+extern int              verbose;
+extern int              Cplusplus;
+extern nlist*           kwdefined;
+extern nlist**          symbols;
+extern include_list     includelist[MAX_INCLUDE_DIRS];
+extern char             wd[];
+extern int              nerrs;
+extern prep_stats       prepstats;
+extern int              statsflag;
+extern prep_phase       curphase;
+extern char*            includeprofile;
+extern int              macroprofile;
+extern double           macronested;
+extern int              macrodepth;
+extern int              maxexpansionsize;
+extern strbuf*          outmemory;
+extern strbuf*          outputcopy;
+extern prep_token_sink  tokensink;
+extern void*            tokensinkcontext;
+extern strbuf*          diagnostics;
+extern strbuf*          diagnosticscopy;
+extern jmp_buf*         fatal_jump;
+extern const prep_file* memfiles;
+extern size_t           nmemfiles;
+extern char**           dependencies;
+extern size_t           ndependencies;
+extern char**           probemisses;
+extern size_t           nprobemisses;
+extern int              daemonflag;
+extern int              specjobs;
+extern int              speculating;
+extern int              prefetchflag;
+extern int              uringflag;
+extern int              pipelineflag;
+extern int              nconfigs;
+extern int              configgroup;
+extern bool             configtouched;
+extern int              pendingrows;
+extern char*            cachedir;
+extern bool             cachehit;
+extern bool             clockread;
+
+extern void (*toplevelinclude)(void) noexcept;
+extern const prep_file* (*filecache)(const char*) noexcept;
+extern void (*namelookup)(const unsigned char*, int) noexcept;
+
+// a Bloom filter over the hashes of the names lookup() installed, two bits each, sized to keep false positives rare
+extern unsigned long long* namefilter;
+extern unsigned            namefiltermask; // bits in the filter, less one
+extern unsigned            namefiltergen;  // bumped whenever a name is added to the filter
+
+// false when no name with the hash h was ever installed, so lookup() would not find it; a token with a symbol id is
+// known to be installed without asking
+[[nodiscard]] static inline bool quicklook(_In_ const unsigned h) noexcept {
+    const unsigned a = h & namefiltermask, b = (h >> 16 | h << 16) * 0x9E3779B1U & namefiltermask;
+    return (namefilter[a >> 6] >> (a & 63) & namefilter[b >> 6] >> (b & 63) & 1) != 0;
+}
 
 [[nodiscard]] static inline void* __cdecl _checked_realloc(_In_ void* const ptr, _In_ const size_t size) noexcept {
     void* _ptr = ::realloc(ptr, size);
     if (!_ptr) {
-        ::fputws(L"memory reallocation failed inside " __FUNCTIONW__ "\n", stderr);
+        ::fprintf(stderr, "memory reallocation failed inside %s\n", __func__);
         std::exit(_UCRT_ALLOC_ERROR);
     }
     return _ptr;
@@ -264,9 +515,52 @@ extern char         wd[];
 template<typename _Ty> [[nodiscard]] static inline _Ty* __cdecl _checked_malloc(_In_ const size_t count) noexcept {
     _Ty* ptr = reinterpret_cast<_Ty*>(::malloc(sizeof(_Ty) * count));
     if (!ptr) {
-        ::fputws(L"memory allocation failed inside " __FUNCTIONW__ "\n", stderr);
+        ::fprintf(stderr, "memory allocation failed inside %s\n", __func__);
         std::exit(_UCRT_ALLOC_ERROR);
     }
     ::memset(ptr, 0U, sizeof(_Ty) * count); // do we really need this??
     return ptr;
 }
+
+template<typename _Ty> [[nodiscard]] static inline _Ty* _new_obj() noexcept { return _checked_malloc<_Ty>(1); }
+
+// charges the wall time from begin() to end() to a phase, costs a branch unless -stats is in effect. a fatal error in
+// library mode longjmp()s past the end(), so the timer has nothing to destroy and resetstate() puts curphase back
+struct phase_timer final {
+        prep_phase saved;
+
+        void begin(_In_ const prep_phase phase) noexcept {
+            saved = curphase;
+            if (statsflag) switchphase(phase);
+        }
+
+        void end(void) noexcept {
+            if (statsflag) switchphase(saved);
+        }
+};
+
+// charges the wall time of one expansion to its macro under -macro-profile, less the time of the expansions nested in it.
+// an expansion may wait on the work stack for its arguments, so it is timed from begin() to end() rather than by scope
+struct macro_timer final {
+        macro_cost* cost;
+        double      start;
+        double      outer; // nested time already collected by the enclosing expansion
+
+        void begin(_In_ nlist* const np) noexcept {
+            cost = macroprofile && !(np->flag & UNCHANGEABLE) ? macrocost(np) : nullptr; /* not defined standing for itself */
+            if (!cost) return;
+            start       = profileclock();
+            outer       = macronested;
+            macronested = 0;
+            macrodepth++;
+        }
+
+        void end(void) noexcept {
+            if (!cost) return;
+            const double inclusive  = profileclock() - start;
+            cost->time             += inclusive;
+            cost->selftime         += inclusive - macronested;
+            macronested             = outer + inclusive;
+            macrodepth--;
+        }
+};
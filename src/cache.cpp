@@ -0,0 +1,365 @@
+#include <ctime>
+
+#include <prep.hpp>
+
+#ifdef _WIN32
+    #include <process.h>
+    #define getpid _getpid
+#endif
+
+/*
+ * -cache dir, keeps the output of a translation unit in dir and hands it back without preprocessing when the same unit
+ * comes again. the unit key hashes the main file, the directory it is preprocessed from, the include path, the flags
+ * that change the output and every definition in effect once the options are read. which headers a run reads only
+ * shows once it has run, so dir/<unit key>.manifest lists, for every output kept for the unit, the contents of the
+ * headers it read and the paths an #include looked under and did not find its file, which must still be missing; the
+ * output and its diagnostics are in dir/<output key>.out, the output key hashing the unit key and all of that.
+ * a run that expands __DATE__ or __TIME__ is only kept when SOURCE_DATE_EPOCH fixes the time, and its entry holds the
+ * time it used. a run with errors is not kept, nor is one that reads a file changed since it started, which it may have
+ * read half old. the hash keeps apart what differs by accident, it is no defense against whoever can write to dir.
+ * outputs a manifest has let go of stay in dir until they are removed by hand. on a hit -stats says so and counts
+ * nothing, the profiles come out empty.
+ */
+
+static constexpr char   CACHE_MAGIC[] { "PREPCACHE1" };
+static constexpr size_t CACHE_MAGIC_LEN { sizeof(CACHE_MAGIC) - 1 };
+static constexpr size_t CACHE_ENTRIES_MAX { 16 };  // outputs a manifest keeps for its unit, the oldest go first
+static constexpr size_t CACHE_HASH_SLOTS { 1024 }; // hash chains of the headers hashed while a manifest is checked
+
+char* cachedir {};
+bool  cachehit {}; // the output was replayed, nothing was preprocessed
+
+struct cache_hash final {
+        unsigned long long a;
+        unsigned long long b;
+};
+
+// a header hashed while a manifest is checked, or while an entry is made
+struct hashed_file final {
+        hashed_file* next;
+        char*        path;
+        char         key[33]; // of its contents, empty when it cannot be read
+        bool         fresh;   // unchanged since the run started
+        bool         listed;  // in the entry being made, which names a header once however often it was read
+};
+
+static cache_hash   unit {};
+static bool         cacheable {}; // the run may be kept, once it turns out to be without errors
+static time_t       started {};
+static strbuf       output {}, messages {};
+static hashed_file* hashed[CACHE_HASH_SLOTS];
+
+static void mixword(_Inout_ cache_hash* const h, _In_ const unsigned long long w) noexcept {
+    h->a  = (h->a ^ w) * 0x9E3779B97F4A7C15ULL;
+    h->a ^= h->a >> 32;
+    h->b  = (h->b ^ (w + h->a)) * 0xD6E8FEB86659FD93ULL;
+    h->b ^= h->b >> 29;
+}
+
+// hashes len and then the bytes, so fields that run together cannot be taken for each other
+static void hashbytes(_Inout_ cache_hash* const h, _In_reads_(len) const void* const data, _In_ size_t len) noexcept {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    unsigned long long   w {};
+
+    mixword(h, len);
+    for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+        ::memcpy(&w, p, sizeof(w));
+        mixword(h, w);
+    }
+    if (!len) return;
+    w = 0;
+    ::memcpy(&w, p, len);
+    mixword(h, w);
+}
+
+static void hashstring(_Inout_ cache_hash* const h, _In_opt_ const char* const s) noexcept { hashbytes(h, s ? s : "", s ? ::strlen(s) + 1 : 0); }
+
+static void hashkey(_In_ const cache_hash* const h, _Out_ char* const key) noexcept {
+    ::snprintf(key, 33, "%016llx%016llx", h->a ^ (h->b >> 31), h->b ^ (h->a >> 17));
+}
+
+static void hashrow(_Inout_ cache_hash* const h, _In_opt_ const token_row* const trp) noexcept {
+    if (!trp) {
+        mixword(h, 0);
+        return;
+    }
+    mixword(h, trp->lp - trp->bp);
+    for (const token* tp = trp->bp; tp < trp->lp; tp++) {
+        mixword(h, static_cast<unsigned long long>(tp->type) << 1 | (tp->wslen != 0));
+        hashbytes(h, tp->t, tp->len);
+    }
+}
+
+// for forallnames(), a definition in effect once the options are read
+static void hashdefinition(_In_ nlist* const np, _Inout_ void* const context) noexcept {
+    cache_hash* const h = reinterpret_cast<cache_hash*>(context);
+
+    if (!(np->flag & DEFINED_VALUE)) return;
+    hashbytes(h, np->name, np->len);
+    mixword(h, static_cast<unsigned char>(np->flag));
+    hashrow(h, np->vp);
+    hashrow(h, np->ap);
+}
+
+// the contents of the file at path, nullptr when it cannot be read; fresh tells whether it is older than the run
+static unsigned char* readfile(_In_z_ const char* const path, _Out_ size_t* const len, _Out_ bool* const fresh) noexcept {
+    struct stat    st {};
+    const int      fd = open(path, O_RDONLY | O_BINARY);
+    unsigned char* data;
+    long long      n {}, got {};
+
+    *len = 0;
+    if (fd < 0) return nullptr;
+    if (::fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    data = _checked_malloc<unsigned char>(st.st_size + 1);
+    while (got < st.st_size && (n = read(fd, data + got, static_cast<unsigned>(st.st_size - got))) > 0) got += n;
+    close(fd);
+    *len = static_cast<size_t>(got);
+    if (fresh) *fresh = st.st_mtime < started;
+    return data;
+}
+
+// writes the parts to path through a file of its own next to it, so a reader never sees half of it
+static bool writefile(_In_z_ const char* const path, _In_ const strbuf* const* const parts, _In_ const int nparts) noexcept {
+    char      tmp[1024];
+    bool      ok { true };
+    long long n {};
+    int       fd;
+
+    if (::snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, static_cast<int>(getpid())) >= static_cast<int>(sizeof(tmp))) return false;
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0) return false;
+    for (int i = 0; ok && i < nparts; i++)
+        for (size_t done = 0; ok && done < parts[i]->len; done += static_cast<size_t>(n))
+            ok = (n = ::write(fd, parts[i]->data + done, static_cast<unsigned>(parts[i]->len - done))) > 0;
+    close(fd);
+#ifdef _WIN32
+    if (ok) ::remove(path); /* rename() does not replace a file there */
+#endif
+    if (ok && ::rename(tmp, path) == 0) return true;
+    ::remove(tmp);
+    return false;
+}
+
+static void cachepath(_Out_ char* const path, _In_ const size_t size, _In_z_ const char* const key, _In_z_ const char* const suffix) noexcept {
+    ::snprintf(path, size, "%s/%s.%s", cachedir, key, suffix);
+}
+
+// the key of the contents of the header at path, hashed once however many entries name it
+static hashed_file* hashfile(_In_z_ const char* const path) noexcept {
+    size_t h { 5381 };
+
+    for (const char* p = path; *p; p++) h = h * 33 + static_cast<unsigned char>(*p);
+    h %= CACHE_HASH_SLOTS;
+    for (hashed_file* f = hashed[h]; f; f = f->next)
+        if (::strcmp(f->path, path) == 0) return f;
+    hashed_file* const f = _new_obj<hashed_file>();
+    size_t             len {};
+    unsigned char*     data = readfile(path, &len, &f->fresh);
+    f->path                 = ::strdup(path);
+    f->next                 = hashed[h];
+    hashed[h]               = f;
+    if (data) {
+        cache_hash contents { 0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL };
+        hashbytes(&contents, data, len);
+        hashkey(&contents, f->key);
+        free(data);
+    }
+    return f;
+}
+
+// a manifest line, the word and its operands
+static void addline(_Inout_ strbuf* const buf, _In_z_ const char* const word, _In_z_ const char* const a, _In_opt_ const char* const b) noexcept {
+    strbuf_append(buf, word, ::strlen(word));
+    strbuf_append(buf, " ", 1);
+    strbuf_append(buf, a, ::strlen(a));
+    if (b) {
+        strbuf_append(buf, " ", 1);
+        strbuf_append(buf, b, ::strlen(b));
+    }
+    strbuf_append(buf, "\n", 1);
+}
+
+static bool missing(_In_z_ const char* const path) noexcept {
+    struct stat st {};
+
+    return ::stat(path, &st) != 0;
+}
+
+// writes out the output and the diagnostics kept in the file at path, false when it is not there or not whole
+static bool replay(_In_z_ const char* const path) noexcept {
+    size_t               len {}, outlen {}, diaglen {};
+    unsigned char* const data = readfile(path, &len, nullptr);
+    const char*          p;
+    char*                end {};
+    long long            n {};
+
+    if (!data) return false;
+    p = reinterpret_cast<const char*>(data);
+    if (len < CACHE_MAGIC_LEN + 1 || ::memcmp(p, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0 || !::memchr(p, '\n', len)) {
+        free(data);
+        return false;
+    }
+    outlen              = ::strtoull(p + CACHE_MAGIC_LEN, &end, 10);
+    diaglen             = ::strtoull(end, &end, 10);
+    const size_t header = static_cast<size_t>(end - p) + 1;
+    if (*end != '\n' || header + outlen + diaglen != len) {
+        free(data);
+        return false;
+    }
+    for (size_t done = 0; done < outlen; done += static_cast<size_t>(n))
+        if ((n = ::write(1, p + header + done, static_cast<unsigned>(outlen - done))) <= 0) error(FATAL, "Can't write the output");
+    ::fwrite(p + header + outlen, sizeof(char), diaglen, stderr);
+    ::fflush(stderr);
+    free(data);
+    return true;
+}
+
+/*
+ * looks the unit up once the options are read, and writes out what an earlier run of it put out, true then. on a miss
+ * the run keeps a copy of what it puts out for storecache().
+ */
+bool replaycache(void) noexcept {
+    char           path[1024], key[33];
+    size_t         len {};
+    unsigned char* data;
+    const char*    entry {}; // the output key of the entry being checked, nullptr once it does not match
+    bool           fresh {};
+
+    if (cursource->fd <= 0) return false; /* stdin cannot be read twice */
+    started = ::time(nullptr);
+#ifdef _WIN32
+    ::_mkdir(cachedir);
+#else
+    ::mkdir(cachedir, 0777);
+#endif
+    if (!(data = readfile(cursource->filename, &len, &fresh))) return false;
+    unit = { 0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL };
+    hashstring(&unit, CACHE_MAGIC);
+    hashstring(&unit, wd);
+    hashstring(&unit, cursource->filename);
+    mixword(&unit, static_cast<unsigned long long>(Cplusplus) << 32 | static_cast<unsigned>(nolineinfo));
+    mixword(&unit, static_cast<unsigned long long>(verbose));
+    for (size_t i = 0; i < MAX_INCLUDE_DIRS; i++) {
+        hashstring(&unit, includelist[i].file);
+        mixword(&unit, static_cast<unsigned long long>(includelist[i].always) << 1 | (includelist[i].deleted != 0));
+    }
+    forallnames(hashdefinition, &unit);
+    hashbytes(&unit, data, len);
+    free(data);
+    hashkey(&unit, key);
+    cachepath(path, sizeof(path), key, "manifest");
+
+    cacheable       = fresh;
+    outputcopy      = &output;
+    diagnosticscopy = &messages;
+    if (!(data = readfile(path, &len, nullptr))) return false;
+    char* const text = reinterpret_cast<char*>(data);
+    text[len]        = '\0'; /* readfile() left room */
+    if (len < CACHE_MAGIC_LEN || ::memcmp(text, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0) {
+        free(data);
+        return false;
+    }
+    for (char *line = text, *nl; (nl = ::strchr(line, '\n')) != nullptr; line = nl + 1) {
+        *nl = '\0';
+        if (::strncmp(line, "output ", 7) == 0)
+            entry = line + 7;
+        else if (!entry)
+            continue;
+        else if (::strncmp(line, "time ", 5) == 0) {
+            if (::strncmp(current_time, line + 5, ::strlen(line + 5)) != 0) entry = nullptr;
+        } else if (::strncmp(line, "missing ", 8) == 0) {
+            if (!missing(line + 8)) entry = nullptr;
+        } else if (::strncmp(line, "header ", 7) == 0) {
+            const hashed_file* const f = nl - line > 40 && line[39] == ' ' ? hashfile(line + 40) : nullptr;
+            if (!f || !f->key[0] || ::strncmp(f->key, line + 7, 32) != 0) entry = nullptr;
+        } else if (::strcmp(line, "end") == 0) {
+            cachepath(path, sizeof(path), entry, "out");
+            entry = nullptr;
+            if (replay(path)) {
+                free(data);
+                outputcopy = diagnosticscopy = nullptr;
+                return cachehit = true;
+            }
+        }
+    }
+    free(data);
+    return false;
+}
+
+// keeps what the run put out, under the headers it read, when the run can be repeated from them
+void storecache(void) noexcept {
+    char          path[1024], key[33], unitkey[33], sizes[64];
+    strbuf        entry {}, manifest {}, header {};
+    size_t        len {};
+    cache_hash    out = unit;
+    const strbuf* parts[3] { &header, &output, &messages };
+
+    outputcopy = diagnosticscopy = nullptr;
+    if (!cacheable || nerrs) return;
+    if (clockread && !::getenv("SOURCE_DATE_EPOCH")) return; /* it holds the time it ran at */
+    for (size_t i = 0; i < ndependencies; i++)
+        if (::strchr(dependencies[i], '\n')) return;
+    for (size_t i = 0; i < nprobemisses; i++)
+        if (::strchr(probemisses[i], '\n')) return;
+
+    if (clockread) {
+        strbuf_append(&entry, "time ", 5);
+        strbuf_append(&entry, current_time, 24);
+        strbuf_append(&entry, "\n", 1);
+        hashbytes(&out, current_time, 24);
+    }
+    for (size_t i = 0; i < nprobemisses; i++) {
+        addline(&entry, "missing", probemisses[i], nullptr);
+        hashstring(&out, probemisses[i]);
+    }
+    for (size_t i = 0; i < ndependencies; i++) {
+        hashed_file* const f = hashfile(dependencies[i]);
+        if (!f->key[0] || !f->fresh) { /* gone, or changed while the run may have been reading it */
+            free(entry.data);
+            return;
+        }
+        if (f->listed) continue;
+        f->listed = true;
+        addline(&entry, "header", f->key, dependencies[i]);
+        hashstring(&out, f->key);
+        hashstring(&out, dependencies[i]);
+    }
+    strbuf_append(&entry, "end\n", 4);
+    hashkey(&out, key);
+    hashkey(&unit, unitkey);
+
+    ::snprintf(sizes, sizeof(sizes), "%s %zu %zu\n", CACHE_MAGIC, output.len, messages.len);
+    strbuf_append(&header, sizes, ::strlen(sizes));
+    cachepath(path, sizeof(path), key, "out");
+    if (!writefile(path, parts, 3)) {
+        free(entry.data);
+        free(header.data);
+        return;
+    }
+
+    /* the entries kept for the unit so far, the newest last, make way for this one */
+    cachepath(path, sizeof(path), unitkey, "manifest");
+    unsigned char* const data = readfile(path, &len, nullptr);
+    strbuf_append(&manifest, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    strbuf_append(&manifest, "\n", 1);
+    if (data && len > CACHE_MAGIC_LEN && ::memcmp(data, CACHE_MAGIC, CACHE_MAGIC_LEN) == 0 && data[CACHE_MAGIC_LEN] == '\n' && data[len - 1] == '\n') {
+        const char* kept = reinterpret_cast<char*>(data) + CACHE_MAGIC_LEN + 1;
+        size_t      n {};
+        data[len]        = '\0';
+        for (const char* p = kept; *p; p = ::strchr(p, '\n') + 1) n += ::strncmp(p, "output ", 7) == 0;
+        for (; *kept; kept = ::strchr(kept, '\n') + 1)
+            if (::strncmp(kept, "output ", 7) == 0 && n-- < CACHE_ENTRIES_MAX) break;
+        strbuf_append(&manifest, kept, ::strlen(kept));
+    }
+    addline(&manifest, "output", key, nullptr);
+    strbuf_append(&manifest, entry.data, entry.len);
+    const strbuf* const whole[1] { &manifest };
+    writefile(path, whole, 1);
+    free(data);
+    free(entry.data);
+    free(manifest.data);
+    free(header.data);
+}
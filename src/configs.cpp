@@ -0,0 +1,668 @@
+#include <prep.hpp>
+
+/*
+ * -config output=defines, preprocesses the input once for several configurations, each of them the -D, -U and
+ * -defines-file options in effect plus a -defines-file of its own, and writes what each makes of it to its own output.
+ * the configurations read the input together. the symbol table holds the definitions of the first of them, the leader,
+ * and every other one keeps only where its definitions differ, on names marked as varying. a row that looks up none of
+ * those is done once for all of them. one that does, and every row while their #if states differ, is done again for
+ * each of the others, with its definitions swapped in on the undo trail and its own #if state, and its output goes to
+ * that configuration alone; as soon as their #if states agree again, e.g. at the #endif, they share rows again. only
+ * where they would go on to read different input, at an #include some of them skip or one that names a macro, or after
+ * a macro call that takes in more or fewer lines for them, do they part for good: the ones that go another way carry on
+ * in a process forked for them, as -j forks its workers.
+ */
+
+static constexpr size_t CONFIG_OUTPUT_CHUNK { 0x10000 }; // output kept back for a configuration before it is written
+
+int  nconfigs {};
+int  configgroup {};   // configurations this process preprocesses, members[0] is the leader
+bool configtouched {}; // lookup() found a name that varies
+int  pendingrows {};   // lines a row took in for the leader that the configurations here still have to do, see keeplines()
+
+// the #if state a row leaves behind, and where it leaves the input
+struct row_state final {
+        int         skipping;
+        int         ifdepth;
+        int         srcifdepth; // cursource->ifdepth
+        int         line;
+        int         lineinc;
+        const char* filename;
+        int         consumed; // lines gatherline() took into the row
+        int         ifsatisfied[MAX_NESTED_IF_DEPTH];
+};
+
+struct version_list final {
+        macro_version* v;
+        size_t         n;
+        size_t         max;
+};
+
+struct configuration final {
+        const char*  output;
+        const char*  defines;
+        int          fd;
+        strbuf       out;    // its output not yet written, all of it from before what is in sharedout
+        strbuf       rowout; // what it made of the row just done again for it
+        version_list delta;  // where its definitions differ from the symbol table's, which are the leader's
+        version_list after;  // what it had for the names the row changed, once the row was done for it
+        row_state    state;  // its #if state while that differs from the leader's, and where a row left it
+        bool         gone;   // went on in a process of its own in the middle of a row
+};
+
+// a line gatherline() took in for the leader
+struct gathered_line final {
+        ptrdiff_t end;     // in gathered, past its last token
+        int       lineinc; // cursource->lineinc once it was read
+};
+
+static configuration* configs {};
+static int*           members {};
+static int*           parting {};   // the members that part from the others, see forkmembers()
+static bool           parted {};    // the #if state of some member differs from the leader's
+static strbuf         sharedout {}; // output every member gets
+static row_state      rowstart {};  // the leader's, before the row
+static token_row      rowcopy {}, replay {}, gathered {};
+static gathered_line* lines {};
+static int            nlines {}, maxlines {};
+static version_list   changed {}, previous {}, scratch {}; // what the leader's row changed, as it left them and before
+static int            replaying { -1 }; // the configuration the row is being done again for
+static int            served {};        // lines of gathered handed to it
+static bool           abandoned {};     // it went on in a forked process, the rest of the row here goes nowhere
+static bool           alone {};         // this is that process
+static strbuf         abandoneddiag {};
+static strbuf*        keptdiag {};
+static int            keptnerrs {};
+static token_row      pending {}; // copies of the lines for pendingrow(), the text in pendingtext
+static source*        pendingsource {};
+static unsigned char* pendingtext {};
+static gathered_line* pendinglines {}; // their lineinc is what each one adds
+static int            npending {};
+static long long*     children {};
+static int            nchildren {};
+static bool           forked {}; // this process was forked for some of the configurations
+
+// -config output=defines
+void addconfig(_In_z_ char* const arg) noexcept {
+    char* const eq = ::strchr(arg, '=');
+
+    if (!eq || eq == arg || !eq[1]) error(FATAL, "Option -config takes output=defines-file, not %s", arg);
+    *eq      = '\0';
+    configs  = reinterpret_cast<configuration*>(_checked_realloc(configs, (nconfigs + 1) * sizeof(configuration)));
+    ::memset(&configs[nconfigs], 0, sizeof(configuration));
+    configs[nconfigs].output  = arg;
+    configs[nconfigs].defines = eq + 1;
+    configs[nconfigs++].fd    = -1;
+}
+
+static macro_version* findversion(_In_ const version_list* const list, _In_ const nlist* const np) noexcept {
+    for (size_t i = 0; i < list->n; i++)
+        if (list->v[i].np == np) return &list->v[i];
+    return nullptr;
+}
+
+// the list holds the definitions of its versions
+static void pushversion(_Inout_ version_list* const list, _In_ const macro_version* const v) noexcept {
+    if (list->n == list->max) {
+        list->max = list->max ? 2 * list->max : 16;
+        list->v   = reinterpret_cast<macro_version*>(_checked_realloc(list->v, list->max * sizeof(macro_version)));
+    }
+    list->v[list->n] = *v;
+    holddefinition(list->v[list->n].vp);
+    holddefinition(list->v[list->n++].ap);
+}
+
+static void dropversion(_In_ const macro_version* const v) noexcept {
+    dropdefinition(v->np, v->vp);
+    dropdefinition(v->np, v->ap);
+}
+
+static void clearversions(_Inout_ version_list* const list) noexcept {
+    for (size_t i = 0; i < list->n; i++) dropversion(&list->v[i]);
+    list->n = 0;
+}
+
+// adds np as it is now, once, for changedmacros()
+static void keepversion(_In_ nlist* const np, _Inout_ void* const context) noexcept {
+    version_list* const list = reinterpret_cast<version_list*>(context);
+    const macro_version v { np, np->vp, np->ap, np->deffile, np->defline, np->flag };
+
+    if (!findversion(list, np)) pushversion(list, &v);
+}
+
+static void setversion(_In_ const macro_version* const v) noexcept {
+    nlist* const np = v->np;
+
+    changemacro(np);
+    setdefinition(np, v->vp, v->ap);
+    np->deffile = v->deffile;
+    np->defline = v->defline;
+    np->flag    = v->flag;
+}
+
+static bool samerow(_In_opt_ token_row* const a, _In_opt_ token_row* const b) noexcept { return a == b || (a && b && comparetokens(a, b) == 0); }
+
+// whether v defines its name the way the symbol table does
+static bool sameversion(_In_ const macro_version* const v) noexcept {
+    const nlist* const np = v->np;
+
+    if (v->flag != np->flag) return false;
+    return !(v->flag & DEFINED_VALUE) || (samerow(v->vp, np->vp) && samerow(v->ap, np->ap));
+}
+
+static void markvarying(_In_ const bool varies) noexcept {
+    for (int i = 1; i < configgroup; i++) {
+        const version_list* const delta = &configs[members[i]].delta;
+        for (size_t j = 0; j < delta->n; j++) delta->v[j].np->varies = varies;
+    }
+}
+
+// makes lead the leader: its definitions go into the symbol table, the other members' are kept against those
+static void rebase(_In_ const int lead) noexcept {
+    version_list* const delta = &configs[lead].delta;
+
+    for (int i = 0; i < configgroup; i++) {
+        version_list* const other = &configs[members[i]].delta;
+        if (members[i] == lead) continue;
+        for (size_t j = 0; j < delta->n; j++) /* it had what the table has now */
+            if (!findversion(other, delta->v[j].np)) keepversion(delta->v[j].np, other);
+    }
+    for (size_t j = 0; j < delta->n; j++) setversion(&delta->v[j]);
+    clearversions(delta);
+    for (int i = 0; i < configgroup; i++) {
+        version_list* const other = &configs[members[i]].delta;
+        size_t              kept {};
+        for (size_t j = 0; j < other->n; j++)
+            if (!sameversion(&other->v[j]))
+                other->v[kept++] = other->v[j];
+            else
+                dropversion(&other->v[j]);
+        other->n = kept;
+    }
+}
+
+static void savestate(_Out_ row_state* const st) noexcept {
+    st->skipping   = skipping;
+    st->ifdepth    = ifdepth;
+    st->srcifdepth = cursource->ifdepth;
+    st->line       = cursource->line;
+    st->lineinc    = cursource->lineinc;
+    st->filename   = cursource->filename;
+    st->consumed   = 0;
+    ::memcpy(st->ifsatisfied, ifsatisfied, (ifdepth + 1) * sizeof(int));
+}
+
+static void loadstate(_In_ const row_state* const st) noexcept {
+    skipping            = st->skipping;
+    ifdepth             = st->ifdepth;
+    cursource->ifdepth  = st->srcifdepth;
+    cursource->line     = st->line;
+    cursource->lineinc  = st->lineinc;
+    cursource->filename = st->filename;
+    ::memcpy(ifsatisfied, st->ifsatisfied, (st->ifdepth + 1) * sizeof(int));
+}
+
+static bool sameifs(_In_ const row_state* const a, _In_ const row_state* const b) noexcept {
+    return a->skipping == b->skipping && a->ifdepth == b->ifdepth && ::memcmp(a->ifsatisfied, b->ifsatisfied, (a->ifdepth + 1) * sizeof(int)) == 0;
+}
+
+// whether a and b go on reading the input at the same place
+static bool samestream(_In_ const row_state* const a, _In_ const row_state* const b) noexcept {
+    return a->ifdepth == b->ifdepth && a->srcifdepth == b->srcifdepth && a->line == b->line && a->lineinc == b->lineinc &&
+           a->consumed == b->consumed && ::strcmp(a->filename, b->filename) == 0;
+}
+
+// the state configuration c starts the row in, the leader's but for its own #if state; st may be its own state
+static void startstate(_In_ const int c, _Inout_ row_state* const st) noexcept {
+    const row_state* const from  = parted && c != members[0] ? &configs[c].state : &rowstart;
+    const int              skips = from->skipping;
+
+    ::memmove(st->ifsatisfied, from->ifsatisfied, (rowstart.ifdepth + 1) * sizeof(int));
+    ::memcpy(st, &rowstart, offsetof(row_state, ifsatisfied));
+    st->skipping = skips;
+}
+
+static void findparted(void) noexcept {
+    parted = false;
+    for (int i = 1; i < configgroup && !parted; i++) parted = !sameifs(&configs[members[i]].state, &configs[members[0]].state);
+}
+
+static void writeall(_In_ const configuration* const cf, _In_reads_(len) const char* p, _In_ size_t len) noexcept {
+    long long n {};
+
+    for (; len; p += n, len -= static_cast<size_t>(n))
+        if ((n = ::write(cf->fd, p, static_cast<unsigned>(len))) <= 0) error(FATAL, "Can't write output file %s", cf->output);
+}
+
+// writes the output of every member
+static void writeshared(void) noexcept {
+    for (int i = 0; i < configgroup; i++) {
+        configuration* const cf = &configs[members[i]];
+        writeall(cf, cf->out.data, cf->out.len);
+        writeall(cf, sharedout.data, sharedout.len);
+        cf->out.len = 0;
+    }
+    sharedout.len = 0;
+}
+
+// hands every member its copy of the shared output, before output that is its own
+static void shareout(void) noexcept {
+    for (int i = 0; i < configgroup; i++) strbuf_append(&configs[members[i]].out, sharedout.data, sharedout.len);
+    sharedout.len = 0;
+}
+
+// the configuration is not this process's to write any more
+static void leave(_Inout_ configuration* const cf) noexcept {
+    if (cf->fd >= 0) close(cf->fd);
+    cf->fd = -1;
+    free(cf->out.data);
+    cf->out = {};
+    clearversions(&cf->delta);
+}
+
+static void appendtokens(_Inout_ token_row* const trp, _In_ const token* const from, _In_ const token* const to) noexcept {
+    if (from == to) return;
+    while (trp->lp + (to - from) > trp->bp + trp->max) growtokenrow(trp);
+    ::memcpy(trp->lp, from, (to - from) * sizeof(token));
+    trp->lp += to - from;
+}
+
+/*
+ * copies of the lines the leader's row took in from first on, which the configurations here have yet to do as rows of
+ * their own, ahead of any kept before that are still to come.
+ */
+static void keeplines(_In_ const int first) noexcept {
+    const ptrdiff_t base = first ? lines[first - 1].end : 0;
+    const ptrdiff_t rest = npending - pendingrows ? pendinglines[npending - pendingrows - 1].end : 0;
+    const int       n    = nlines - first;
+    gathered_line*  kept = _checked_malloc<gathered_line>(n + pendingrows);
+    token_row       row {};
+    size_t          text {};
+    unsigned char*  p;
+
+    appendtokens(&row, gathered.bp + base, gathered.bp + lines[nlines - 1].end);
+    appendtokens(&row, pending.bp + rest, pending.lp);
+    for (const token* tp = row.bp; tp < row.lp; tp++) text += tp->wslen + tp->len;
+    p = _checked_malloc<unsigned char>(text + 1);
+    for (token* tp = row.bp; tp < row.lp; tp++) { /* the blanks before a token are put out with it */
+        ::memcpy(p, tp->t - tp->wslen, tp->wslen + tp->len);
+        tp->t  = p + tp->wslen;
+        p     += tp->wslen + tp->len;
+    }
+    for (int i = first; i < nlines; i++) kept[i - first] = { lines[i].end - base, lines[i].lineinc - (i ? lines[i - 1].lineinc : rowstart.lineinc) };
+    for (int i = 0; i < pendingrows; i++) {
+        const gathered_line* const line = &pendinglines[npending - pendingrows + i];
+        kept[n + i]                     = { line->end - rest + lines[nlines - 1].end - base, line->lineinc };
+    }
+    free(pending.bp);
+    free(pendingtext);
+    free(pendinglines);
+    pending       = row;
+    pendingtext   = p - text;
+    pendinglines  = kept;
+    pendingsource = cursource;
+    npending = pendingrows = n + pendingrows;
+}
+
+// the next kept line, appended to trp, what it adds to cursource->lineinc is left to the caller
+static int takeline(_Inout_ token_row* const trp) noexcept {
+    const int i = npending - pendingrows--;
+
+    appendtokens(trp, pending.bp + (i ? pendinglines[i - 1].end : 0), pending.bp + pendinglines[i].end);
+    return pendinglines[i].lineinc;
+}
+
+// processrows() reads the kept lines before the rest of the source they came from
+int pendingrow(_Inout_ token_row* const trp) noexcept {
+    if (cursource != pendingsource) return gettokens(trp, 1);
+    cursource->lineinc = takeline(trp);
+    return 1;
+}
+
+#ifdef _WIN32
+
+// there is no fork() to part the configurations with
+static bool forkoff(void) noexcept {
+    error(FATAL, "The -config configurations part ways here, which takes fork()");
+    return false;
+}
+
+#else
+
+    #include <sys/wait.h>
+
+// forks a process for configurations that go their own way, true in it
+static bool forkoff(void) noexcept {
+    for (source* s = cursource; s; s = s->next) readwhole(s); /* neither may read what the other is to */
+    ::fflush(stderr);
+    const pid_t pid = ::fork();
+    if (pid < 0) error(FATAL, "Can't fork a process for -config");
+    if (pid == 0) {
+        nchildren    = 0;
+        forked       = true;
+        prefetchflag = 0; /* the prefetch thread was not forked along, its lock may be held for good */
+        closeuring();
+        return true;
+    }
+    children              = reinterpret_cast<long long*>(_checked_realloc(children, (nchildren + 1) * sizeof(long long)));
+    children[nchildren++] = pid;
+    return false;
+}
+
+#endif
+
+/*
+ * the members in part, in the order of members, carry on in a process of their own from the state each one's row left
+ * it in, and the others here. true in the new process.
+ */
+static bool forkmembers(_In_reads_(npart) const int* const part, _In_ const int npart) noexcept {
+    int kept {};
+
+    flushout();
+    shareout();
+    markvarying(false);
+    const bool child = forkoff();
+    for (int i = 0, j = 0; i < configgroup; i++) {
+        for (j = 0; j < npart && part[j] != members[i]; j++);
+        if ((j < npart) == child)
+            members[kept++] = members[i];
+        else
+            leave(&configs[members[i]]);
+    }
+    configgroup = kept;
+    if (child) {
+        const row_state* const st = &configs[members[0]].state;
+        rebase(members[0]);
+        loadstate(st);
+        if (st->consumed < nlines) keeplines(st->consumed);
+    }
+    findparted();
+    markvarying(true);
+    return child;
+}
+
+// an #include row, from the # on
+static bool includerow(_In_ const token_row* const trp) noexcept {
+    const token* const tp = trp->tp;
+
+    return trp->lp - tp > 2 && tp[1].type == NAME && tp[1].len == 7 && ::strncmp(reinterpret_cast<const char*>(tp[1].t), "include", 7) == 0;
+}
+
+/*
+ * the members that do an #include read the file next, those that skip it the line after, so the ones that do what the
+ * leader does not go on elsewhere. when the file is named by a macro, each member may find another one.
+ */
+static void partinclude(_In_ const token_row* const trp) noexcept {
+    row_state here;
+    int       n {};
+
+    savestate(&here);
+    rowstart = here;
+    nlines   = 0;
+    for (int i = 1; i < configgroup; i++) startstate(members[i], &configs[members[i]].state);
+    configs[members[0]].state = here;
+    for (int i = 1; i < configgroup; i++)
+        if ((configs[members[i]].state.skipping == 0) != (skipping == 0)) parting[n++] = members[i];
+    if (n) forkmembers(parting, n); /* on either side, they all do it or all skip it now */
+    if (skipping || trp->tp[2].type == STRING || trp->tp[2].type == LT) return;
+    while (configgroup > 1) {
+        parting[0] = members[configgroup - 1];
+        if (forkmembers(parting, 1)) return;
+    }
+}
+
+// this process takes configuration c on alone, from the middle of the row being done for it, e.g. in gatherline()
+static bool goalone(_In_ const int c) noexcept {
+    flushout();
+    markvarying(false);
+    if (!forkoff()) {
+        abandoned   = true; /* what is left of the row is for nothing, so are its diagnostics */
+        keptdiag    = diagnostics;
+        keptnerrs   = nerrs;
+        diagnostics = &abandoneddiag;
+        markvarying(true);
+        return false;
+    }
+    for (int i = 0; i < configgroup; i++)
+        if (members[i] != c) leave(&configs[members[i]]);
+    members[0]         = c;
+    configgroup        = 1;
+    clearversions(&configs[c].delta); /* the row was being done with its definitions in the table */
+    parted             = false;
+    alone              = true;
+    return true;
+}
+
+// the next line for a macro call, from the kept lines first
+static void readline(_Inout_ token_row* const trp) noexcept {
+    if (pendingrows && cursource == pendingsource)
+        cursource->lineinc += takeline(trp);
+    else
+        gettokens(trp, 0);
+}
+
+/*
+ * moretokens() for the row being done, when a macro call goes on past its end. the lines the leader reads are kept, so
+ * the row can be done again with them; one that would read on past them goes on alone in a process of its own.
+ */
+void gatherline(_Inout_ token_row* const trp) noexcept {
+    static unsigned char nothing[1];
+
+    if (replaying < 0) {
+        const ptrdiff_t from = trp->lp - trp->bp;
+        readline(trp);
+        if (configgroup == 1) return;
+        appendtokens(&gathered, trp->bp + from, trp->lp);
+        if (nlines == maxlines) {
+            maxlines = maxlines ? 2 * maxlines : 16;
+            lines    = reinterpret_cast<gathered_line*>(_checked_realloc(lines, maxlines * sizeof(gathered_line)));
+        }
+        lines[nlines++] = { gathered.lp - gathered.bp, cursource->lineinc };
+        return;
+    }
+    if (!abandoned && served < nlines) {
+        appendtokens(trp, gathered.bp + (served ? lines[served - 1].end : 0), gathered.bp + lines[served].end);
+        cursource->lineinc = lines[served++].lineinc;
+        return;
+    }
+    if (!abandoned && goalone(replaying)) {
+        readline(trp);
+        return;
+    }
+    if (trp->lp >= trp->bp + trp->max) growtokenrow(trp);
+    *trp->lp++ = { END, 0, 0, 0, 0, 0, nothing };
+}
+
+// does the row again for configuration c, true when this process took c on alone in the middle of it
+static bool replayrow(_In_ const int c, _In_ const int anymacros) noexcept {
+    configuration* const cf   = &configs[c];
+    const size_t         mark = savemacros();
+    row_state            st;
+
+    startstate(c, &st);
+    loadstate(&st);
+    for (size_t i = 0; i < cf->delta.n; i++) setversion(&cf->delta.v[i]);
+    replay.lp = replay.bp;
+    appendtokens(&replay, rowcopy.bp, rowcopy.lp);
+    replay.tp = replay.bp;
+    replaying = c;
+    served    = 0;
+    processrow(&replay, anymacros || parted); /* the names of a line the leader skips were not looked at */
+    replaying = -1;
+    if (alone) { /* the definitions in the table are its own now */
+        alone = false;
+        puttokens(&replay);
+        freemacros(mark);
+        return true;
+    }
+    if (abandoned) {
+        abandoned         = false;
+        diagnostics       = keptdiag;
+        nerrs             = keptnerrs;
+        abandoneddiag.len = 0;
+        cf->gone          = true;
+    } else {
+        savestate(&cf->state);
+        cf->state.consumed = served;
+        cf->rowout.len     = 0;
+        outmemory          = &cf->rowout;
+        puttokens(&replay);
+        flushout();
+        outmemory   = &sharedout;
+        clearversions(&cf->after);
+        changedmacros(mark, keepversion, &cf->after);
+    }
+    restoremacros(mark);
+    freemacros(mark);
+    return false;
+}
+
+// the definitions where c differs from the table once the leader's row is in it
+static void newdelta(_Inout_ configuration* const cf) noexcept {
+    clearversions(&scratch);
+    for (size_t i = 0; i < cf->after.n; i++)
+        if (!sameversion(&cf->after.v[i])) pushversion(&scratch, &cf->after.v[i]);
+    for (size_t i = 0; i < previous.n; i++) /* the row changed them for the leader alone */
+        if (!findversion(&cf->after, previous.v[i].np) && !sameversion(&previous.v[i])) pushversion(&scratch, &previous.v[i]);
+    const version_list delta = cf->delta;
+    cf->delta                = scratch;
+    scratch                  = delta;
+}
+
+// the row is done for the leader and then again for every other member, each one's output goes to it alone
+static void replayall(_Inout_ token_row* const trp, _In_ const int anymacros, _In_ const size_t mark) noexcept {
+    configuration* const lead = &configs[members[0]];
+    int                  kept {};
+    bool                 same { true };
+
+    shareout();
+    lead->rowout.len = 0;
+    outmemory        = &lead->rowout;
+    puttokens(trp);
+    flushout();
+    outmemory = &sharedout;
+    savestate(&lead->state);
+    lead->state.consumed = nlines;
+    clearversions(&changed);
+    changedmacros(mark, keepversion, &changed);
+    restoremacros(mark);
+    clearversions(&previous);
+    for (size_t i = 0; i < changed.n; i++) keepversion(changed.v[i].np, &previous);
+    for (int i = 1; i < configgroup; i++)
+        if (replayrow(members[i], anymacros)) return;
+    for (size_t i = 0; i < changed.n; i++) setversion(&changed.v[i]);
+    loadstate(&lead->state);
+
+    markvarying(false);
+    for (int i = 0; i < configgroup; i++) {
+        configuration* const cf = &configs[members[i]];
+        if (cf->gone) {
+            cf->gone = false;
+            leave(cf);
+            continue;
+        }
+        members[kept++] = members[i];
+        if (i) newdelta(cf);
+        same = same && cf->rowout.len == lead->rowout.len && ::memcmp(cf->rowout.data, lead->rowout.data, lead->rowout.len) == 0;
+    }
+    configgroup = kept;
+    for (int i = 0; i < configgroup; i++) {
+        configuration* const cf = &configs[members[i]];
+        if (same) {
+            if (i == 0) strbuf_append(&sharedout, cf->rowout.data, cf->rowout.len);
+            continue;
+        }
+        strbuf_append(&cf->out, cf->rowout.data, cf->rowout.len);
+        if (cf->out.len < CONFIG_OUTPUT_CHUNK) continue;
+        writeall(cf, cf->out.data, cf->out.len);
+        cf->out.len = 0;
+    }
+    findparted();
+    markvarying(true);
+
+    for (int i = 1; i < configgroup;) { /* the members the row left elsewhere in the input part, one process for each place */
+        const row_state* const st = &configs[members[i]].state;
+        int                    n {};
+        if (samestream(st, &lead->state)) {
+            i++;
+            continue;
+        }
+        for (int j = i; j < configgroup; j++)
+            if (samestream(&configs[members[j]].state, st)) parting[n++] = members[j];
+        if (forkmembers(parting, n)) return;
+    }
+}
+
+// processrows() on a row while several configurations are preprocessed together
+void steprow(_Inout_ token_row* const trp, _In_ const int anymacros) noexcept {
+    const bool directive = trp->tp->type == SHARP;
+
+    if (directive && includerow(trp)) {
+        partinclude(trp);
+        processrow(trp, anymacros);
+        puttokens(trp);
+        return;
+    }
+    if (!parted && !directive && !anymacros) { /* nothing in it may vary */
+        processrow(trp, anymacros);
+        puttokens(trp);
+        if (sharedout.len >= CONFIG_OUTPUT_CHUNK) writeshared();
+        return;
+    }
+    savestate(&rowstart);
+    rowcopy.lp = rowcopy.bp;
+    appendtokens(&rowcopy, trp->bp, trp->lp);
+    gathered.lp   = gathered.bp;
+    nlines        = 0;
+    configtouched = false;
+    const size_t mark = savemacros();
+    processrow(trp, anymacros);
+    if (parted || configtouched) {
+        flushout();
+        replayall(trp, anymacros, mark);
+    } else {
+        puttokens(trp);
+        if (sharedout.len >= CONFIG_OUTPUT_CHUNK) writeshared();
+    }
+    freemacros(mark);
+}
+
+// takes the definitions of every configuration and sets the leader's, once the -D and -U options are in
+void startconfigs(void) noexcept {
+    members = _checked_malloc<int>(nconfigs);
+    parting = _checked_malloc<int>(nconfigs);
+    for (int c = 0; c < nconfigs; c++) {
+        configuration* const cf   = &configs[c];
+        const size_t         mark = savemacros();
+        loaddefines(cf->defines);
+        changedmacros(mark, keepversion, &cf->delta);
+        restoremacros(mark);
+        freemacros(mark);
+        if ((cf->fd = open(cf->output, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0) error(FATAL, "Can't open output file %s", cf->output);
+        members[c] = c;
+    }
+    configgroup = nconfigs;
+    rebase(members[0]);
+    markvarying(true);
+    maketokenrow(64, &rowcopy);
+    maketokenrow(64, &replay);
+    maketokenrow(64, &gathered);
+    outmemory = &sharedout;
+}
+
+// writes what is left of every output, waits for the processes forked for the others, and ends such a process
+void finishconfigs(void) noexcept {
+    flushout();
+    writeshared();
+    for (int i = 0; i < configgroup; i++) leave(&configs[members[i]]);
+    outmemory = nullptr;
+#ifndef _WIN32
+    for (int i = 0; i < nchildren; i++) {
+        int status {};
+        if (::waitpid(static_cast<pid_t>(children[i]), &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) nerrs++;
+    }
+#endif
+    if (!forked) return;
+    ::fflush(stderr);
+    _exit(nerrs ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,309 @@
+#include <csetjmp>
+
+#include <prep.hpp>
+
+/*
+ * prep -daemon, keeps preprocessing the files an editor sends it over stdin and answers on stdout.
+ * every request is a line followed by the contents of the file, as it is in the editor:
+ *     run <length> <name>\n<length bytes>
+ *     quit\n
+ * and every answer a line followed by the output and the diagnostics:
+ *     ok errors=<n> output=<length> diagnostics=<length> resumed=<line>\n<output><diagnostics>
+ * the options given on the command line (-I, -D, -U, -+, -P ...) hold for every request.
+ *
+ * between requests the daemon keeps every header it read, checked with a stat() per request, and a checkpoint of the
+ * whole preprocessor state after each #include of the main file. when the same file comes again, it picks the last
+ * checkpoint ahead of the first changed byte whose headers have not changed, and reruns only from there; resumed is
+ * the line it started from, 0 for a run from the top. going back to a checkpoint frees the definitions made after it,
+ * so the daemon stays the size of the largest request however many it serves.
+ */
+
+#if defined(_WIN32) && !defined(S_ISREG)
+    #define S_ISREG(mode) (((mode) & S_IFMT) == S_IFREG)
+#endif
+
+static constexpr size_t FILE_CACHE_SLOTS { 1024 }; // hash chains of the header cache
+static constexpr size_t REQUEST_LINE_MAX { 4096 };
+
+struct cached_file final {
+        cached_file*       next;
+        char*              path;
+        bool               exists;
+        bool               changed; // differs from what the previous request saw
+        long long          size;
+        long long          mtime;   // nanoseconds
+        unsigned long long inode;
+        prep_file          file;    // the contents, read on first use
+};
+
+// everything process() needs to carry on from right after an #include of the main file
+struct checkpoint final {
+        size_t      offset; // in the main file, the start of the line after the #include
+        int         line;
+        const char* filename;
+        int         fileifdepth;
+        int         ifdepth;
+        int         skipping;
+        int         ifsatisfied[MAX_NESTED_IF_DEPTH];
+        int         nerrs;
+        size_t      outlen;
+        size_t      diaglen;
+        size_t      ndependencies;
+        size_t      macros; // savemacros() mark
+};
+
+static cached_file* filecache_slots[FILE_CACHE_SLOTS];
+static bool         resolutionchanged {}; // a header appeared or went away, so an #include may find another file
+static checkpoint*  checkpoints {};
+static size_t       ncheckpoints {}, maxcheckpoints {};
+static size_t       initialmacros {}; // right after the command line was read
+static strbuf       out {}, diag {};
+static char*        lastname {};
+static char*        lastdata {};
+static size_t       lastlen {};
+static char*        lastdir {};
+
+static size_t hashpath(_In_z_ const char* s) noexcept {
+    size_t h { 5381 };
+
+    while (*s) h = h * 33 + static_cast<unsigned char>(*s++);
+    return h % FILE_CACHE_SLOTS;
+}
+
+// fills in what stat() says about the file, returns whether that differs from before
+static bool stamp(_Inout_ cached_file* const cf) noexcept {
+    struct stat st {};
+    const bool  exists = ::stat(cf->path, &st) == 0 && S_ISREG(st.st_mode);
+    long long   mtime {};
+
+#ifdef _WIN32
+    mtime = static_cast<long long>(st.st_mtime) * 1'000'000'000;
+#else
+    mtime = static_cast<long long>(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec;
+#endif
+    if (!exists) st.st_size = 0, st.st_ino = 0, mtime = 0;
+    if (exists == cf->exists && st.st_size == cf->size && mtime == cf->mtime && st.st_ino == cf->inode) return false;
+    cf->exists = exists;
+    cf->size   = st.st_size;
+    cf->mtime  = mtime;
+    cf->inode  = st.st_ino;
+    return true;
+}
+
+// reads the whole file once, a short read leaves it looking empty rather than failing the #include
+static void load(_Inout_ cached_file* const cf) noexcept {
+    char*     data = _checked_malloc<char>(cf->size + 1);
+    long long n {};
+    int       fd   = open(cf->path, 0);
+
+    while (fd >= 0 && n < cf->size) {
+        const auto r = read(fd, data + n, static_cast<unsigned>(cf->size - n));
+        if (r <= 0) break;
+        n += r;
+    }
+    if (fd >= 0) close(fd);
+    cf->file.name = cf->path;
+    cf->file.data = data;
+    cf->file.len  = n;
+}
+
+// the header cache behind filecache, a path not seen before is stat()ed and read right away
+static const prep_file* cachedfile(_In_z_ const char* const path) noexcept {
+    const size_t h  = hashpath(path);
+    cached_file* cf = filecache_slots[h];
+
+    while (cf && ::strcmp(cf->path, path) != 0) cf = cf->next;
+    if (!cf) {
+        cf = _new_obj<cached_file>();
+        ::memset(cf, 0, sizeof(cached_file));
+        cf->path           = ::strdup(path);
+        cf->next           = filecache_slots[h];
+        filecache_slots[h] = cf;
+        stamp(cf);
+    }
+    if (!cf->exists) return nullptr;
+    if (!cf->file.data) load(cf);
+    return &cf->file;
+}
+
+// stat()s every cached file once per request and drops the contents of those that changed
+static void revalidate(void) noexcept {
+    resolutionchanged = false;
+    for (size_t i = 0; i < FILE_CACHE_SLOTS; i++)
+        for (cached_file* cf = filecache_slots[i]; cf; cf = cf->next) {
+            const bool existed = cf->exists;
+            cf->changed        = stamp(cf);
+            if (!cf->changed) continue;
+            if (existed != cf->exists) resolutionchanged = true;
+            free(const_cast<char*>(cf->file.data));
+            cf->file.data = nullptr;
+        }
+}
+
+// the number of dependencies of the previous run that were read before the first one that changed
+static size_t unchangeddependencies(void) noexcept {
+    for (size_t i = 0; i < ndependencies; i++) {
+        const cached_file* cf = filecache_slots[hashpath(dependencies[i])];
+        while (cf && ::strcmp(cf->path, dependencies[i]) != 0) cf = cf->next;
+        if (!cf || cf->changed) return i;
+    }
+    return ndependencies;
+}
+
+// process() calls this after every #include of the main file
+static void savecheckpoint(void) noexcept {
+    checkpoint* cp;
+
+    flushout();
+    if (ncheckpoints == maxcheckpoints) {
+        maxcheckpoints = maxcheckpoints ? 2 * maxcheckpoints : 64;
+        checkpoints    = reinterpret_cast<checkpoint*>(_checked_realloc(checkpoints, maxcheckpoints * sizeof(checkpoint)));
+    }
+    cp                = &checkpoints[ncheckpoints++];
+    cp->offset        = cursource->inp - cursource->inb + cursource->shifted;
+    cp->line          = cursource->line;
+    cp->filename      = cursource->filename;
+    cp->fileifdepth   = cursource->ifdepth;
+    cp->ifdepth       = ifdepth;
+    cp->skipping      = skipping;
+    cp->nerrs         = nerrs;
+    cp->outlen        = out.len;
+    cp->diaglen       = diag.len;
+    cp->ndependencies = ndependencies;
+    cp->macros        = savemacros();
+    ::memcpy(cp->ifsatisfied, ifsatisfied, sizeof(ifsatisfied));
+}
+
+static void dropcheckpoints(_In_ const size_t keep) noexcept {
+    while (ncheckpoints > keep) freemacros(checkpoints[--ncheckpoints].macros);
+}
+
+// forgets the dependencies from index keep on
+static void truncatedependencies(_In_ const size_t keep) noexcept {
+    while (ndependencies > keep) free(dependencies[--ndependencies]);
+}
+
+/*
+ * the checkpoint to resume name at, or nullptr to run it from the top. only the text ahead of a checkpoint and the
+ * headers read before it went into its state, so both have to be unchanged.
+ */
+static const checkpoint* resumepoint(_In_z_ const char* const name, _In_reads_(len) const char* const data, _In_ const size_t len) noexcept {
+    size_t same {}, deps {};
+
+    if (!lastname || ::strcmp(name, lastname) != 0 || resolutionchanged) return nullptr;
+    while (same < len && same < lastlen && data[same] == lastdata[same]) same++;
+    deps = unchangeddependencies();
+    for (size_t i = ncheckpoints; i-- > 0;)
+        if (checkpoints[i].offset <= same && checkpoints[i].ndependencies <= deps) return &checkpoints[i];
+    return nullptr;
+}
+
+// preprocesses one request into out and diag, returns the line it resumed from
+static int run(_Inout_ token_row* const trp, _In_z_ const char* const name, _In_reads_(len) const char* const data, _In_ const size_t len) noexcept {
+    static jmp_buf    jump {};
+    const checkpoint* cp   = resumepoint(name, data, len);
+    source* const     base = cursource;
+    const char* const slash = ::strrchr(name, '/');
+    int               resumed {};
+
+    if (cp) {
+        restoremacros(cp->macros);
+        truncatedependencies(cp->ndependencies);
+        dropcheckpoints(cp - checkpoints + 1);
+        nerrs    = cp->nerrs;
+        ifdepth  = cp->ifdepth;
+        skipping = cp->skipping;
+        out.len  = cp->outlen;
+        diag.len = cp->diaglen;
+        resumed  = cp->line;
+        ::memcpy(ifsatisfied, cp->ifsatisfied, sizeof(ifsatisfied));
+    } else {
+        restoremacros(initialmacros);
+        truncatedependencies(0);
+        dropcheckpoints(0);
+        nerrs    = 0;
+        ifdepth  = 0;
+        skipping = 0;
+        out.len  = 0;
+        diag.len = 0;
+        ::memset(ifsatisfied, 0, sizeof(ifsatisfied));
+    }
+    if (!lastname || ::strcmp(name, lastname) != 0) {
+        free(lastname);
+        free(lastdir);
+        lastname = ::strdup(name);
+        lastdir  = slash ? reinterpret_cast<char*>(newstring(reinterpret_cast<const unsigned char*>(name), slash - name, 0)) : nullptr;
+    }
+    free(lastdata);
+    lastdata = _checked_malloc<char>(len + 1);
+    if (len) ::memcpy(lastdata, data, len);
+    lastlen = len;
+
+    includelist[MAX_INCLUDE_DIRS - 1].file = lastdir ? lastdir : ".";
+    incdepth                               = 0;
+    init_hideset();
+    startstats();
+    outmemory   = &out;
+    diagnostics = &diag;
+    trp->tp = trp->lp = trp->bp;
+    if (setjmp(jump) == 0) {
+        fatal_jump = &jump;
+        setmemsource(lastname, data, len);
+        if (cp) {
+            cursource->inp      = cursource->inb + cp->offset;
+            cursource->line     = cp->line;
+            cursource->filename = cp->filename;
+            cursource->ifdepth  = cp->fileifdepth;
+        } else {
+            settime(); /* a bad SOURCE_DATE_EPOCH fails the request, the daemon stays */
+            genline();
+        }
+        process(trp);
+    }
+    flushout();
+    fatal_jump  = nullptr;
+    outmemory   = nullptr;
+    diagnostics = nullptr;
+    while (cursource != base) unsetsource();
+    resetexpansion(); /* a fatal error leaves the expansion it hit on the work stack */
+    macronested = 0;  /* and the macro timers it jumped past unbalanced */
+    macrodepth  = 0;
+    stopstats();
+    return resumed;
+}
+
+// reads exactly len bytes of a request, false at the end of the input
+static bool readexactly(_Out_ char* const buffer, _In_ const size_t len) noexcept {
+    return std::fread(buffer, 1, len, stdin) == len;
+}
+
+int servedaemon(_Inout_ token_row* const trp) noexcept {
+    char   line[REQUEST_LINE_MAX];
+    char*  data {};
+    size_t len {};
+    int    name {}, resumed {};
+
+    initialmacros   = savemacros();
+    filecache       = cachedfile;
+    toplevelinclude = savecheckpoint;
+    while (std::fgets(line, sizeof(line), stdin)) {
+        line[::strcspn(line, "\r\n")] = '\0';
+        name                          = 0;
+        if (::strcmp(line, "quit") == 0) break;
+        if (std::sscanf(line, "run %zu %n", &len, &name) != 1 || name == 0 || line[name] == '\0') {
+            std::printf("error malformed request\n");
+            std::fflush(stdout);
+            continue;
+        }
+        data = reinterpret_cast<char*>(_checked_realloc(data, len + 1));
+        if (!readexactly(data, len)) break;
+        revalidate();
+        resumed = run(trp, line + name, data, len);
+        std::printf("ok errors=%d output=%zu diagnostics=%zu resumed=%d\n", nerrs, out.len, diag.len, resumed);
+        if (out.len) std::fwrite(out.data, 1, out.len, stdout);
+        if (diag.len) std::fwrite(diag.data, 1, diag.len, stdout);
+        std::fflush(stdout);
+    }
+    free(data);
+    return EXIT_SUCCESS;
+}
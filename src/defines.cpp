@@ -0,0 +1,131 @@
+#include <prep.hpp>
+
+/*
+ * -defines-file, the -D and -U arguments of a build read from one file, and -save-defines, the same in binary.
+ * the text form is lexed in one pass as a single source: a line holds NAME or NAME=body, or any number of -DNAME[=body]
+ * and -UNAME words, the way a build passes them, each running up to the next such word. the binary form holds the
+ * definitions as -save-defines found them after the options, one record per name, and loads without any lexing; it is
+ * encoded like the results of the -j workers, so it is only good on hosts with the same byte order.
+ */
+
+static constexpr char   DEFINES_MAGIC[] { "PREPDEF1" };
+static constexpr size_t DEFINES_MAGIC_LEN { sizeof(DEFINES_MAGIC) - 1 };
+
+// the 'D' or 'U' of a -D or -U word at tp, a minus right up against a name, or 0
+static int defineword(_In_ const token* const tp, _In_ const token* const end) noexcept {
+    if (tp->type != MINUS || tp + 1 >= end || tp[1].type != NAME || tp[1].wslen) return 0;
+    return tp[1].t[0] == 'D' || tp[1].t[0] == 'U' ? tp[1].t[0] : 0;
+}
+
+// hands every definition of the row to doadefine(), the row ends with its NL or END
+static void definerow(_Inout_ token_row* const trp) noexcept {
+    token* const last = trp->lp - 1;
+    token*       tp   = trp->bp;
+
+    while (tp < last) {
+        int type = defineword(tp, last);
+        if (type) { /* the name is what follows the D or U, in the same token or the next */
+            tp[1].t++;
+            tp[1].len--;
+            tp[1].sym = 0; /* the id of the word with the D or U */
+            tp += tp[1].len ? 1 : 2;
+        } else
+            type = 'D';
+        token* end = tp;
+        while (end < last && !(end > tp && end->wslen && defineword(end, last))) end++;
+        const TKNTYPE next = end->type;
+        token_row     word { tp, tp, end + 1, end + 1 - tp };
+        end->type          = END; /* what doadefine() expects after the argument */
+        doadefine(&word, type);
+        end->type = next;
+        tp        = end;
+    }
+}
+
+static void loadtext(_In_z_ const char* const path, _In_ unsigned char* const data, _In_ const size_t len) noexcept {
+    token_row tr;
+
+    setbuffersource(path, data, len);
+    maketokenrow(64, &tr);
+    do {
+        tr.tp = tr.lp = tr.bp;
+        gettokens(&tr, 1);
+        definerow(&tr);
+        cursource->line += cursource->lineinc;
+    } while ((tr.lp - 1)->type != END);
+    unsetsource();
+    free(tr.bp);
+}
+
+static void loadbinary(_In_z_ const char* const path, _In_reads_(len) const char* const data, _In_ const size_t len) noexcept {
+    byte_reader r { data + DEFINES_MAGIC_LEN, data + len, false };
+
+    while (r.p < r.end) {
+        const long long kind = getnumber(&r);
+        token           t {};
+        size_t          namelen {};
+        nlist*          np;
+
+        t.type = NAME;
+        t.t    = reinterpret_cast<unsigned char*>(const_cast<char*>(getbytes(&r, &namelen)));
+        t.len  = static_cast<unsigned>(namelen);
+        if (r.bad || !namelen || (kind != 'D' && kind != 'U')) break;
+        if (kind == 'U') {
+            if ((np = lookup(&t, 0)) == nullptr) continue;
+            changemacro(np);
+            np->flag &= ~DEFINED_VALUE;
+            continue;
+        }
+        token_row* const vp = getrow(&r);
+        if (r.bad || !vp) break;
+        np = lookup(&t, 1);
+        changemacro(np);
+        np->flag    |= DEFINED_VALUE;
+        np->deffile  = "<cmdarg>";
+        np->defline  = 0;
+        setdefinition(np, vp, np->ap);
+    }
+    if (r.p < r.end || r.bad) error(FATAL, "Malformed defines file %s", path);
+}
+
+// -defines-file, the binary form is told apart by its first bytes
+void loaddefines(_In_z_ const char* const path) noexcept {
+    struct stat    st {};
+    unsigned char* data;
+    long long      n {}, got {};
+    const int      fd = open(path, O_RDONLY | O_BINARY);
+
+    if (fd < 0 || ::fstat(fd, &st) != 0) error(FATAL, "Can't open defines file %s", path);
+    data = sourcebuffer(static_cast<size_t>(st.st_size));
+    while (got < st.st_size && (n = read(fd, data + got, static_cast<unsigned>(st.st_size - got))) > 0) got += n;
+    close(fd);
+    if (got >= static_cast<long long>(DEFINES_MAGIC_LEN) && ::memcmp(data, DEFINES_MAGIC, DEFINES_MAGIC_LEN) == 0) {
+        loadbinary(path, reinterpret_cast<const char*>(data), static_cast<size_t>(got));
+        free(data);
+    } else
+        loadtext(path, data, static_cast<size_t>(got));
+}
+
+static void savedefinition(_In_ nlist* const np, _Inout_ void* const context) noexcept {
+    strbuf* const buf = reinterpret_cast<strbuf*>(context);
+
+    if (!np->deffile || ::strcmp(np->deffile, "<cmdarg>") != 0) return;
+    putnumber(buf, np->flag & DEFINED_VALUE ? 'D' : 'U');
+    putbytes(buf, np->name, np->len);
+    if (np->flag & DEFINED_VALUE) putrow(buf, np->vp);
+}
+
+// -save-defines, what the -D, -U and -defines-file options came to, in the binary form
+void savedefines(_In_z_ const char* const path) noexcept {
+    strbuf    buf {};
+    long long n {};
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+
+    if (fd < 0) error(FATAL, "Can't open defines file %s", path);
+    strbuf_append(&buf, DEFINES_MAGIC, DEFINES_MAGIC_LEN);
+    forallnames(savedefinition, &buf);
+    for (const char* p = buf.data; p < buf.data + buf.len; p += n)
+        if ((n = write(fd, p, static_cast<unsigned>(buf.data + buf.len - p))) <= 0) error(FATAL, "Can't write defines file %s", path);
+    close(fd);
+    free(buf.data);
+}
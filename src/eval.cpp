@@ -86,14 +86,14 @@ static constexpr priority operator_priority[] = {
 };
 
 // forward declarations
-int   evalop(struct priority);
+int   evalop(struct priority) noexcept;
 value tokval(token*);
 
 value   vals[NSTAK + 1], *vp;
 TKNTYPE ops[NSTAK + 1], *op;
 
-// Evaluates an #if #elif #ifdef #ifndef line.  trp->tp points to the keyword.
-long eval(_In_ token_row* trp, _In_ const KWTYPE& keyword) noexcept {
+// eval() without the timing
+static long evalrow(_In_ token_row* trp, _In_ const int keyword) noexcept {
     token* tp {};
     nlist* np {};
     int    ntok {}, rand {};
@@ -115,7 +115,7 @@ long eval(_In_ token_row* trp, _In_ const KWTYPE& keyword) noexcept {
     op             = ops;
     *op++          = END;
     for (rand = 0, tp = trp->bp + ntok; tp < trp->lp; tp++) {
-        if (op >= ops + NSTAK) sysfatal("cpp: can't evaluate #if: increase NSTAK");
+        if (op >= ops + NSTAK) error(FATAL, "Can't evaluate #if: increase NSTAK");
         switch (tp->type) {
             case TKNTYPE::WS :
             case TKNTYPE::NL : continue;
@@ -206,6 +206,17 @@ syntax:
     return 0;
 }
 
+// Evaluates an #if #elif #ifdef #ifndef line.  trp->tp points to the keyword.
+long eval(_In_ token_row* trp, _In_ const int keyword) noexcept {
+    phase_timer timer;
+    long        value;
+
+    timer.begin(PREP_PHASE_EVAL);
+    value = evalrow(trp, keyword);
+    timer.end();
+    return value;
+}
+
 int evalop(struct priority pri) noexcept {
     struct value v1, v2;
     long         rv1, rv2;
@@ -222,30 +233,30 @@ int evalop(struct priority pri) noexcept {
         v1  = *--vp;
         rv1 = v1.val;
         switch (operator_priority[oper].ctype) {
-            case 0 :
-            default : error(WARNING, "Syntax error in #if/#endif"); return 1;
-            case ARITH :
-            case RELAT :
+            case CNVRSNTYPE::NONE :
+            default                : error(WARNING, "Syntax error in #if/#endif"); return 1;
+            case CNVRSNTYPE::ARITH :
+            case CNVRSNTYPE::RELAT :
                 if (v1.type == UNS || v2.type == UNS)
                     rtype = UNS;
                 else
                     rtype = SGN;
                 if (v1.type == UND || v2.type == UND) rtype = UND;
-                if (operator_priority[oper].ctype == RELAT && rtype == UNS) {
+                if (operator_priority[oper].ctype == CNVRSNTYPE::RELAT && rtype == UNS) {
                     oper  |= UNSMARK;
                     rtype  = SGN;
                 }
                 break;
-            case SHIFT :
+            case CNVRSNTYPE::SHIFT :
                 if (v1.type == UND || v2.type == UND)
                     rtype = UND;
                 else
                     rtype = v1.type;
                 if (rtype == UNS) oper |= UNSMARK;
                 break;
-            case UNARY : rtype = v1.type; break;
-            case LOGIC :
-            case SPCL  : break;
+            case CNVRSNTYPE::UNARY : rtype = v1.type; break;
+            case CNVRSNTYPE::LOGIC :
+            case CNVRSNTYPE::SPCL  : break;
         }
         switch (oper) {
             case EQ :
@@ -339,12 +350,36 @@ int evalop(struct priority pri) noexcept {
     return 0;
 }
 
+// decodes the UTF-8 sequence at p into r, returns its length; a malformed sequence is taken as a single byte
+static int utf8torune(_Out_ unsigned long* const r, _In_ const unsigned char* const p) noexcept {
+    int len, i;
+
+    *r = p[0];
+    if ((p[0] & 0xE0) == 0xC0)
+        len = 2;
+    else if ((p[0] & 0xF0) == 0xE0)
+        len = 3;
+    else if ((p[0] & 0xF8) == 0xF0)
+        len = 4;
+    else
+        return 1;
+    *r = p[0] & (0x7F >> len);
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *r = p[0];
+            return 1;
+        }
+        *r = (*r << 6) | (p[i] & 0x3F);
+    }
+    return len;
+}
+
 struct value tokval(token* tp) {
     struct value   v;
     nlist*         np;
     int            i, base, c, longcc;
     unsigned long  n;
-    Rune           r;
+    unsigned long  r;
     unsigned char* p;
 
     v.type = SGN;
@@ -435,7 +470,7 @@ struct value tokval(token* tp) {
             } else if (*p == '\'')
                 error(ERROR, "Empty character constant");
             else {
-                i  = chartorune(&r, (char*) p);
+                i  = utf8torune(&r, p);
                 n  = r;
                 p += i;
                 if (i > 1 && longcc == 0) error(WARNING, "Undefined character constant");
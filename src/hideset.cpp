@@ -35,10 +35,14 @@ int new_hideset(int hs, nlist* np) noexcept {
     nlist*  nhs[HIDESET_SIZE + 3];
     Hideset hs1, hs2;
 
+    prepstats.hidesetlookups++;
     len = insert_hideset(nhs, hidesets[hs], np);
     for (i = 0; i < nhidesets; i++) {
         for (hs1 = nhs, hs2 = hidesets[i]; *hs1 == *hs2; hs1++, hs2++)
-            if (*hs1 == nullptr) return i;
+            if (*hs1 == nullptr) {
+                prepstats.hidesethits++;
+                return i;
+            }
     }
     if (len >= HIDESET_SIZE) return hs;
     if (nhidesets >= maxhidesets) {
@@ -48,6 +52,7 @@ int new_hideset(int hs, nlist* np) noexcept {
     hs1 = (Hideset) _checked_malloc<Hideset>(len); //(len * sizeof(Hideset));
     memmove(hs1, nhs, len * sizeof(Hideset));
     hidesets[nhidesets] = hs1;
+    prepstats.hidesets++;
     return nhidesets++;
 }
 
@@ -68,13 +73,27 @@ int unionhideset(int hs1, int hs2) noexcept {
     return hs1;
 }
 
+// creates the table holding only the empty hideset, a second call drops everything but the empty set and keeps the table
 void init_hideset() noexcept {
+    if (hidesets) {
+        for (long long i = 1; i < nhidesets; i++) free(hidesets[i]);
+        nhidesets = 1;
+        return;
+    }
     hidesets     = (Hideset*) _checked_malloc<Hideset*>(maxhidesets); // (maxhidesets * sizeof(Hideset*));
     hidesets[0]  = (Hideset) _checked_malloc<Hideset>(1);             // (sizeof(Hideset));
     *hidesets[0] = nullptr;
     nhidesets++;
 }
 
+// the number of names in a hideset
+int sizeof_hideset(int hs) noexcept {
+    Hideset hsp;
+
+    for (hsp = hidesets[hs]; *hsp; hsp++);
+    return hsp - hidesets[hs];
+}
+
 void print_hideset(int hs) noexcept {
     Hideset np;
 
@@ -4,11 +4,91 @@ include_list includelist[MAX_INCLUDE_DIRS] {};
 
 char* objname;
 
+const prep_file* memfiles {}; // in-memory files consulted before the filesystem (library mode)
+size_t           nmemfiles {};
+char**           dependencies {}; // every file entered by #include, in order of inclusion
+size_t           ndependencies {};
+char**           probemisses {}; // the paths an #include looked for its file under and did not find it, for -cache
+size_t           nprobemisses {};
+
+const prep_file* (*filecache)(const char*) noexcept {}; // when set, answers for the filesystem, e.g. the daemon's header cache
+
+static char        candidates[MAX_INCLUDE_DIRS + 1][256]; // the paths an #include may find its file under, in search order
+static const char* candidatepaths[MAX_INCLUDE_DIRS + 1];
+
+// returns the in-memory file registered under name, if any
+static const prep_file* findmemfile(_In_z_ const char* const name) noexcept {
+    for (size_t i = 0; i < nmemfiles; i++)
+        if (::strcmp(memfiles[i].name, name) == 0) return &memfiles[i];
+    return nullptr;
+}
+
+// records a path in list, e.g. a file that was entered by #include in dependencies
+static void addpath(_Inout_ char*** const list, _Inout_ size_t* const n, _In_z_ const char* const name) noexcept {
+    *list           = reinterpret_cast<char**>(_checked_realloc(*list, (*n + 1) * sizeof(char*)));
+    (*list)[(*n)++] = (char*) newstring((unsigned char*) name, strlen(name), 0);
+}
+
+// tries one candidate path, returns the descriptor of the file or sets mfp when it lives in memory
+static int probe(_In_z_ const char* const path, _Out_ const prep_file** const mfp) noexcept {
+    prepstats.includeprobes++;
+    *mfp = nmemfiles ? findmemfile(path) : nullptr;
+    if (*mfp) return -1;
+    if (filecache) {
+        *mfp = filecache(path);
+        return -1;
+    }
+    return open(path, 0);
+}
+
+// fills candidates with the paths fname is looked for under, returns how many
+static int listcandidates(_In_z_ const char* const fname, _In_ const int angled) noexcept {
+    const size_t      len   = strlen(fname);
+    const char* const slash = strrchr(cursource->filename, '/');
+    int               n {};
+
+    if (fname[0] == '/')
+        strcpy(candidates[n++], fname);
+    else
+        for (int i = MAX_INCLUDE_DIRS - 1; i >= 0; i--) {
+            const include_list* const ip = &includelist[i];
+            if (ip->file == nullptr || ip->deleted || (angled && ip->always == 0)) continue;
+            if (len + strlen(ip->file) + 2 > sizeof(candidates[0])) continue;
+            strcpy(candidates[n], ip->file);
+            strcat(candidates[n], "/");
+            strcat(candidates[n++], fname);
+        }
+    /* last, the directory of the file with the #include */
+    if (slash != nullptr && (slash - cursource->filename) + len + 2 <= sizeof(candidates[0])) {
+        memcpy(candidates[n], cursource->filename, slash - cursource->filename);
+        candidates[n][slash - cursource->filename] = '\0';
+        strcat(candidates[n], "/");
+        strcat(candidates[n++], fname);
+    }
+    for (int i = 0; i < n; i++) candidatepaths[i] = candidates[i];
+    return n;
+}
+
+void cleardependencies(void) noexcept {
+    for (size_t i = 0; i < ndependencies; i++) free(dependencies[i]);
+    free(dependencies);
+    dependencies  = nullptr;
+    ndependencies = 0;
+    for (size_t i = 0; i < nprobemisses; i++) free(probemisses[i]);
+    free(probemisses);
+    probemisses  = nullptr;
+    nprobemisses = 0;
+}
+
 void doinclude(token_row* trp) {
-    char          fname[256], iname[256], *p;
-    include_list* ip;
-    int           angled, len, fd, i;
+    char             fname[256], iname[256];
+    const prep_file* mfp;
+    unsigned char*   loaded;
+    size_t           loadedlen;
+    int              angled, len, fd, i, n;
+    phase_timer      timer;
 
+    timer.begin(PREP_PHASE_INCLUDE);
     trp->tp += 1;
     if (trp->tp >= trp->lp) goto syntax;
     if (trp->tp->type != STRING && trp->tp->type != LT) {
@@ -36,59 +116,66 @@ void doinclude(token_row* trp) {
     trp->tp += 2;
     if (trp->tp < trp->lp || len == 0) goto syntax;
     fname[len] = '\0';
-    if (fname[0] == '/') {
-        fd = open(fname, 0);
+    mfp        = nullptr;
+    loaded     = nullptr;
+    fd         = -1;
+    prepstats.includes++;
+    if (nmemfiles && (prepstats.includeprobes++, mfp = findmemfile(fname)) != nullptr)
         strcpy(iname, fname);
-    } else
-        for (fd = -1, i = MAX_INCLUDE_DIRS - 1; i >= 0; i--) {
-            ip = &includelist[i];
-            if (ip->file == nullptr || ip->deleted || (angled && ip->always == 0)) continue;
-            if (strlen(fname) + strlen(ip->file) + 2 > sizeof(iname)) continue;
-            strcpy(iname, ip->file);
-            strcat(iname, "/");
-            strcat(iname, fname);
-            if ((fd = open(iname, 0)) >= 0) break;
-        }
-    if (fd < 0) {
-        strcpy(iname, cursource->filename);
-        p = strrchr(iname, '/');
-        if (p != nullptr) {
-            *p = '\0';
-            strcat(iname, "/");
-            strcat(iname, fname);
-            fd = open(iname, 0);
-        }
+    else {
+        n = listcandidates(fname, angled);
+        i = uringflag && !filecache && !nmemfiles ? loadinclude(candidatepaths, n, &loaded, &loadedlen) : IO_UNAVAILABLE;
+        if (i == IO_UNAVAILABLE)
+            for (i = 0; i < n; i++) {
+                if ((fd = probe(candidates[i], &mfp)) >= 0 || mfp) break;
+            }
+        else
+            prepstats.includeprobes += i >= 0 ? i + 1 : n;
+        if (cachedir) /* a file that turns up under one of them later is found instead */
+            for (int j = 0; j < (i >= 0 && i < n ? i : n); j++) addpath(&probemisses, &nprobemisses, candidates[j]);
+        /* the file found, or the last path tried */
+        strcpy(iname, i >= 0 && i < n ? candidates[i] : n ? candidates[n - 1] : fname);
     }
     if (Mflag > 1 || !angled && Mflag == 1) {
-        write(1, objname, strlen(objname));
-        write(1, iname, strlen(iname));
-        write(1, "\n", 1);
+        writeout(objname, strlen(objname));
+        writeout(iname, strlen(iname));
+        writeout("\n", 1);
     }
-    if (fd >= 0) {
+    if (fd >= 0 || mfp || loaded) {
         if (++incdepth > 20) error(FATAL, "#include too deeply nested");
-        setsource((char*) newstring((unsigned char*) iname, strlen(iname), 0), fd, nullptr);
+        addpath(&dependencies, &ndependencies, iname);
+        if (mfp)
+            setmemsource((char*) newstring((unsigned char*) iname, strlen(iname), 0), mfp->data, mfp->len);
+        else if (loaded) {
+            setbuffersource((char*) newstring((unsigned char*) iname, strlen(iname), 0), loaded, loadedlen);
+            if (prefetchflag && loadedlen) prefetchincludes(cursource, cursource->inb, cursource->inl);
+        } else
+            setsource((char*) newstring((unsigned char*) iname, strlen(iname), 0), fd, nullptr);
         genline();
     } else {
+        prepstats.includefailures++;
         trp->tp = trp->bp + 2;
         error(ERROR, "Could not find include file %r", trp);
     }
+    timer.end();
     return;
 syntax:
     error(ERROR, "Syntax error in #include");
-    return;
+    timer.end();
 }
 
 /*
  * Generate a line directive for cursource
  */
 void genline(void) {
-    static token     ta = { UNCLASS, nullptr, 0, 0 };
+    static token     ta = { UNCLASS, 0, 0, 0, 0, 0, nullptr };
     static token_row tr = { &ta, &ta, &ta + 1, 1 };
     unsigned char*   p;
 
     if (nolineinfo) return;
 
-    ta.t = p = (unsigned char*) outp;
+    /* #line, the number, the directory and the name, quotes, blanks and the newline */
+    ta.t = p = linespace(sizeof("#line ") + 16 + strlen(wd) + strlen(cursource->filename));
     strcpy((char*) p, "#line ");
     p    += sizeof("#line ") - 1;
     p     = (unsigned char*) outnum((char*) p, cursource->line);
@@ -103,15 +190,14 @@ void genline(void) {
     p      += strlen((char*) p);
     *p++    = '"';
     *p++    = '\n';
-    ta.len  = (char*) p - outp;
-    outp    = (char*) p;
+    ta.len  = p - ta.t;
     tr.tp   = tr.bp;
     puttokens(&tr);
 }
 
-void setobjname(char* f) {
+void setobjname(const char* f) {
     int n   = strlen(f);
-    objname = (char*) _checked_malloc(n + 5);
+    objname = _checked_malloc<char>(n + 5);
     strcpy(objname, f);
     if (objname[n - 2] == '.')
         strcpy(objname + n - 1, "$O: ");
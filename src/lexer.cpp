@@ -11,8 +11,8 @@
  *   in ch arrives, enter nextstate.
  *   States >= S_SELF are either final, or at least require special action.
  *   In 'fsmachine' there is a line for each state X charset X nextstate.
- *   List chars that overwrite previous entries later (e.g. ALPHABET
- *   can be overridden by '_' by a later entry; and character_classl::xx is the
+ *   List chars that overwrite previous entries later (e.g. C_ALPH
+ *   can be overridden by '_' by a later entry; and C_XX is the
  *   the universal set, and should always be first.
  *   States above S_SELF are represented in the big table as negative values.
  *   S_SELF and S_SELFB encode the resulting token type in the upper bits.
@@ -37,13 +37,14 @@ static constexpr size_t FSM_MAX_STATES { 32 };
 
 #define ACT(tok, act) ((tok << 7) + act)
 #define QBSBIT        0100
-#define GETACT(st)    (st >> 7) & 0x1ff
+#define GETACT(st)    (((st) >> 7) & 0x1ff)
 
 #define UTF2(c)       ((c) >= 0xA0 && (c) < 0xE0) /* 2-char UTF seq */
 #define UTF3(c)       ((c) >= 0xE0 && (c) < 0xF0) /* 3-char UTF seq */
+#define INCOMMENT(st) ((st) == COM2 || (st) == COM3 || (st) == COM4)
 
 // character classes
-enum CHARCLASS : char { WHITESPACE = 0x01, ALPHABET, NUMBER, EOFILE, MISC };
+enum CHARCLASS : unsigned char { C_WS = 0x01, C_ALPH, C_NUM, C_EOF, C_XX };
 
 // valid states for the finite state machine
 enum FSMSTATE : unsigned {
@@ -93,18 +94,18 @@ enum FSMSTATE : unsigned {
 };
 
 struct fsm {
-        FSMSTATE state;     // if in this state
-        char     ch[4];     // and see one of these characters
-        FSMSTATE nextstate; // enter this state if positive
+        int           state;     // if in this state
+        unsigned char ch[4];     // and see one of these characters
+        int           nextstate; // enter this state if positive
 };
 
 /*const*/
 fsm fsmachine[] = {
-    { FSMSTATE::START, { ::to_underlying(CHARCLASS::MISC) }, ACT(TKNTYPE::UNCLASS, FSMSTATE::S_SELF) },
+    { FSMSTATE::START, { C_XX }, ACT(TKNTYPE::UNCLASS, FSMSTATE::S_SELF) },
     { FSMSTATE::START, { ' ', '\t', '\v', '\r' }, WS1 },
-    { FSMSTATE::START, { CHARCLASS::NUMBER }, NUM1 },
+    { FSMSTATE::START, { C_NUM }, NUM1 },
     { FSMSTATE::START, { '.' }, NUM3 },
-    { FSMSTATE::START, { CHARCLASS::ALPHABET }, ID1 },
+    { FSMSTATE::START, { C_ALPH }, ID1 },
     { FSMSTATE::START, { 'L' }, ST1 },
     { FSMSTATE::START, { '"' }, ST2 },
     { FSMSTATE::START, { '\'' }, CC1 },
@@ -276,31 +277,32 @@ fsm fsmachine[] = {
     /* ^ */
     { CIRC1, { C_XX }, ACT(CIRC, S_SELFB) },
     { CIRC1, { '=' }, ACT(ASCIRC, S_SELF) },
-    -1
+    { -1 }
 };
 
 /* first index is char, second is state */
 /* increase #states to power of 2 to encourage use of shift */
 short bigfsm[256][FSM_MAX_STATES];
+static short cxxcomment; // the untouched transition for "//", so C++ comments can be toggled between runs
 
 void expandlex(void) {
     /*const*/ struct fsm* fp;
     int                   i, j, nstate;
 
     for (fp = fsmachine; fp->state >= 0; fp++) {
-        for (i = 0; fp->ch[i]; i++) {
+        for (i = 0; i < static_cast<int>(sizeof(fp->ch)) && fp->ch[i]; i++) {
             nstate = fp->nextstate;
             if (nstate >= S_SELF) nstate = ~nstate;
 
             switch (fp->ch[i]) {
-                case CHARCLASS::MISC : /* random characters */
+                case C_XX : /* random characters */
                     for (j = 0; j < 256; j++) bigfsm[j][fp->state] = nstate;
                     continue;
-                case CHARCLASS::ALPHABET :
-                    for (j = 0; j <= 256; j++)
+                case C_ALPH :
+                    for (j = 0; j < 256; j++)
                         if ('a' <= j && j <= 'z' || 'A' <= j && j <= 'Z' || UTF2(j) || UTF3(j) || j == '_') bigfsm[j][fp->state] = nstate;
                     continue;
-                case CHARCLASS::NUMBER :
+                case C_NUM :
                     for (j = '0'; j <= '9'; j++) bigfsm[j][fp->state] = nstate;
                     continue;
                 default : bigfsm[fp->ch[i]][fp->state] = nstate;
@@ -314,14 +316,24 @@ void expandlex(void) {
                 if (bigfsm[j][i] > 0) bigfsm[j][i] = ~bigfsm[j][i];
                 bigfsm[j][i] &= ~QBSBIT;
             }
-        bigfsm[EOB][i] = ~S_EOB;
-        if (bigfsm[EOFC][i] >= 0) bigfsm[EOFC][i] = ~S_EOF;
+        bigfsm[EOB][i] = ~static_cast<int>(S_EOB);
+        if (bigfsm[EOFC][i] >= 0) bigfsm[EOFC][i] = ~static_cast<int>(S_EOF);
     }
+    cxxcomment = bigfsm['/'][COM1];
 }
 
 void fixlex(void) {
     /* do C++ comments? */
-    if (Cplusplus == 0) bigfsm['/'][COM1] = bigfsm['x'][COM1];
+    bigfsm['/'][COM1] = Cplusplus ? cxxcomment : bigfsm['x'][COM1];
+}
+
+/*
+ * The start of the text of the first token of the row that was lexed into s's buffer as it is now, which fillbuf()
+ * must leave where it is; held indexes that token in trp, or is -1 for tokens an earlier call lexed.
+ */
+static inline const unsigned char* heldtext(const source* s, const token_row* trp, const token* tp, long long held) noexcept {
+    if (held < 0) return s->inb;
+    return trp->bp + held < tp ? trp->bp[held].t - trp->bp[held].wslen : nullptr;
 }
 
 /*
@@ -330,25 +342,69 @@ void fixlex(void) {
  * Reset is non-zero when the input buffer can be "rewound."
  * The value is a flag indicating that possible macros have
  * been seen in the row.
+ * The tokens point into the input buffer, so they are good until the row is put out and the next call resets.
  */
 int gettokens(token_row* trp, int reset) {
+    phase_timer timer;
+    int         nmac;
+
+    timer.begin(PREP_PHASE_LEX);
+    nmac = cursource->ahead == AHEAD_TAKEN ? takerow(trp, reset) : lexrow(cursource, trp, reset);
+    timer.end();
+    return nmac;
+}
+
+/*
+ * A source lexed ahead on the -pipeline thread, AHEAD_LEXED, touches nothing the preprocessor shares: its names are
+ * looked up, and its rows, lines and diagnostics counted, when takerow() hands the row over.
+ */
+static void lexerror(const source* s, ERRKIND type, const char* message) noexcept {
+    if (s->ahead == AHEAD_LEXED)
+        aheaderror(type, message);
+    else
+        error(type, message);
+}
+
+// gettokens() from s
+int lexrow(source* s, token_row* trp, int reset) noexcept {
     register int            c, state, oldstate;
     register unsigned char* ip;
     register token *        tp, *maxp;
+    size_t                  first; /* row index this call started at; the row may move */
+    long long               held;  /* the first token lexed into the buffer as it is now, see heldtext() */
+    const unsigned char*    text;
     int                     runelen;
-    source*                 s    = cursource;
-    int                     nmac = 0;
-    extern char             outbuf[];
+    int                     nmac  = 0;
+    const bool              ahead = s->ahead == AHEAD_LEXED;
 
-    tp = trp->lp;
-    ip = s->inp;
+    tp    = trp->lp;
+    ip    = s->inp;
+    first = tp - trp->bp;
+    held  = reset ? first : -1;
     if (reset) {
         s->lineinc = 0;
+        while (s->retired) { /* the row that needed them has been put out */
+            retired_buffer* const r = s->retired;
+            s->retired              = r->next;
+            free(r->data);
+            free(r);
+        }
+        if (s->fd >= 0 && s->ins > s->inw && s->inl - ip < static_cast<long long>(s->inw / 2)) {
+            unsigned char* const b = _checked_malloc<unsigned char>(s->inw + 4); /* back to the usual window */
+            memcpy(b, ip, 4 + s->inl - ip);
+            s->shifted += ip - s->inb;
+            s->inl      = b + (s->inl - ip);
+            s->ins      = s->inw;
+            free(s->inb);
+            ip = s->inp = s->inb = b;
+        }
         if (ip >= s->inl) { /* nothing in buffer */
-            s->inl = s->inb;
-            fillbuf(s);
+            s->shifted += ip - s->inb;
+            s->inl      = s->inb;
+            fillbuf(s, nullptr, nullptr);
             ip = s->inp = s->inb;
         } else if (ip >= s->inb + (3 * s->ins / 4)) {
+            s->shifted += ip - s->inb;
             memmove(s->inb, ip, 4 + s->inl - ip);
             s->inl = s->inb + (s->inl - ip);
             ip = s->inp = s->inb;
@@ -382,15 +438,26 @@ reswitch:
             switch (state & 0177) {
                 case S_SELF : ip += runelen; runelen = 1;
                 case S_SELFB :
-                    tp->type = GETACT(state);
+                    tp->type = static_cast<TKNTYPE>(GETACT(state));
                     tp->len  = ip - tp->t;
                     tp++;
                     goto continue2;
 
-                case S_NAME : /* like S_SELFB but with nmac check */
-                    tp->type  = NAME;
-                    tp->len   = ip - tp->t;
-                    nmac     |= quicklook(tp->t[0], tp->len > 1 ? tp->t[1] : 0);
+                case S_NAME : /* like S_SELFB but with nmac check, and the symbol id of a name in the table */
+                    tp->type = NAME;
+                    tp->len  = ip - tp->t;
+                    tp->sym  = 0;
+                    if (ahead) /* looked up as it is taken */
+                        tp->sym = hashname(tp->t, tp->len);
+                    else if (!skipping) { /* a skipped line is dropped, or a directive */
+                        const unsigned     h  = hashname(tp->t, tp->len);
+                        const nlist* const np = findname(tp->t, tp->len, h);
+                        if (np) { /* lookup() installed it, which is all there is to know */
+                            tp->sym = np->sym;
+                            nmac    = 1;
+                        } else
+                            nmac |= quicklook(h); /* only ever true while passallnames() is in effect */
+                    }
                     tp++;
                     goto continue2;
 
@@ -406,18 +473,21 @@ reswitch:
                         runelen  = 1;
                         continue;
                     }
-                    state  &= ~QBSBIT;
-                    s->inp  = ip;
-                    if (c == '?') { /* check trigraph */
-                        if (trigraph(s)) {
-                            state = oldstate;
-                            continue;
+                    state &= ~QBSBIT;
+                    if (c == '?' || c == '\\') { /* a trigraph or a line-folding, maybe */
+                        if (INCOMMENT(oldstate)) { /* nothing of a comment is kept */
+                            tp->t     = ip;
+                            tp->wslen = 0;
                         }
-                        goto reswitch;
-                    }
-                    if (c == '\\') { /* line-folding */
-                        if (foldline(s)) {
-                            s->lineinc++;
+                        s->inp = ip;
+                        text   = heldtext(s, trp, tp, held);
+                        if (c == '?' ? trigraph(s, tp, &text) : foldline(s, tp, &text)) {
+                            if (c == '\\') s->lineinc++;
+                            c = 0;
+                        }
+                        if (text == nullptr) held = tp - trp->bp;
+                        ip = s->inp;
+                        if (c == 0) {
                             state = oldstate;
                             continue;
                         }
@@ -431,14 +501,21 @@ reswitch:
                         runelen = 3;
                         goto reswitch;
                     }
-                    error(WARNING, "Lexical botch in cpp");
+                    lexerror(s, WARNING, "Lexical botch in cpp");
                     ip      += runelen;
                     runelen  = 1;
                     continue;
 
                 case S_EOB :
+                    if (INCOMMENT(oldstate)) {
+                        tp->t     = ip;
+                        tp->wslen = 0;
+                    }
                     s->inp = ip;
-                    fillbuf(cursource);
+                    text   = heldtext(s, trp, tp, held);
+                    fillbuf(s, tp, &text);
+                    if (text == nullptr) held = tp - trp->bp;
+                    ip    = s->inp;
                     state = oldstate;
                     continue;
 
@@ -446,11 +523,12 @@ reswitch:
                     tp->type = END;
                     tp->len  = 0;
                     s->inp   = ip;
-                    if (tp != trp->bp && (tp - 1)->type != NL && cursource->fd != -1) error(WARNING, "No newline at end of file");
+                    if (tp != trp->bp && (tp - 1)->type != NL && s->fd != -1) lexerror(s, WARNING, "No newline at end of file");
                     trp->lp = tp + 1;
+                    if (!ahead) prepstats.tokens += trp->lp - trp->bp - first;
                     return nmac;
 
-                case S_STNL : error(ERROR, "Unterminated string or char const");
+                case S_STNL : lexerror(s, ERROR, "Unterminated string or char const");
                 case S_NL :
                     tp->t     = ip;
                     tp->type  = NL;
@@ -459,23 +537,28 @@ reswitch:
                     s->lineinc++;
                     s->inp  = ip + 1;
                     trp->lp = tp + 1;
+                    if (!ahead) {
+                        prepstats.tokens += trp->lp - trp->bp - first;
+                        prepstats.lines++;
+                    }
                     return nmac;
 
-                case S_EOFSTR : error(FATAL, "EOF in string or char constant"); break;
+                case S_EOFSTR :
+                    lexerror(s, FATAL, "EOF in string or char constant");
+                    tp->type = END; /* ahead, where the error returns; the row is the last one taken */
+                    tp->len  = 0;
+                    s->inp   = ip;
+                    trp->lp  = tp + 1;
+                    return nmac;
 
                 case S_COMNL :
                     s->lineinc++;
                     state    = COM2;
                     ip      += runelen;
                     runelen  = 1;
-                    if (ip >= s->inb + (7 * s->ins / 8)) { /* very long comment */
-                        memmove(tp->t, ip, 4 + s->inl - ip);
-                        s->inl -= ip - tp->t;
-                        ip      = tp->t + 1;
-                    }
                     continue;
 
-                case S_EOFCOM : error(WARNING, "EOF inside comment"); --ip;
+                case S_EOFCOM : lexerror(s, WARNING, "EOF inside comment"); --ip;
                 case S_COMMENT :
                     ++ip;
                     tp->t     = ip;
@@ -493,11 +576,24 @@ reswitch:
     }
 }
 
+/*
+ * Drop the n bytes at s->inp from the input, a splice or what is left of a trigraph.  Rather than the rest of the
+ * buffer moving down over them, what tp has taken in so far, its whitespace included, moves up against what follows,
+ * so a splice costs the length of the token it falls in.  Inside a comment the lexer has already let go of it all.
+ */
+static void dropinput(source* s, token* tp, int n) noexcept {
+    unsigned char* const start = tp->t - tp->wslen;
+
+    memmove(start + n, start, s->inp - start);
+    tp->t  += n;
+    s->inp += n;
+}
+
 /* have seen ?; handle the trigraph it starts (if any) else 0 */
-int trigraph(source* s) noexcept {
+int trigraph(source* s, token* tp, const unsigned char** held) noexcept {
     int c;
 
-    while (s->inp + 2 >= s->inl && fillbuf(s) != EOF);
+    while (s->inp + 2 >= s->inl && fillbuf(s, tp, held) != EOF);
     if (s->inp[1] != '?') return 0;
     c = 0;
     switch (s->inp[2]) {
@@ -512,49 +608,72 @@ int trigraph(source* s) noexcept {
         case '-'  : c = '~'; break;
     }
     if (c) {
-        *s->inp = c;
-        memmove(s->inp + 1, s->inp + 3, s->inl - s->inp + 2);
-        s->inl -= 2;
+        s->inp[2] = c;
+        dropinput(s, tp, 2);
     }
     return c;
 }
 
-int foldline(source* s) noexcept {
+/* have seen \; splice the line it ends (if it does) */
+int foldline(source* s, token* tp, const unsigned char** held) noexcept {
     int ncr = 0;
 
 recheck:
-    while (s->inp + 1 >= s->inl && fillbuf(s) != EOF);
+    while (s->inp + ncr + 1 >= s->inl && fillbuf(s, tp, held) != EOF);
     if (s->inp[ncr + 1] == '\r') { /* nonstandardly, ignore CR before line-folding */
         ncr++;
         goto recheck;
     }
     if (s->inp[ncr + 1] == '\n') {
-        memmove(s->inp, s->inp + 2 + ncr, s->inl - s->inp + 3 - ncr);
-        s->inl -= 2 + ncr;
+        dropinput(s, tp, 2 + ncr);
         return 1;
     }
     return 0;
 }
 
-int fillbuf(source* s) noexcept {
-    int n;
-
-    while ((char*) s->inl + s->ins / 8 > (char*) s->inb + s->ins) {
-        int l = s->inl - s->inb;
-        int p = s->inp - s->inb;
-        if (l < 0) error(FATAL, "negative end of input!?");
-        if (p < 0) error(FATAL, "negative input pointer!?");
-        /* double the buffer size and try again */
-        s->ins *= 2;
-        s->inb  = _checked_realloc(s->inb, s->ins);
-        s->inl  = s->inb + l;
-        s->inp  = s->inb + p;
+/*
+ * Read the next block of input into s.  A source read from a descriptor streams through a window of its buffer: when
+ * the block does not fit, the text from the token being lexed, tp, on moves to the front of the buffer.  If tokens of
+ * the row still point into it, from *held on, it is retired instead, kept until the row is put out, and the text goes
+ * to a new buffer; either way *held becomes nullptr.  Only a token that does not fit the window grows it, so memory
+ * follows the longest row rather than the size of the input.
+ */
+int fillbuf(source* s, token* tp, const unsigned char** held) noexcept {
+    long long n;
+
+    if (s->fd >= 0 && s->inl + s->ins / 8 > s->inb + s->ins) {
+        unsigned char* const keep = tp ? tp->t - tp->wslen : s->inp;
+        const size_t         live = s->inl - keep;
+        size_t               size = s->inw;
+        unsigned char*       to;
+
+        while (live + size / 8 > size) size *= 2;
+        if (held && *held && *held < keep) {
+            retired_buffer* const r = _new_obj<retired_buffer>();
+            r->data                 = s->inb;
+            r->next                 = s->retired;
+            s->retired              = r;
+            to                      = _checked_malloc<unsigned char>(size + 4); /* slop at right for EOB */
+            memcpy(to, keep, live);
+        } else {
+            memmove(s->inb, keep, live);
+            to = size == s->ins ? s->inb : reinterpret_cast<unsigned char*>(_checked_realloc(s->inb, size + 4));
+        }
+        if (held) *held = nullptr;
+        s->shifted += keep - s->inb;
+        if (tp) tp->t = to + (tp->t - keep);
+        s->inp = to + (s->inp - keep);
+        s->inl = to + live;
+        s->inb = to;
+        s->ins = size;
     }
-    if (s->fd < 0 || (n = read(s->fd, (char*) s->inl, s->ins / 8)) <= 0) n = 0;
+    if (s->fd < 0 || (n = read(s->fd, (char*) s->inl, static_cast<unsigned>(s->ins / 8))) <= 0) n = 0;
+    if (s->ahead != AHEAD_LEXED) prepstats.bytes += n;
     if ((*s->inp & 0xff) == EOB) /* sentinel character appears in input */
         *s->inp = EOFC;
     s->inl    += n;
     s->inl[0] = s->inl[1] = s->inl[2] = s->inl[3] = EOB;
+    if (prefetchflag && n) prefetchincludes(s, s->inl - n, s->inl);
     if (n == 0) {
         s->inl[0] = s->inl[1] = s->inl[2] = s->inl[3] = EOFC;
         return EOF;
@@ -562,14 +681,44 @@ int fillbuf(source* s) noexcept {
     return 0;
 }
 
+/*
+ * Read the rest of a file source into its buffer, so that a process forked from here on, which shares the descriptor
+ * and its offset, reads nothing more from it.  Tokens of the row may point into the buffer, so it is retired.
+ */
+void readwhole(source* s) noexcept {
+    long long n;
+
+    if (s->fd < 0) return;
+    for (;;) {
+        if (s->inl + s->ins / 8 > s->inb + s->ins) {
+            unsigned char* const to = _checked_malloc<unsigned char>(2 * s->ins + 4);
+            retired_buffer* const r = _new_obj<retired_buffer>();
+            memcpy(to, s->inb, s->inl - s->inb);
+            r->data    = s->inb;
+            r->next    = s->retired;
+            s->retired = r;
+            s->inp     = to + (s->inp - s->inb);
+            s->inl     = to + (s->inl - s->inb);
+            s->inb     = to;
+            s->ins    *= 2;
+        }
+        if ((n = read(s->fd, (char*) s->inl, static_cast<unsigned>(s->ins / 8))) <= 0) break;
+        if (prefetchflag) prefetchincludes(s, s->inl, s->inl + n);
+        prepstats.bytes += n;
+        s->inl          += n;
+    }
+    s->inl[0] = s->inl[1] = s->inl[2] = s->inl[3] = EOB;
+}
+
 /*
  * Push down to new source of characters.
  * If fd>0 and str==nullptr, then from a file `name';
  * if fd==-1 and str, then from the string.
  */
-source* setsource(char* name, int fd, char* str) noexcept {
+source* setsource(const char* name, int fd, const char* str) noexcept {
     source* s = _new_obj<source>();
     int     len;
+    size_t  window = INPUT_BUFFER_SIZE;
 
     s->line     = 1;
     s->lineinc  = 0;
@@ -577,41 +726,88 @@ source* setsource(char* name, int fd, char* str) noexcept {
     s->filename = name;
     s->next     = cursource;
     s->ifdepth  = 0;
+    s->shifted  = 0;
     cursource   = s;
     /* slop at right for EOB */
     if (str) {
         len    = strlen(str);
-        s->inb = _checked_malloc(len + 4);
+        s->inb = _checked_malloc<unsigned char>(len + 4);
         s->inp = s->inb;
         strncpy((char*) s->inp, str, len);
-    } else {
-        Dir*  d;
-        int   junk;
-        ulong length = 0;
-        d            = dirfstat(fd);
-        if (d != nil) {
-            length = d->length;
-            free(d);
-        }
-        junk = length;
-        if (junk < INPUT_BUFFER_SIZE) junk = INPUT_BUFFER_SIZE;
-        s->inb = _checked_malloc((junk) + 4);
+        prepstats.bytes += len;
+    } else { /* streamed through a window of the buffer, as large as the file up to STREAM_WINDOW_MAX */
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > window) window = static_cast<size_t>(st.st_size);
+        if (window > STREAM_WINDOW_MAX) window = STREAM_WINDOW_MAX;
+        s->inb = _checked_malloc<unsigned char>(window + 4);
         s->inp = s->inb;
         len    = 0;
     }
 
-    s->ins    = INPUT_BUFFER_SIZE;
+    s->ins    = s->inw = window;
     s->inl    = s->inp + len;
     s->inl[0] = s->inl[1] = EOB;
+    if (includeprofile && fd >= 0) enterinclude(s);
+    return s;
+}
+
+/*
+ * A buffer for a source whose whole contents, len bytes, are read up front; setbuffersource() takes it over.
+ */
+unsigned char* sourcebuffer(_In_ const size_t len) noexcept {
+    return _checked_malloc<unsigned char>((len > INPUT_BUFFER_SIZE ? len : INPUT_BUFFER_SIZE) + 4); /* slop at right for EOB */
+}
+
+/*
+ * Push down to a source that already lives in memory, e.g. a buffer handed to the library or an in-memory header.
+ * The lexer writes into its buffer, so the contents are copied once; nothing touches the filesystem.
+ */
+source* setmemsource(_In_z_ const char* const name, _In_reads_(len) const char* const data, _In_ const size_t len) noexcept {
+    unsigned char* const buffer = sourcebuffer(len);
+
+    if (len) ::memcpy(buffer, data, len);
+    return setbuffersource(name, buffer, len);
+}
+
+/*
+ * Push down to the len bytes in buffer, from sourcebuffer(), which the source owns from here on.
+ */
+source* setbuffersource(_In_z_ const char* const name, _In_ unsigned char* const buffer, _In_ const size_t len) noexcept {
+    source* s = _new_obj<source>();
+
+    s->line     = 1;
+    s->lineinc  = 0;
+    s->fd       = MEMORY_SOURCE;
+    s->filename = name;
+    s->next     = cursource;
+    s->ifdepth  = 0;
+    s->shifted  = 0;
+    cursource   = s;
+    s->ins      = s->inw = len > INPUT_BUFFER_SIZE ? len : INPUT_BUFFER_SIZE;
+    s->inb      = buffer;
+    s->inp      = s->inb;
+    prepstats.bytes += len;
+    s->inl    = s->inp + len;
+    s->inl[0] = s->inl[1] = EOB;
+    if (includeprofile) enterinclude(s);
     return s;
 }
 
 void unsetsource() noexcept {
     source* s = cursource;
 
+    if (includeprofile && (s->fd >= 0 || s->fd == MEMORY_SOURCE)) leaveinclude();
+
     if (s->fd >= 0) {
         close(s->fd);
         free(s->inb);
+    } else if (s->fd == MEMORY_SOURCE)
+        free(s->inb);
+    while (s->retired) {
+        retired_buffer* const r = s->retired;
+        s->retired              = r->next;
+        free(r->data);
+        free(r);
     }
     cursource = s->next;
     free(s);
@@ -0,0 +1,115 @@
+#include <csetjmp>
+
+#include <prep.hpp>
+
+// the library entry point, drives the same machinery as main() but reads from and writes to memory
+
+// puts every piece of per run state back to where a fresh process would have it
+static void resetstate(_In_opt_ const prep_options* const options) noexcept {
+    while (cursource) unsetsource(); // left over when the previous run ended with a fatal error
+    resetexpansion();
+    curphase    = PREP_PHASE_OTHER; /* the timers a fatal error jumped past never put theirs back */
+    macronested = 0;
+    macrodepth  = 0;
+    nerrs       = 0;
+    incdepth = 0;
+    ifdepth  = 0;
+    skipping = 0;
+    ::memset(ifsatisfied, 0, sizeof(ifsatisfied));
+    ::memset(includelist, 0, sizeof(include_list) * MAX_INCLUDE_DIRS);
+    Mflag          = 0;
+    verbose        = 0;
+    wd[0]          = '\0';
+    kwdefined->val = NAME;
+    statsflag      = options && options->timephases;
+    Cplusplus      = options && options->cplusplus;
+    nolineinfo     = options && (options->nolineinfo || options->tokensink); // a token sink gets the locations with every line
+    fixlex();
+    resetmacros();
+    init_hideset();
+    cleardependencies();
+}
+
+int preprocess(
+    _In_reads_(len) const char* const data, _In_ const size_t len, _In_opt_ const prep_options* const options, _Out_ prep_result* const result
+) noexcept {
+    static bool      initialized {};
+    static token_row tknrow {};
+    static jmp_buf   jump {};
+    strbuf           out {}, diag {};
+    const char*      filename = options && options->filename ? options->filename : "<memory>";
+    const char*      slash = ::strrchr(filename, '/');
+    char*            dir   = slash ? (char*) newstring((unsigned char*) filename, slash - filename, 0) : nullptr;
+    char*            name  = (char*) newstring((unsigned char*) filename, strlen(filename), 0); // the source's, freed with dir
+    size_t           i {};
+
+    ::memset(result, 0, sizeof(prep_result));
+    if (!initialized) {
+        maketokenrow(3, &tknrow);
+        expandlex();
+        initkeywords();
+        init_hideset();
+        initialized = true;
+    }
+    resetstate(options);
+    startstats();
+    tknrow.tp = tknrow.lp = tknrow.bp;
+    outmemory             = &out;
+    tokensink             = options ? options->tokensink : nullptr;
+    tokensinkcontext      = options ? options->sinkcontext : nullptr;
+    diagnostics           = &diag;
+    memfiles              = options ? options->files : nullptr;
+    nmemfiles             = options ? options->nfiles : 0;
+
+    if (setjmp(jump) == 0) {
+        fatal_jump = &jump;
+        settime(); /* a bad SOURCE_DATE_EPOCH is an error of this run, not the end of the program that called it */
+        // -I directories are searched from the high end of includelist, the last slot is the directory of the input
+        for (i = 0; options && i < options->nincludedirs && i < MAX_INCLUDE_DIRS - 1; i++) {
+            includelist[MAX_INCLUDE_DIRS - 2 - i].file   = options->includedirs[i];
+            includelist[MAX_INCLUDE_DIRS - 2 - i].always = 1;
+        }
+        if (options && i < options->nincludedirs) error(WARNING, "Too many -I directives");
+        includelist[MAX_INCLUDE_DIRS - 1].file = dir ? dir : ".";
+        for (i = 0; options && i < options->ndefines; i++) definearg(const_cast<char*>(options->defines[i]), 'D');
+        for (i = 0; options && i < options->nundefines; i++) definearg(const_cast<char*>(options->undefines[i]), 'U');
+
+        setmemsource(name, data, len);
+        genline();
+        process(&tknrow);
+    }
+    flushout();
+    stopstats();
+    statsflag   = 0;
+    fatal_jump  = nullptr;
+    outmemory   = nullptr;
+    tokensink   = nullptr;
+    diagnostics = nullptr;
+    memfiles    = nullptr;
+    nmemfiles   = 0;
+    while (cursource) unsetsource();
+    free(dir);
+    free(name);
+
+    if (!out.data) strbuf_append(&out, "", 0);
+    if (!diag.data) strbuf_append(&diag, "", 0);
+    result->output        = out.data;
+    result->outlen        = out.len;
+    result->diagnostics   = diag.data;
+    result->diaglen       = diag.len;
+    result->dependencies  = dependencies;
+    result->ndependencies = ndependencies;
+    result->nerrors       = nerrs;
+    result->stats         = prepstats;
+    dependencies          = nullptr; // ownership moves to the result
+    ndependencies         = 0;
+    return nerrs;
+}
+
+void prep_freeresult(_Inout_ prep_result* const result) noexcept {
+    free(result->output);
+    free(result->diagnostics);
+    for (size_t i = 0; i < result->ndependencies; i++) free(result->dependencies[i]);
+    free(result->dependencies);
+    ::memset(result, 0, sizeof(prep_result));
+}
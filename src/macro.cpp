@@ -2,6 +2,42 @@
 
 #include <prep.hpp>
 
+/*
+ * Compile np's replacement list into its template: runs of plain tokens, and the parameters with what
+ * substargs() is to do with them, resolved once so that an expansion compares no names.
+ */
+static void compiletemplate(nlist* np) noexcept {
+    const int       n  = tokenrow_len(np->vp);
+    token*          tp = np->vp->bp;
+    macro_template* mt = np->tpl;
+    macro_slot*     s;
+    int             i, argno;
+
+    if (mt == nullptr) mt = np->tpl = _new_obj<macro_template>();
+    free(mt->slots);
+    mt->vp     = np->vp;
+    mt->nslots = 0;
+    mt->slots  = _checked_malloc<macro_slot>(n ? n : 1); /* at most one per token */
+    for (i = 0; i < n;) {
+        s = &mt->slots[mt->nslots];
+        if (tp[i].type == SHARP) {
+            if (i + 1 < n && (argno = lookuparg(np, &tp[i + 1])) >= 0)
+                *s = { SLOT_STRINGIFY, false, argno, 2 };
+            else
+                *s = { SLOT_SHARP, false, i, 1 };
+        } else if (tp[i].type == NAME && (argno = lookuparg(np, &tp[i])) >= 0)
+            *s = { SLOT_ARG, i + 1 < n && tp[i + 1].type == DSHARP, argno, 1 };
+        else if (mt->nslots && s[-1].kind == SLOT_TEXT) { /* extend the run */
+            s[-1].count++;
+            i++;
+            continue;
+        } else
+            *s = { SLOT_TEXT, false, i, 1 };
+        i += s->kind == SLOT_STRINGIFY ? 2 : 1;
+        mt->nslots++;
+    }
+}
+
 /*
  * do a macro definition.  tp points to the name being defined in the line
  */
@@ -58,6 +94,8 @@ void dodefine(token_row* trp) {
             }
             if (err) {
                 error(ERROR, "Syntax error in macro parameters");
+                free(args->bp);
+                free(args);
                 return;
             }
         }
@@ -65,21 +103,25 @@ void dodefine(token_row* trp) {
     }
     trp->tp = tp;
     if (((trp->lp) - 1)->type == NL) trp->lp -= 1;
-    def = normtokenrow(trp);
+    def = newdefinition(trp);
     if (np->flag & DEFINED_VALUE) {
         if (comparetokens(def, np->vp) || (np->ap == nullptr) != (args == nullptr) || np->ap && comparetokens(args, np->ap))
             error(ERROR, "Macro redefinition of %t", trp->bp + 2);
     }
     if (args) {
         token_row* tap;
-        tap = normtokenrow(args);
+        tap = newdefinition(args);
         free(args->bp);
+        free(args);
         args = tap;
     }
-    np->ap    = args;
-    np->vp    = def;
-    np->flag |= DEFINED_VALUE;
+    changemacro(np);
+    setdefinition(np, def, args);
+    np->flag    |= DEFINED_VALUE;
+    np->deffile  = cursource->filename;
+    np->defline  = cursource->line;
     if (dots) np->flag |= VARIADIC_MACRO;
+    if (args) compiletemplate(np);
 }
 
 /*
@@ -89,7 +131,7 @@ void doadefine(token_row* trp, int type) {
     nlist*               np;
     static unsigned char one[]       = "1";
     static token         onetoken[1] = {
-        { NUMBER, 0, 0, 0, 1, one }
+        { NUMBER, 0, 0, 0, 1, 0, one }
     };
     static token_row onetr = { onetoken, onetoken, onetoken + 1, 1 };
 
@@ -97,38 +139,160 @@ void doadefine(token_row* trp, int type) {
     if (type == 'U') {
         if (trp->lp - trp->tp != 2 || trp->tp->type != NAME) goto syntax;
         if ((np = lookup(trp->tp, 0)) == nullptr) return;
+        changemacro(np);
         np->flag &= ~DEFINED_VALUE;
         return;
     }
     if (trp->tp >= trp->lp || trp->tp->type != NAME) goto syntax;
-    np        = lookup(trp->tp, 1);
-    np->flag |= DEFINED_VALUE;
-    trp->tp  += 1;
+    np = lookup(trp->tp, 1);
+    changemacro(np);
+    np->flag    |= DEFINED_VALUE;
+    np->deffile  = "<cmdarg>";
+    np->defline  = 0;
+    trp->tp     += 1;
     if (trp->tp >= trp->lp || trp->tp->type == END) {
-        np->vp = &onetr;
+        setdefinition(np, newdefinition(&onetr), np->ap);
         return;
     }
     if (trp->tp->type != ASGN) goto syntax;
     trp->tp += 1;
     if ((trp->lp - 1)->type == END) trp->lp -= 1;
-    np->vp = normtokenrow(trp);
+    setdefinition(np, newdefinition(trp), np->ap);
     return;
 syntax:
     error(FATAL, "Illegal -D or -U argument %r", trp);
 }
 
 /*
- * Do macro expansion in a row of tokens.
- * Flag is nullptr if more input can be gathered.
+ * The expansion work stack.  Expanding a row used to recurse, expandrow() into expand() into substargs() and back
+ * into expandrow() for every argument, with a fake source pushed per row to name it in diagnostics.  Instead a row
+ * being scanned and a call waiting for its arguments to expand are each a frame here, expandrow() runs whatever frame
+ * is on top until its own is done, and a row's label stays in its frame.  Frames live in blocks that are kept from
+ * one expansion to the next and never move, so a frame may point into itself.
  */
-void expandrow(token_row* trp, char* flag, int inmacro) {
-    token* tp;
-    nlist* np;
+static constexpr size_t FRAMES_PER_BLOCK { 64 };
+
+enum FRAMEKIND : unsigned char { FRAME_ROW, FRAME_CALL };
+
+struct expansion_frame final {
+        FRAMEKIND     kind;
+        int           inmacro;
+        token_row*    trp;      // the row scanned, or the row the call was gathered from
+        const char*   label;    // a row that cannot gather more input, as diagnostics name it
+        const source* under;    // on top when the row was pushed, the label comes right before it in diagnostics
+        nlist*        np;       // the macro called
+        int           ntokc;    // tokens of the call in trp
+        int           slot;     // the next template slot to substitute
+        int           space;
+        macro_args    args;
+        token_row     ntr;      // the replacement being built
+        long long     held;     // tokens set aside for ntr and the copies of the arguments
+        token_row*    expanded; // the arguments macro expanded, bp nullptr and max -1 until they are
+        token_row     inlined[MACRO_ARGS_INLINE];
+        macro_timer   timer;
+        double        substart;
+};
+
+/*
+ * every call nested in the argument of another holds a copy of what is left of it, so F(F(...F(1)...)) holds tokens
+ * by the square of its depth. past maxexpansionsize of them it is taken for a runaway and stopped.
+ */
+int              maxexpansionsize { MAX_EXPANSION_SIZE };
+static long long heldtokens {};
+
+static expansion_frame** frameblocks {};
+static size_t            nframeblocks {};
+static size_t            nframes {};
+
+static inline expansion_frame* frameat(size_t i) noexcept { return &frameblocks[i / FRAMES_PER_BLOCK][i % FRAMES_PER_BLOCK]; }
+
+static expansion_frame* pushframe(FRAMEKIND kind, token_row* trp, const char* label, int inmacro) noexcept {
+    expansion_frame* f;
+
+    if (nframes == nframeblocks * FRAMES_PER_BLOCK) {
+        frameblocks = reinterpret_cast<expansion_frame**>(_checked_realloc(frameblocks, (nframeblocks + 1) * sizeof(expansion_frame*)));
+        frameblocks[nframeblocks++] = _checked_malloc<expansion_frame>(FRAMES_PER_BLOCK);
+    }
+    f          = frameat(nframes++);
+    f->kind    = kind;
+    f->inmacro = inmacro;
+    f->trp     = trp;
+    f->label   = label;
+    f->under   = cursource;
+    f->held    = 0;
+    return f;
+}
+
+// counts n more tokens set aside for the call of frame f
+static void holdtokens(expansion_frame* f, long long n) noexcept {
+    f->held    += n;
+    heldtokens += n;
+    if (heldtokens > maxexpansionsize) error(FATAL, "Macro expansion holds more than %d tokens, see -max-expansion-size", maxexpansionsize);
+}
+
+// drops what a fatal error left on the stack, the rows in it are not freed
+void resetexpansion(void) noexcept {
+    nframes    = 0;
+    heldtokens = 0;
+}
+
+// appends the labels of the rows in expansion that were pushed over s, innermost first
+void expansionlabels(strbuf* buf, const source* s) noexcept {
+    for (size_t i = nframes; i-- > 0;) {
+        const expansion_frame* const f = frameat(i);
+        if (f->kind != FRAME_ROW || f->label == nullptr || f->under != s) continue;
+        strbuf_append(buf, f->label, ::strlen(f->label));
+        strbuf_append(buf, ":1 ", 3);
+    }
+}
+
+/*
+ * More tokens for the macro call gatherargs() is looking at.  Only the row being expanded from the input can read
+ * more of it; a row with a label gets an END, as its fake source used to give.
+ */
+static void moretokens(token_row* trp) {
+    static unsigned char nothing[1];
+
+    for (size_t i = nframes; i-- > 0;) {
+        const expansion_frame* const f = frameat(i);
+        if (f->kind != FRAME_ROW) continue;
+        if (f->label == nullptr) break;
+        if (trp->lp >= trp->bp + trp->max) growtokenrow(trp);
+        *trp->lp++ = { END, 0, 0, 0, 0, 0, nothing };
+        prepstats.tokens++;
+        return;
+    }
+    if (configgroup > 1 || pendingrows)
+        gatherline(trp);
+    else
+        gettokens(trp, 0);
+}
+
+static void substargs(expansion_frame*);
+
+/*
+ * Scan the row of frame f from trp->tp, expanding what is found.  Returns with the frame popped when the row is done,
+ * or early with a call pushed over it, which moves trp->tp to where the scan goes on once the call is replaced.
+ */
+static void scanrow(expansion_frame* f) {
+    token_row* const trp = f->trp;
+    token*           tp;
+    nlist*           np;
 
-    if (flag) setsource(flag, -1, "");
     for (tp = trp->tp; tp < trp->lp;) {
-        if (tp->type != NAME || quicklook(tp->t[0], tp->len > 1 ? tp->t[1] : 0) == 0 || (np = lookup(tp, 0)) == nullptr ||
-            (np->flag & (DEFINED_VALUE | BUILTIN)) == 0 || tp->hideset && check_hideset(tp->hideset, np)) {
+        np = nullptr;
+        if (tp->type == NAME) {
+            if (tp->sym) /* the lexer found it installed */
+                np = lookup(tp, 0);
+            else {
+                prepstats.filterchecks++;
+                if (quicklook(hashname(tp->t, tp->len))) {
+                    prepstats.filterpasses++;
+                    if ((np = lookup(tp, 0)) == nullptr) prepstats.filtermisses++;
+                }
+            }
+        }
+        if (np == nullptr || (np->flag & (DEFINED_VALUE | BUILTIN)) == 0 || tp->hideset && check_hideset(tp->hideset, np)) {
             tp++;
             continue;
         }
@@ -146,50 +310,78 @@ void expandrow(token_row* trp, char* flag, int inmacro) {
         }
         if (np->flag & BUILTIN)
             builtin(trp, np->val);
-        else
-            expand(trp, np, inmacro);
+        else if (!expand(trp, np, f->inmacro))
+            return;
         tp = trp->tp;
     }
-    if (flag) unsetsource();
+    nframes--;
 }
 
 /*
- * Expand the macro whose name is np, at token trp->tp, in the tokenrow.
- * Return trp->tp at the first token next to be expanded
- * (ordinarily the beginning of the expansion)
+ * Do macro expansion in a row of tokens.
+ * Flag is nullptr if more input can be gathered, else it labels the row in diagnostics.
  */
-void expand(token_row* trp, nlist* np, int inmacro) {
-    token_row  ntr;
-    int        ntokc, narg, i;
-    token*     tp;
-    token_row* atr[MAX_MACRO_ARGS + 1];
-    int        hs;
-
-    copytokenrow(&ntr, np->vp); /* copy macro value */
-    if (np->ap == nullptr)      /* parameterless */
-        ntokc = 1;
-    else {
-        ntokc = gatherargs(trp, atr, (np->flag & VARIADIC_MACRO) ? tokenrow_len(np->ap) : 0, &narg);
-        if (narg < 0) { /* not actually a call (no '(') */
-                        /* error(WARNING, "%d %r\n", narg, trp); */
-            /* gatherargs has already pushed trp->tr to the next token */
-            return;
-        }
-        if (narg != tokenrow_len(np->ap)) {
-            error(ERROR, "Disagreement in number of macro arguments");
-            trp->tp->hideset  = new_hideset(trp->tp->hideset, np);
-            trp->tp          += ntokc;
-            return;
-        }
-        substargs(np, &ntr, atr); /* put args into replacement */
-        for (i = 0; i < narg; i++) {
-            free(atr[i]->bp);
-            free(atr[i]);
+void expandrow(token_row* trp, const char* flag, int inmacro) {
+    const size_t base = nframes;
+
+    pushframe(FRAME_ROW, trp, flag, inmacro);
+    while (nframes > base) {
+        expansion_frame* const f = frameat(nframes - 1);
+        if (f->kind == FRAME_ROW)
+            scanrow(f);
+        else
+            substargs(f);
+    }
+}
+
+/*
+ * How many leading tokens of np's expansion hold no name the rescan could expand: tokens copied from the body as
+ * they are, up to the first name the filter lets through, parameter, # or operand of ##. The filter only grows, so
+ * the count holds until the body changes or a name is added to the filter.
+ */
+static int inertprefix(nlist* np) noexcept {
+    const token* const bp = np->vp->bp;
+    int                n, limit;
+
+    if (np->inertvp == np->vp && np->inertgen == namefiltergen) return np->inert;
+    limit = tokenrow_len(np->vp);
+    if (np->ap) /* the template is up to date, substargs() has just used it */
+        limit = np->tpl->nslots && np->tpl->slots[0].kind == SLOT_TEXT ? np->tpl->slots[0].count : 0;
+    for (n = 0; n < limit; n++) {
+        if (bp[n].type == DSHARP) { /* the token before it is pasted into something new */
+            if (n) n--;
+            break;
         }
+        if (bp[n].type == NAME && (bp[n].sym || quicklook(hashname(bp[n].t, bp[n].len)))) break;
+    }
+    np->inertvp  = np->vp;
+    np->inertgen = namefiltergen;
+    np->inert    = n;
+    return n;
+}
+
+/*
+ * Put the expansion ntr of np in place of the ntokc tokens of its call at trp->tp, and leave
+ * trp->tp at the first token next to be expanded (ordinarily the first token of the expansion that may expand again)
+ */
+static void replace(token_row* trp, nlist* np, token_row* ntr, int ntokc, int inmacro, macro_timer* timer) {
+    token* tp;
+    int    hs;
+    double t {};
+
+    if (!(np->flag & UNCHANGEABLE)) { /* defined standing for itself outside #if is no macro */
+        prepstats.expansions++;
+        np->nexpand++;
+    }
+    if (timer->cost) t = profileclock();
+    if (!inmacro) doconcat(ntr); /* execute ## operators */
+    if (timer->cost) {
+        timer->cost->concattime += profileclock() - t;
+        timer->cost->tokens     += tokenrow_len(ntr);
+        timer->cost->calls++;
     }
-    if (!inmacro) doconcat(&ntr); /* execute ## operators */
     hs = new_hideset(trp->tp->hideset, np);
-    for (tp = ntr.bp; tp < ntr.lp; tp++) { /* distribute hidesets */
+    for (tp = ntr->bp; tp < ntr->lp; tp++) { /* distribute hidesets */
         if (tp->type == NAME) {
             if (tp->hideset == 0)
                 tp->hideset = hs;
@@ -197,25 +389,93 @@ void expand(token_row* trp, nlist* np, int inmacro) {
                 tp->hideset = unionhideset(tp->hideset, hs);
         }
     }
-    ntr.tp = ntr.bp;
-    insertrow(trp, ntokc, &ntr);
-    trp->tp -= tokenrow_len(&ntr);
-    free(ntr.bp);
-    return;
+    ntr->tp = ntr->bp;
+    insertrow(trp, ntokc, ntr);
+    trp->tp -= tokenrow_len(ntr) - inertprefix(np); /* rescan from the first token that may expand */
+    free(ntr->bp);
+    timer->end();
+}
+
+/*
+ * Expand the macro whose name is np, at token trp->tp, in the tokenrow.
+ * An object-like macro is replaced at once.  A call of a function-like one has its arguments gathered
+ * and is pushed on the work stack for substargs(); false means it was.
+ */
+bool expand(token_row* trp, nlist* np, int inmacro) {
+    expansion_frame* f {};
+    macro_timer      local, *timer = &local;
+    token_row        ntr;
+    int              narg, nargs, size, i;
+    const macro_slot *s, *se;
+    double           t {};
+
+    if (np->ap) {
+        f     = pushframe(FRAME_CALL, trp, nullptr, inmacro);
+        f->np = np;
+        timer = &f->timer;
+    }
+    timer->begin(np);
+    if (timer->cost) {
+        const int depth = macrodepth - 1 + sizeof_hideset(trp->tp->hideset); // expansions whose arguments or rescan this one sits in
+        if (depth > timer->cost->maxdepth) timer->cost->maxdepth = depth;
+    }
+    if (f == nullptr) {             /* parameterless */
+        copytokenrow(&ntr, np->vp); /* copy macro value */
+        replace(trp, np, &ntr, 1, inmacro, timer);
+        return true;
+    }
+    f->args.views = f->args.inlined;
+    f->args.max   = MACRO_ARGS_INLINE;
+    if (timer->cost) t = profileclock();
+    f->ntokc = gatherargs(trp, &f->args, (np->flag & VARIADIC_MACRO) ? tokenrow_len(np->ap) : 0, &narg);
+    if (timer->cost) timer->cost->gathertime += profileclock() - t;
+    if (narg < 0) { /* not actually a call (no '(') */
+                    /* error(WARNING, "%d %r\n", narg, trp); */
+        /* gatherargs has already pushed trp->tr to the next token */
+        nframes--;
+        timer->end();
+        return true;
+    }
+    if (narg != tokenrow_len(np->ap)) {
+        error(ERROR, "Disagreement in number of macro arguments");
+        trp->tp->hideset  = new_hideset(trp->tp->hideset, np);
+        trp->tp          += f->ntokc;
+        if (f->args.views != f->args.inlined) free(f->args.views);
+        nframes--;
+        timer->end();
+        return true;
+    }
+    if (np->tpl == nullptr || np->tpl->vp != np->vp) compiletemplate(np);
+    nargs       = tokenrow_len(np->ap);
+    f->expanded = nargs <= static_cast<int>(MACRO_ARGS_INLINE) ? f->inlined : _checked_malloc<token_row>(nargs);
+    for (i = 0; i < nargs; i++) {
+        f->expanded[i].bp  = nullptr;
+        f->expanded[i].max = -1; /* not expanded yet */
+    }
+    size = tokenrow_len(np->vp) + 1;
+    for (s = np->tpl->slots, se = s + np->tpl->nslots; s < se; s++)
+        if (s->kind == SLOT_ARG) size += tokenrow_len(&f->args.views[s->arg]);
+    maketokenrow(size, &f->ntr);
+    holdtokens(f, size);
+    f->slot  = 0;
+    f->space = 0;
+    if (timer->cost) f->substart = profileclock();
+    return false;
 }
 
 /*
  * Gather an arglist, starting in trp with tp pointing at the macro name.
  * Return total number of tokens passed, stash number of args found.
  * trp->tp is not changed relative to the tokenrow.
+ * The arguments are views of trp, nothing is copied; they stay valid until trp changes.
  */
-int gatherargs(token_row* trp, token_row** atr, int dots, int* narg) {
-    int       parens = 1;
-    int       ntok   = 0;
-    token *   bp, *lp;
-    token_row ttr;
-    int       ntokp;
-    int       needspace;
+int gatherargs(token_row* trp, macro_args* args, int dots, int* narg) {
+    int        parens = 1;
+    int        ntok   = 0;
+    token *    bp, *lp;
+    token_row* view;
+    int        ntokp;
+    int        needspace;
 
     *narg = -1; /* means that there is no macro call */
     /* look for the ( */
@@ -223,7 +483,7 @@ int gatherargs(token_row* trp, token_row** atr, int dots, int* narg) {
         trp->tp++;
         ntok++;
         if (trp->tp >= trp->lp) {
-            gettokens(trp, 0);
+            moretokens(trp);
             if ((trp->lp - 1)->type == END) {
                 /* error(WARNING, "reach END\n"); */
                 trp->lp -= 1;
@@ -241,7 +501,7 @@ int gatherargs(token_row* trp, token_row** atr, int dots, int* narg) {
     /* search for the terminating ), possibly extending the row */
     needspace = 0;
     while (parens > 0) {
-        if (trp->tp >= trp->lp) gettokens(trp, 0);
+        if (trp->tp >= trp->lp) moretokens(trp);
         if (needspace) {
             needspace = 0;
             makespace(trp);
@@ -279,52 +539,87 @@ int gatherargs(token_row* trp, token_row** atr, int dots, int* narg) {
         if (lp->type == DSHARP) lp->type = DSHARP1; /* ## not special in arg */
         if ((lp->type == COMMA && parens == 0) || (parens < 0 && (lp - 1)->type != LP)) {
             if (lp->type == COMMA && dots && *narg == dots - 1) continue;
-            if (*narg >= MAX_MACRO_ARGS - 1) error(FATAL, "Sorry, too many macro arguments");
-            ttr.bp = ttr.tp = bp;
-            ttr.lp          = lp;
-            atr[(*narg)++]  = normtokenrow(&ttr);
-            bp              = lp + 1;
+            if (*narg == args->max) {
+                args->max *= 2;
+                if (args->views == args->inlined) {
+                    args->views = _checked_malloc<token_row>(args->max);
+                    memcpy(args->views, args->inlined, sizeof(args->inlined));
+                } else
+                    args->views = reinterpret_cast<token_row*>(_checked_realloc(args->views, args->max * sizeof(token_row)));
+            }
+            view     = &args->views[(*narg)++];
+            view->bp = view->tp = bp;
+            view->lp            = lp;
+            view->max           = 0; /* not owned */
+            bp                  = lp + 1;
         }
     }
     return ntok;
 }
 
 /*
- * substitute the argument list into the replacement string
+ * Append n tokens to rtr.  With space set, they come right after an argument,
+ * and the first gets the whitespace insertrow() gives the token after its insertion.
+ */
+static void appendtokens(token_row* rtr, const token* tp, int n, int space) {
+    while (tokenrow_len(rtr) + n > rtr->max) growtokenrow(rtr);
+    if (n) memcpy(rtr->lp, tp, n * sizeof(token));
+    rtr->tp  = rtr->lp;
+    rtr->lp += n;
+    if (space) makespace(rtr);
+}
+
+/*
+ * substitute the argument list into the replacement list of the call on top of the work stack, building f->ntr from
+ * its template, and replace the call with it.  An argument is macro expanded once, however many times its parameter
+ * appears; that pushes its row over the call, and substitution picks up again at the same slot once it is done.
  *  This would be simple except for ## and #
  */
-void substargs(nlist* np, token_row* rtr, token_row** atr) {
-    token_row tatr;
-    token*    tp;
-    int       ntok, argno;
-
-    for (rtr->tp = rtr->bp; rtr->tp < rtr->lp;) {
-        if (rtr->tp->type == SHARP) { /* string operator */
-            tp       = rtr->tp;
-            rtr->tp += 1;
-            if ((argno = lookuparg(np, rtr->tp)) < 0) {
-                error(ERROR, "# not followed by macro parameter");
+static void substargs(expansion_frame* f) {
+    nlist* const      np    = f->np;
+    token_row* const  rtr   = &f->ntr;
+    token_row* const  atr   = f->args.views;
+    const int         nargs = tokenrow_len(np->ap);
+    const macro_slot *s, *se;
+    int               i;
+
+    for (s = np->tpl->slots + f->slot, se = np->tpl->slots + np->tpl->nslots; s < se; s++) {
+        switch (s->kind) {
+            case SLOT_SHARP : error(ERROR, "# not followed by macro parameter"); /* and the # stays */
+            case SLOT_TEXT :
+                appendtokens(rtr, np->vp->bp + s->arg, s->count, f->space);
+                f->space = 0;
                 continue;
-            }
-            ntok    = 1 + (rtr->tp - tp);
-            rtr->tp = tp;
-            insertrow(rtr, ntok, stringify(atr[argno]));
-            continue;
-        }
-        if (rtr->tp->type == NAME && (argno = lookuparg(np, rtr->tp)) >= 0) {
-            if (rtr->tp < rtr->bp) error(ERROR, "access out of bounds");
-            if ((rtr->tp + 1)->type == DSHARP || rtr->tp != rtr->bp && (rtr->tp - 1)->type == DSHARP)
-                insertrow(rtr, 1, atr[argno]);
-            else {
-                copytokenrow(&tatr, atr[argno]);
-                expandrow(&tatr, "<macro>", IN_MACRO);
-                insertrow(rtr, 1, &tatr);
-                free(tatr.bp);
-            }
-            continue;
+            case SLOT_STRINGIFY : /* string operator */
+                normargument(&atr[s->arg]);
+                appendtokens(rtr, stringify(&atr[s->arg])->bp, 1, 1);
+                break;
+            case SLOT_ARG :
+                normargument(&atr[s->arg]);
+                if (s->pasted || rtr->lp > rtr->bp && (rtr->lp - 1)->type == DSHARP)
+                    appendtokens(rtr, atr[s->arg].bp, tokenrow_len(&atr[s->arg]), 1);
+                else {
+                    if (f->expanded[s->arg].max < 0) {
+                        copytokenrow(&f->expanded[s->arg], &atr[s->arg]);
+                        holdtokens(f, tokenrow_len(&atr[s->arg]));
+                        f->slot = static_cast<int>(s - np->tpl->slots);
+                        pushframe(FRAME_ROW, &f->expanded[s->arg], "<macro>", IN_MACRO);
+                        return;
+                    }
+                    appendtokens(rtr, f->expanded[s->arg].bp, tokenrow_len(&f->expanded[s->arg]), 1);
+                }
+                break;
         }
-        rtr->tp++;
+        f->space = 1;
     }
+    rtr->tp     = rtr->lp;
+    heldtokens -= f->held;
+    for (i = 0; i < nargs; i++) free(f->expanded[i].bp);
+    if (f->expanded != f->inlined) free(f->expanded);
+    if (f->args.views != f->args.inlined) free(f->args.views);
+    if (f->timer.cost) f->timer.cost->substtime += profileclock() - f->substart;
+    nframes--; /* the frame stays put until something else is pushed */
+    replace(f->trp, np, rtr, f->ntokc, f->inmacro, &f->timer);
 }
 
 /*
@@ -382,34 +677,35 @@ int lookuparg(nlist* mac, token* tp) {
 
 /*
  * Return a quoted version of the tokenrow (from # arg)
+ * The string is measured first and then written straight into the line's storage.
  */
-#define STRLEN 512
 token_row* stringify(token_row* vp) {
     static token     t  = { STRING };
     static token_row tr = { &t, &t, &t + 1, 1 };
     token*           tp;
-    unsigned char    s[STRLEN];
-    unsigned char *  sp = s, *cp;
+    unsigned char *  sp, *cp;
+    size_t           len;
     int              i, instring;
 
+    len = 2;
+    for (tp = vp->bp; tp < vp->lp; tp++) {
+        instring  = tp->type == STRING || tp->type == CCON;
+        len      += tp->len + (tp->wslen ? 1 : 0);
+        for (i = 0, cp = tp->t; instring && i < tp->len; i++, cp++)
+            if (*cp == '"' || *cp == '\\') len++;
+    }
+    t.t   = sp = linespace(len);
+    t.len = len;
     *sp++ = '"';
     for (tp = vp->bp; tp < vp->lp; tp++) {
         instring = tp->type == STRING || tp->type == CCON;
-        if (sp + 2 * tp->len >= &s[STRLEN - 10]) {
-            error(ERROR, "Stringified macro arg is too long");
-            break;
-        }
         if (tp->wslen /* && (tp->flag&XPWS)==0 */) *sp++ = ' ';
         for (i = 0, cp = tp->t; i < tp->len; i++) {
             if (instring && (*cp == '"' || *cp == '\\')) *sp++ = '\\';
             *sp++ = *cp++;
         }
     }
-    *sp++ = '"';
-    *sp   = '\0';
-    sp    = s;
-    t.len = strlen((char*) sp);
-    t.t   = newstring(sp, t.len, 0);
+    *sp = '"';
     return &tr;
 }
 
@@ -417,7 +713,7 @@ token_row* stringify(token_row* vp) {
  * expand a builtin name
  */
 void builtin(token_row* trp, int biname) {
-    char*   op;
+    char *  p, *op;
     token*  tp;
     source* s;
 
@@ -429,11 +725,12 @@ void builtin(token_row* trp, int biname) {
     if (s == nullptr) s = cursource;
     /* most are strings */
     tp->type = STRING;
+    p        = (char*) linespace(strlen(s->filename) + 16); /* room for the longest of them, quotes and a blank */
     if (tp->wslen) {
-        *outp++   = ' ';
+        *p++      = ' ';
         tp->wslen = 1;
     }
-    op    = outp;
+    op    = p;
     *op++ = '"';
     switch (biname) {
         case KLINENO :
@@ -447,12 +744,14 @@ void builtin(token_row* trp, int biname) {
             break;
 
         case KDATE :
+            clockread = true;
             strncpy(op, current_time + 4, 7);
-            strncpy(op + 7, current_time + 24, 4); /* Plan 9 asctime disobeys standard */
+            strncpy(op + 7, current_time + 20, 4); /* the year, after the time */
             op += 11;
             break;
 
         case KTIME :
+            clockread = true;
             strncpy(op, current_time + 11, 8);
             op += 8;
             break;
@@ -460,7 +759,6 @@ void builtin(token_row* trp, int biname) {
         default : error(ERROR, "cpp botch: unknown internal macro"); return;
     }
     if (tp->type == STRING) *op++ = '"';
-    tp->t   = (unsigned char*) outp;
-    tp->len = op - outp;
-    outp    = op;
+    tp->t   = (unsigned char*) p;
+    tp->len = op - p;
 }
@@ -1,17 +1,40 @@
 #include <prep.hpp>
 
-extern int   getopt(int, char**, char*);
-extern char* optarg;
-extern int   optind;
-int          verbose;
-int          Mflag;
-int          Cplusplus;
-int          nolineinfo;
-nlist*       kwdefined;
-char         wd[128];
-
-static constexpr size_t NLIST_SIZE { 128 };
-nlist*                  nlist[NLIST_SIZE];
+int    verbose;
+int    Mflag;
+int    Cplusplus;
+int    nolineinfo;
+int    daemonflag;
+nlist* kwdefined;
+char   wd[128];
+
+void (*namelookup)(const unsigned char*, int) noexcept {}; // when set, told of every name looked up, e.g. by a speculative #include
+
+/*
+ * the table only holds the names lookup() was asked to install: keywords, builtins and every name #defined, #undefined
+ * or given with -D and -U. the lexer looks up each identifier as it scans it without adding it, a token whose name is
+ * here carries the entry's symbol id and is looked up again by an index into symbols[], any other one has id 0 and is
+ * hashed. identifiers that never name a macro take no memory, however many distinct ones a file has.
+ */
+static constexpr size_t NLIST_SIZE { 1024 }; // hash chains to start with, doubled whenever there are as many names
+static nlist**          symtab {};           // hash chains of names, nslots of them
+static size_t           nslots {};
+nlist**                 symbols {};          // every entry by its symbol id, symbols[0] is left empty
+static unsigned*        symhashes {};        // and the hash of its name
+static size_t           nsymbols { 1 }, maxsymbols {};
+
+static constexpr size_t NAME_FILTER_BITS { 0x4000 }; // the smallest filter, 2 KiB
+static constexpr size_t NAME_FILTER_LOAD { 16 };     // bits per name, with two probes about 1.4% false positives
+static unsigned long long initialfilter[NAME_FILTER_BITS / 64];
+unsigned long long*       namefilter { initialfilter };
+unsigned                  namefiltermask { NAME_FILTER_BITS - 1 };
+unsigned                  namefiltergen {};
+static size_t             nfiltered {}; // names installed in the filter
+static bool               passall {};   // every name passes the filter, see passallnames()
+
+static constexpr size_t NAME_SLAB_SIZE { 0x10000 }; // entries and their names are carved out of blocks this large
+static unsigned char*   slab {};
+static size_t           slabfree {};
 
 struct keyword final {
         const char* keyword;
@@ -43,28 +66,25 @@ static constexpr keyword keyword_table[] = {
     nullptr
 };
 
-unsigned long namebit[0x40];
-nlist*        np;
+nlist* np;
 
-void setup(int argc, char** argv) noexcept {
+static token     deftoken[1] = {
+    { NAME, 0, 0, 0, 7, 0, (unsigned char*) "defined" }
+};
+static macro_definition deftr = {
+    { deftoken, deftoken, deftoken + 1, 1 },
+    nullptr, 1
+}; // holds itself, it is never freed
+
+// installs the preprocessor keywords and builtin macros, only the first call does any work
+void initkeywords(void) noexcept {
+    static bool    installed {};
     const keyword* kp;
     nlist*         np;
-    token          t;
-    int            fd, i;
-    char *         fp, *dp;
-    token_row      tr;
-    char*          objtype;
-    char*          includeenv;
-    int            firstinclude;
-    static char    nbuf[40];
-    static token   deftoken[1] = {
-        { NAME, 0, 0, 0, 7, (unsigned char*) "defined" }
-    };
-    static token_row deftr        = { deftoken, deftoken, deftoken + 1, 1 };
-    int              debuginclude = 0;
-    int              nodot        = 0;
-    char             xx[2]        = { 0, 0 };
+    token          t {};
 
+    if (installed) return;
+    installed = true;
     for (kp = keyword_table; kp->keyword; kp++) {
         t.t      = (unsigned char*) kp->keyword;
         t.len    = strlen(kp->keyword);
@@ -74,24 +94,181 @@ void setup(int argc, char** argv) noexcept {
         if (np->val == KDEFINED) {
             kwdefined = np;
             np->val   = NAME;
-            np->vp    = &deftr;
+            np->vp    = holddefinition(&deftr.row);
             np->ap    = 0;
         }
     }
+}
+
+/*
+ * the symbol table is versioned by an undo trail: definitions are never modified once made, so every #define and
+ * #undef only has to record the entry's previous pointers and flags before it replaces them. a checkpoint is the
+ * position on the trail, and restoring one undoes the changes made since, newest first. the trail holds the definitions
+ * it recorded, so one made after a checkpoint is freed when a restore unwinds past it, unless -config kept it. what
+ * lies before the oldest live checkpoint can never be restored, so the trail is cut back to it as checkpoints are freed;
+ * positions count from the start of the trail as it was before any cut, so the marks handed out stay good.
+ */
+static macro_version* trail {}; // every replaced definition since the oldest live checkpoint, or a little before, oldest first
+static size_t         ntrail {}, maxtrail {};
+static size_t         trailbase {}; // the position of trail[0]
+static size_t*        marks {};     // the live checkpoints, in no order, nothing is recorded while there are none
+static size_t         nmarks {}, maxmarks {};
+
+// forgets the changes recorded from mark on, without undoing them
+static void droptrail(_In_ const size_t mark) noexcept {
+    while (ntrail > mark) {
+        const macro_version* const v = &trail[--ntrail];
+        dropdefinition(v->np, v->vp);
+        dropdefinition(v->np, v->ap);
+    }
+}
+
+/*
+ * forget every user defined macro so the symbol table can be reused by another run.
+ * the entries themselves are kept, only their definitions go away.
+ */
+void resetmacros(void) noexcept {
+    for (size_t i = 1; i < nsymbols; i++) {
+        nlist* const np = symbols[i];
+        np->nexpand     = 0;
+        free(np->cost);
+        np->cost = nullptr;
+        if (np->flag & (KEYWORD | BUILTIN | UNCHANGEABLE)) continue;
+        setdefinition(np, nullptr, nullptr);
+        np->flag    = 0;
+        np->deffile = nullptr;
+    }
+    droptrail(0);
+    trailbase = nmarks = 0;
+}
+
+// records np's definition before it is changed, must precede every change to its vp, ap, flag or deffile
+void changemacro(_In_ nlist* const np) noexcept {
+    if (!nmarks) return;
+    if (ntrail == maxtrail) {
+        maxtrail = maxtrail ? 2 * maxtrail : 256;
+        trail    = reinterpret_cast<macro_version*>(_checked_realloc(trail, maxtrail * sizeof(macro_version)));
+    }
+    trail[ntrail++] = { np, holddefinition(np->vp), holddefinition(np->ap), np->deffile, np->defline, np->flag };
+}
+
+// gives np the definition vp and ap, and lets go of the one it had; changemacro() comes first
+void setdefinition(_Inout_ nlist* const np, _In_opt_ token_row* const vp, _In_opt_ token_row* const ap) noexcept {
+    holddefinition(vp);
+    holddefinition(ap);
+    dropdefinition(np, np->vp);
+    dropdefinition(np, np->ap);
+    np->vp = vp;
+    np->ap = ap;
+}
+
+// a checkpoint of every macro definition, O(1)
+size_t savemacros(void) noexcept {
+    if (nmarks == maxmarks) {
+        maxmarks = maxmarks ? 2 * maxmarks : 16;
+        marks    = reinterpret_cast<size_t*>(_checked_realloc(marks, maxmarks * sizeof(size_t)));
+    }
+    return marks[nmarks++] = trailbase + ntrail;
+}
+
+// puts every macro back to what it was at mark in O(changes since), the checkpoints taken after mark become invalid
+void restoremacros(_In_ const size_t mark) noexcept {
+    while (trailbase + ntrail > mark) {
+        const macro_version* const v = &trail[--ntrail];
+        setdefinition(v->np, v->vp, v->ap);
+        dropdefinition(v->np, v->vp); /* the trail's hold went to the table */
+        dropdefinition(v->np, v->ap);
+        v->np->flag    = v->flag;
+        v->np->deffile = v->deffile;
+        v->np->defline = v->defline;
+    }
+}
+
+// calls fn on every entry changed since mark, once per change
+void changedmacros(_In_ const size_t mark, _In_ void (*const fn)(nlist*, void*), _Inout_opt_ void* const context) noexcept {
+    for (size_t i = mark - trailbase; i < ntrail; i++) fn(trail[i].np, context);
+}
+
+// frees the checkpoint at mark, and lets go of the part of the trail no live checkpoint can be restored to any more
+void freemacros(_In_ const size_t mark) noexcept {
+    size_t i {}, oldest {}, cut {};
+
+    while (i < nmarks && marks[i] != mark) i++;
+    if (i == nmarks) return;
+    marks[i] = marks[--nmarks];
+    if (!nmarks) { /* the trail starts over empty */
+        droptrail(0);
+        trailbase = 0;
+        return;
+    }
+    oldest = marks[0];
+    for (i = 1; i < nmarks; i++)
+        if (marks[i] < oldest) oldest = marks[i];
+    cut = oldest - trailbase;
+    if (cut == 0 || cut < ntrail / 2) return; /* cut in halves at least, so each change is moved O(1) times */
+    for (i = 0; i < cut; i++) {
+        dropdefinition(trail[i].np, trail[i].vp);
+        dropdefinition(trail[i].np, trail[i].ap);
+    }
+    ::memmove(trail, trail + cut, (ntrail - cut) * sizeof(macro_version));
+    ntrail    -= cut;
+    trailbase += cut;
+}
+
+// calls fn on every name lookup() installed
+void forallnames(_In_ void (*const fn)(nlist*, void*), _Inout_opt_ void* const context) noexcept {
+    for (size_t i = 1; i < nsymbols; i++) fn(symbols[i], context);
+}
+
+// the argument of the option at opt, either the rest of the word (-Idir) or the next word (-I dir)
+static char* optionvalue(_In_z_ char* const opt, _Inout_ int* const argc, _Inout_ char*** const argv) noexcept {
+    char xx[2] = { *opt, 0 };
+
+    if (opt[1] != '\0') return opt + 1;
+    if (*argc < 2) error(FATAL, "Option -%s requires an argument", xx);
+    --*argc;
+    return *++*argv;
+}
+
+// handles a -D or -U argument, type being 'D' or 'U'
+void definearg(_In_z_ char* const arg, _In_ const int type) noexcept {
+    token_row tr;
+
+    setsource("<cmdarg>", -1, arg);
+    maketokenrow(3, &tr);
+    gettokens(&tr, 1);
+    doadefine(&tr, type);
+    unsetsource();
+    free(tr.bp);
+}
+
+void setup(int argc, char** argv) noexcept {
+    int         fd, i;
+    const char *fp, *dp;
+    char*       objtype;
+    char*       includeenv;
+    int         firstinclude;
+    static char nbuf[40];
+    int         debuginclude = 0;
+    int         nodot        = 0;
+    const char* savefile     = nullptr;
+    char        xx[2]        = { 0, 0 };
+
+    initkeywords();
     /*
-	 * For Plan 9, search /objtype/include, then /sys/include
+	 * For Plan 9, search /objtype/include, then /sys/include, elsewhere /usr/local/include, then /usr/include
 	 * (Note that includelist is searched from high end to low)
 	 */
     if ((objtype = getenv("objtype"))) {
         snprintf(nbuf, sizeof nbuf, "/%s/include", objtype);
-        includelist[1].file   = nbuf;
-        includelist[1].always = 1;
+        includelist[1].file = nbuf;
+        includelist[0].file = "/sys/include";
     } else {
-        includelist[1].file = nullptr;
-        error(WARNING, "Unknown $objtype");
+        includelist[1].file = "/usr/local/include";
+        includelist[0].file = "/usr/include";
     }
-    if (getwd(wd, sizeof(wd)) == 0) wd[0] = '\0';
-    includelist[0].file   = "/sys/include";
+    if (getcwd(wd, sizeof(wd)) == nullptr) wd[0] = '\0';
+    includelist[1].always = 1;
     includelist[0].always = 1;
     firstinclude          = MAX_INCLUDE_DIRS - 2;
     if ((includeenv = getenv("include")) != nullptr) {
@@ -106,63 +283,138 @@ void setup(int argc, char** argv) noexcept {
         }
     }
     setsource("", -1, 0);
-    ARGBEGIN {
-        case 'N' :
-            for (i = 0; i < MAX_INCLUDE_DIRS; i++)
-                if (includelist[i].always == 1) includelist[i].deleted = 1;
+    for (argc--, argv++; argc > 0 && argv[0][0] == '-' && argv[0][1] != '\0'; argc--, argv++) {
+        if (strcmp(argv[0], "--") == 0) { /* end of the options */
+            argc--, argv++;
             break;
-        case 'I' :
-            for (i = firstinclude; i >= 0; i--) {
-                if (includelist[i].file == nullptr) {
-                    includelist[i].always = 1;
-                    includelist[i].file   = ARGF();
+        }
+        if (strcmp(argv[0], "-stats") == 0) {
+            statsflag++;
+            continue;
+        }
+        if (strcmp(argv[0], "-daemon") == 0) {
+            daemonflag++;
+            continue;
+        }
+        if (strcmp(argv[0], "-prefetch") == 0) {
+            prefetchflag++;
+            continue;
+        }
+        if (strcmp(argv[0], "-uring") == 0) {
+            uringflag++;
+            continue;
+        }
+        if (strcmp(argv[0], "-pipeline") == 0) {
+            pipelineflag++;
+            continue;
+        }
+        if (strcmp(argv[0], "-config") == 0) {
+            if (argc < 2) error(FATAL, "Option -config requires an argument");
+            argc--, argv++;
+            addconfig(argv[0]);
+            continue;
+        }
+        if (strcmp(argv[0], "-cache") == 0) {
+            if (argc < 2) error(FATAL, "Option -cache requires an argument");
+            argc--, argv++;
+            cachedir = argv[0];
+            continue;
+        }
+        if (strcmp(argv[0], "-max-expansion-size") == 0) {
+            if (argc < 2) error(FATAL, "Option -max-expansion-size requires an argument");
+            argc--, argv++;
+            if ((maxexpansionsize = atoi(argv[0])) < 1) error(FATAL, "Option -max-expansion-size takes a number of tokens, not %s", argv[0]);
+            continue;
+        }
+        if (strcmp(argv[0], "-macro-profile") == 0) {
+            macroprofile++;
+            continue;
+        }
+        if (strcmp(argv[0], "-defines-file") == 0) {
+            if (argc < 2) error(FATAL, "Option -defines-file requires an argument");
+            argc--, argv++;
+            loaddefines(argv[0]);
+            continue;
+        }
+        if (strcmp(argv[0], "-save-defines") == 0) {
+            if (argc < 2) error(FATAL, "Option -save-defines requires an argument");
+            argc--, argv++;
+            savefile = argv[0];
+            continue;
+        }
+        if (strcmp(argv[0], "-include-profile") == 0) {
+            if (argc < 2) error(FATAL, "Option -include-profile requires an argument");
+            argc--, argv++;
+            includeprofile = argv[0];
+            continue;
+        }
+        for (char* opt = argv[0] + 1; *opt; opt++) {
+            switch (*opt) {
+                case 'N' :
+                    for (i = 0; i < MAX_INCLUDE_DIRS; i++)
+                        if (includelist[i].always == 1) includelist[i].deleted = 1;
+                    break;
+                case 'I' :
+                    for (i = firstinclude; i >= 0; i--) {
+                        if (includelist[i].file == nullptr) {
+                            includelist[i].always = 1;
+                            includelist[i].file   = optionvalue(opt, &argc, &argv);
+                            break;
+                        }
+                    }
+                    if (i < 0) error(WARNING, "Too many -I directives");
+                    goto nextword;
+                case 'D' :
+                case 'U' : definearg(optionvalue(opt, &argc, &argv), *opt); goto nextword;
+                case 'j' : specjobs = atoi(optionvalue(opt, &argc, &argv)); goto nextword;
+                case 'M' : Mflag++; break;
+                case 'V' : verbose++; break;
+                case '+' : Cplusplus++; break;
+                case 'i' : debuginclude++; break;
+                case 'P' : nolineinfo++; break;
+                case '.' : nodot++; break;
+                default :
+                    xx[0] = *opt;
+                    error(FATAL, "Unknown argument '%s'", xx);
                     break;
-                }
             }
-            if (i < 0) error(WARNING, "Too many -I directives");
-            break;
-        case 'D' :
-        case 'U' :
-            setsource("<cmdarg>", -1, ARGF());
-            maketokenrow(3, &tr);
-            gettokens(&tr, 1);
-            doadefine(&tr, ARGC());
-            unsetsource();
-            break;
-        case 'M' : Mflag++; break;
-        case 'V' : verbose++; break;
-        case '+' : Cplusplus++; break;
-        case 'i' : debuginclude++; break;
-        case 'P' : nolineinfo++; break;
-        case '.' : nodot++; break;
-        default :
-            xx[0] = ARGC();
-            error(FATAL, "Unknown argument '%s'", xx);
-            break;
+        }
+nextword:;
     }
-    ARGEND
+    if (savefile) savedefines(savefile);
     dp = ".";
     fp = "<stdin>";
     fd = 0;
     if (argc > 2) error(FATAL, "Too many file arguments; see cpp(1)");
+    /* the workers' counters, traces and dependency lists stay in their own processes */
+    if (specjobs < 0 || statsflag || Mflag || includeprofile || macroprofile || daemonflag || verbose || cachedir) specjobs = 0;
+    if (cachedir && (Mflag || nconfigs || daemonflag)) error(FATAL, "-cache does not go with -M, -config or -daemon");
+    if (nconfigs) { /* the configurations part into processes of their own, which -j and -pipeline would not survive */
+        if (Mflag || daemonflag) error(FATAL, "-config does not go with -M or -daemon");
+        if (argc > 1) error(FATAL, "-config names the output files, there is no output file argument");
+        specjobs = pipelineflag = 0;
+    }
+    if (daemonflag) { /* the files come with the requests */
+        if (argc > 0) error(FATAL, "-daemon takes no file arguments");
+        return;
+    }
     if (argc > 0) {
         if ((fp = strrchr(argv[0], '/')) != nullptr) {
-            int len = fp - argv[0];
-            dp      = (char*) newstring((unsigned char*) argv[0], len + 1, 0);
-            dp[len] = '\0';
+            dp = (char*) newstring((unsigned char*) argv[0], fp - argv[0], 0);
         }
         fp = (char*) newstring((unsigned char*) argv[0], strlen(argv[0]), 0);
         if ((fd = open(fp, 0)) < 0) error(FATAL, "Can't open input file %s", fp);
     }
     if (argc > 1) {
-        int fdo = create(argv[1], 1, 0666);
+        int fdo = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
         if (fdo < 0) error(FATAL, "Can't open output file %s", argv[1]);
-        dup(fdo, 1);
+        dup2(fdo, 1);
     }
     if (Mflag) setobjname(fp);
     includelist[MAX_INCLUDE_DIRS - 1].always = 0;
     includelist[MAX_INCLUDE_DIRS - 1].file   = dp;
     if (nodot) includelist[MAX_INCLUDE_DIRS - 1].deleted = 1;
+    if (prefetchflag) startprefetch();
     setsource(fp, fd, nullptr);
     if (debuginclude) {
         for (i = 0; i < MAX_INCLUDE_DIRS; i++)
@@ -170,31 +422,115 @@ void setup(int argc, char** argv) noexcept {
     }
 }
 
-nlist* lookup(token* tp, int install) noexcept {
-    unsigned int   h;
-    nlist*         np;
-    unsigned char *cp, *cpe;
-
-    h = 0;
-    for (cp = tp->t, cpe = cp + tp->len; cp < cpe;) h += *cp++;
-    h  %= NLIST_SIZE;
-    np  = nlist[h];
-    while (np) {
-        if (*tp->t == *np->name && tp->len == np->len && strncmp((char*) tp->t, (char*) np->name, tp->len) == 0) return np;
-        np = np->next;
-    }
-    if (install) {
-        np       = _new_obj<nlist>();
-        np->val  = 0;
-        np->vp   = nullptr;
-        np->ap   = nullptr;
-        np->flag = 0;
-        np->len  = tp->len;
-        np->name = newstring(tp->t, tp->len, 0);
-        np->next = nlist[h];
-        nlist[h] = np;
-        quickset(tp->t[0], tp->len > 1 ? tp->t[1] : 0);
-        return np;
+unsigned hashname(_In_reads_(len) const unsigned char* s, _In_ const unsigned len) noexcept {
+    unsigned h { 2166136261U };
+
+    for (const unsigned char* const e = s + len; s < e; s++) h = (h ^ *s) * 16777619U;
+    return h;
+}
+
+// the entry spelled s, whose hash is h, nullptr if there is none
+nlist* findname(_In_reads_(len) const unsigned char* const s, _In_ const unsigned len, _In_ const unsigned h) noexcept {
+    if (!symtab) return nullptr;
+    prepstats.chainwalks++;
+    for (nlist* np = symtab[h & (nslots - 1)]; np; np = np->next) {
+        prepstats.chainsteps++;
+        if (np->hash == h && np->len == static_cast<int>(len) && memcmp(s, np->name, len) == 0) return np;
     }
     return nullptr;
 }
+
+// rehashes the chains into twice as many
+static void growsymtab(void) noexcept {
+    const size_t  n      = nslots ? 2 * nslots : NLIST_SIZE;
+    nlist** const chains = _checked_malloc<nlist*>(n);
+
+    for (size_t i = 1; i < nsymbols; i++) {
+        nlist* const np            = symbols[i];
+        np->next                   = chains[np->hash & (n - 1)];
+        chains[np->hash & (n - 1)] = np;
+    }
+    free(symtab);
+    symtab = chains;
+    nslots = n;
+}
+
+// n zeroed bytes that stay put for good, the entries are never freed
+static void* slabspace(_In_ size_t n) noexcept {
+    n = (n + alignof(nlist) - 1) & ~(alignof(nlist) - 1);
+    if (n > slabfree) {
+        slabfree = n > NAME_SLAB_SIZE ? n : NAME_SLAB_SIZE;
+        slab     = _checked_malloc<unsigned char>(slabfree);
+    }
+    void* const p  = slab;
+    slab          += n;
+    slabfree      -= n;
+    return p;
+}
+
+static nlist* addname(_In_reads_(len) const unsigned char* const s, _In_ const unsigned len, _In_ const unsigned h) noexcept {
+    nlist* const np = reinterpret_cast<nlist*>(slabspace(sizeof(nlist)));
+
+    if (nsymbols >= nslots) growsymtab();
+    if (nsymbols >= maxsymbols) {
+        maxsymbols = maxsymbols ? 2 * maxsymbols : NLIST_SIZE;
+        symbols    = reinterpret_cast<nlist**>(_checked_realloc(symbols, maxsymbols * sizeof(nlist*)));
+        symhashes  = reinterpret_cast<unsigned*>(_checked_realloc(symhashes, maxsymbols * sizeof(unsigned)));
+    }
+    np->len                  = static_cast<int>(len);
+    np->name                 = reinterpret_cast<unsigned char*>(::memcpy(slabspace(len + 1), s, len));
+    np->hash                 = h;
+    np->sym                  = static_cast<unsigned>(nsymbols);
+    symhashes[nsymbols]      = h;
+    symbols[nsymbols++]      = np;
+    np->next                 = symtab[h & (nslots - 1)];
+    symtab[h & (nslots - 1)] = np;
+    return np;
+}
+
+static void setfilterbits(_In_ const unsigned h) noexcept {
+    const unsigned a = h & namefiltermask, b = (h >> 16 | h << 16) * 0x9E3779B1U & namefiltermask;
+
+    namefilter[a >> 6] |= 1ULL << (a & 63);
+    namefilter[b >> 6] |= 1ULL << (b & 63);
+}
+
+// adds an installed name to the filter, which is rebuilt twice as large whenever it gets too full
+static void filtername(_In_ const unsigned h) noexcept {
+    namefiltergen++;
+    if (++nfiltered * NAME_FILTER_LOAD > namefiltermask + 1ULL) {
+        const size_t nbits = 2 * (namefiltermask + 1ULL);
+        if (namefilter != initialfilter) free(namefilter);
+        namefilter     = _checked_malloc<unsigned long long>(nbits / 64);
+        namefiltermask = static_cast<unsigned>(nbits - 1);
+        if (passall) ::memset(namefilter, 0xFF, nbits / 8);
+        for (size_t i = 1; i < nsymbols; i++) setfilterbits(symhashes[i]);
+    }
+    setfilterbits(h);
+}
+
+// lets every name through the filter from here on, so lookup() sees them all
+void passallnames(void) noexcept {
+    namefiltergen++;
+    passall = true;
+    ::memset(namefilter, 0xFF, (namefiltermask + 1ULL) / 8);
+}
+
+// the entry for tp's name, by its symbol id when the lexer gave it one; install makes it a candidate for expansion
+nlist* lookup(token* tp, int install) noexcept {
+    nlist* np;
+
+    prepstats.lookups++;
+    if (namelookup) namelookup(tp->t, tp->len);
+    if (tp->sym)
+        np = symbols[tp->sym];
+    else {
+        const unsigned h = hashname(tp->t, tp->len);
+        if ((np = findname(tp->t, tp->len, h)) == nullptr && install) {
+            np = addname(tp->t, tp->len, h);
+            filtername(h);
+        }
+    }
+    if (np && np->varies) configtouched = true;
+    return np;
+}
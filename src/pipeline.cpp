@@ -0,0 +1,381 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <prep.hpp>
+
+/*
+ * -pipeline, lexes the main file and writes the output on threads of their own, so both overlap with expansion.
+ * the lexing thread runs lexrow() over its own copy of the main file's source, copies every row with its text into a
+ * line batch, and hands full batches over a single producer, single consumer ring. gettokens() takes the rows from
+ * there, looks up their names and reports their diagnostics where the lexer would have. directives stay on the
+ * preprocessor's thread: an #include pushes a source that is lexed there as before, and no directive changes how the
+ * rest of the main file lexes, so the thread never waits on one. the output goes the other way, writeout() fills
+ * batches for the writing thread and flushout() waits until they are written. the main file from stdin is read as
+ * before, and so is everything under -j, whose workers are forked without the threads, or on a single processor, where
+ * the threads would only take turns.
+ */
+
+static constexpr size_t BATCH_SLOTS { 16 };       // batches in flight on either ring, a power of two
+static constexpr size_t BATCH_ROWS { 4096 };      // rows in a line batch
+static constexpr size_t BATCH_TEXT { 0x40000 };   // bytes of text in a line batch, a longer row gets one of its own
+static constexpr size_t OUTPUT_BATCH { 0x40000 }; // bytes of output handed to the writing thread at once
+static constexpr int    RING_SPINS { 64 };        // looks at a ring before going to sleep on it
+
+int pipelineflag {};
+
+// a row the lexing thread returned, its tokens and diagnostics run up to those of the next one
+struct ahead_row final {
+        size_t end;    // one past its last token in the batch
+        size_t ndiags; // one past its last diagnostic
+        int    lineinc;
+};
+
+struct ahead_diagnostic final {
+        ERRKIND     type;
+        const char* message; // a literal of the lexer's
+};
+
+struct line_batch final {
+        line_batch*       next;   // taken before the one rows are taken from, the row may still point into it
+        token*            tokens; // pointing into text
+        size_t            ntokens;
+        size_t            maxtokens;
+        unsigned char*    text;
+        size_t            ntext;
+        size_t            maxtext;
+        ahead_row         rows[BATCH_ROWS];
+        size_t            nrows;
+        ahead_diagnostic* diags;
+        size_t            ndiags;
+        size_t            maxdiags;
+        size_t            bytes; // the main file's, set on the batch that ends with its END
+};
+
+// a single producer, single consumer ring of pointers, the slots keep head and tail off each other's cache line.
+// a side that finds it full, or empty, sleeps on wake until the other one moves
+struct batch_ring final {
+        std::atomic<size_t>     head; // the next slot to take
+        void*                   slots[BATCH_SLOTS];
+        std::atomic<size_t>     tail; // the next slot to fill
+        std::atomic<int>        sleepers;
+        std::mutex              lock;
+        std::condition_variable wake;
+};
+
+// allocated once and never destroyed, like the prefetch thread's, so exit() cannot pull it from under the threads
+struct pipeline_state final {
+        batch_ring          rows;     // line batches from the lexing thread
+        batch_ring          spare;    // and back to it once taken, to be filled again
+        batch_ring          output;   // strbufs to the writing thread, nullptr stops it
+        batch_ring          spareout; // and back once written
+        std::thread         lexer;
+        std::thread         writer;
+        source*             ahead;   // the lexing thread's copy of the main file's source
+        std::atomic<size_t> written; // output batches the writing thread is done with
+        size_t              queued;  // output batches handed over, the rest is the preprocessor's side
+        strbuf*             out;     // being filled
+        line_batch*         batch;   // rows are taken from
+        size_t              row;     // the next one in batch
+        line_batch*         spent;   // freed once the row is reset
+        bool                done;    // the END was taken
+};
+
+static pipeline_state* pl {};
+static bool            emitting {};
+
+static line_batch*       filling {}; // the lexing thread's own from here on
+static ahead_diagnostic* pending {}; // diagnostics of the row being lexed
+static size_t            npending {}, maxpending {};
+
+/*
+ * waits until ready() holds, the other side of r wakes it when it moves. head, tail and sleepers are sequentially
+ * consistent, so either ready() sees the move or the mover sees the sleeper; they change once a batch.
+ */
+template <typename predicate> static void awaitring(_Inout_ batch_ring* const r, _In_ const predicate ready) noexcept {
+    for (int i = 0; i < RING_SPINS; i++)
+        if (ready()) return;
+    std::unique_lock<std::mutex> guard { r->lock };
+    r->sleepers++;
+    while (!ready()) r->wake.wait(guard);
+    r->sleepers--;
+}
+
+// after head or tail moved, drainoutput() sleeps on the output ring too
+static void wakering(_Inout_ batch_ring* const r) noexcept {
+    if (!r->sleepers) return;
+    std::lock_guard<std::mutex> guard { r->lock };
+    r->wake.notify_all();
+}
+
+static void ringput(_Inout_ batch_ring* const r, _In_opt_ void* const p) noexcept {
+    const size_t tail = r->tail;
+
+    awaitring(r, [r, tail] { return tail - r->head < BATCH_SLOTS; });
+    r->slots[tail & (BATCH_SLOTS - 1)] = p;
+    r->tail = tail + 1;
+    wakering(r);
+}
+
+static void* ringtake(_Inout_ batch_ring* const r) noexcept {
+    const size_t head = r->head;
+
+    awaitring(r, [r, head] { return r->tail != head; });
+    void* const p = r->slots[head & (BATCH_SLOTS - 1)];
+    r->head       = head + 1;
+    wakering(r);
+    return p;
+}
+
+// ringput() and ringtake() that give up rather than wait, for the rings batches come back on; nobody sleeps on those
+static bool ringoffer(_Inout_ batch_ring* const r, _In_ void* const p) noexcept {
+    const size_t tail = r->tail;
+
+    if (tail - r->head == BATCH_SLOTS) return false;
+    r->slots[tail & (BATCH_SLOTS - 1)] = p;
+    r->tail                            = tail + 1;
+    return true;
+}
+
+static void* ringpoll(_Inout_ batch_ring* const r) noexcept {
+    const size_t head = r->head;
+
+    if (r->tail == head) return nullptr;
+    void* const p = r->slots[head & (BATCH_SLOTS - 1)];
+    r->head       = head + 1;
+    return p;
+}
+
+static void freebatch(_In_ line_batch* const b) noexcept {
+    free(b->text);
+    free(b->tokens);
+    free(b->diags);
+    free(b);
+}
+
+// an empty batch with room for text bytes, one that was taken if it is large enough
+static line_batch* newbatch(_In_ const size_t text) noexcept {
+    line_batch* b = reinterpret_cast<line_batch*>(ringpoll(&pl->spare));
+
+    if (b && b->maxtext >= text) {
+        b->next    = nullptr;
+        b->ntokens = b->ntext = b->nrows = b->ndiags = b->bytes = 0;
+        return b;
+    }
+    if (b) freebatch(b);
+    b            = _new_obj<line_batch>();
+    b->maxtext   = text;
+    b->text      = _checked_malloc<unsigned char>(text);
+    b->maxtokens = BATCH_ROWS;
+    b->tokens    = _checked_malloc<token>(b->maxtokens);
+    return b;
+}
+
+// the lexer's diagnostics, kept with the row they were found in
+void aheaderror(_In_ const ERRKIND type, _In_z_ const char* const message) noexcept {
+    if (npending == maxpending) {
+        maxpending = maxpending ? 2 * maxpending : 8;
+        pending    = reinterpret_cast<ahead_diagnostic*>(_checked_realloc(pending, maxpending * sizeof(ahead_diagnostic)));
+    }
+    pending[npending++] = { type, message };
+}
+
+// copies the row into the batch being filled, each token right after the one before so puttokens() still joins them
+static void keeprow(_In_ const token_row* const trp, _In_ const int lineinc) noexcept {
+    const size_t ntokens = trp->lp - trp->bp;
+    size_t       ntext { 1 }; /* a NUL after the row */
+
+    for (const token* tp = trp->bp; tp < trp->lp; tp++) ntext += tp->wslen + tp->len;
+    if (filling && (filling->nrows == BATCH_ROWS || filling->ntext + ntext > filling->maxtext)) {
+        ringput(&pl->rows, filling);
+        filling = nullptr;
+    }
+    if (!filling) filling = newbatch(ntext > BATCH_TEXT ? ntext : BATCH_TEXT);
+
+    line_batch* const b = filling;
+    if (b->ntokens + ntokens > b->maxtokens) {
+        while (b->ntokens + ntokens > b->maxtokens) b->maxtokens *= 2;
+        b->tokens = reinterpret_cast<token*>(_checked_realloc(b->tokens, b->maxtokens * sizeof(token)));
+    }
+    if (b->ndiags + npending > b->maxdiags) {
+        b->maxdiags = b->ndiags + npending;
+        b->diags    = reinterpret_cast<ahead_diagnostic*>(_checked_realloc(b->diags, b->maxdiags * sizeof(ahead_diagnostic)));
+    }
+    unsigned char* p = b->text + b->ntext;
+    token*         t = b->tokens + b->ntokens;
+    for (const token* tp = trp->bp; tp < trp->lp; tp++, t++) {
+        ::memcpy(p, tp->t - tp->wslen, tp->wslen + tp->len);
+        *t    = *tp;
+        t->t  = p + tp->wslen;
+        p    += tp->wslen + tp->len;
+    }
+    *p++ = '\0';
+    if (npending) ::memcpy(b->diags + b->ndiags, pending, npending * sizeof(ahead_diagnostic));
+    b->ntext                 = p - b->text;
+    b->ntokens              += ntokens;
+    b->ndiags               += npending;
+    b->rows[b->nrows++]      = { b->ntokens, b->ndiags, lineinc };
+    npending                 = 0;
+}
+
+static void lexahead(void) noexcept {
+    source* const s = pl->ahead;
+    token_row     tr {};
+    bool          end {};
+
+    maketokenrow(256, &tr);
+    while (!end) {
+        tr.tp = tr.lp = tr.bp;
+        lexrow(s, &tr, 1);
+        end = (tr.lp - 1)->type == END;
+        keeprow(&tr, s->lineinc);
+    }
+    filling->bytes = s->shifted + (s->inl - s->inb);
+    ringput(&pl->rows, filling);
+    filling = nullptr;
+    while (s->retired) {
+        retired_buffer* const r = s->retired;
+        s->retired              = r->next;
+        free(r->data);
+        free(r);
+    }
+    free(s->inb);
+    free(s);
+    free(tr.bp);
+    free(pending);
+}
+
+/*
+ * gettokens() from the main file: the next row the lexing thread returned, its names looked up now that it is known
+ * whether the line is skipped.
+ */
+int takerow(_Inout_ token_row* const trp, _In_ const int reset) noexcept {
+    static unsigned char nothing[1];
+    source* const        s = cursource;
+    int                  nmac {};
+
+    if (reset) {
+        s->lineinc = 0;
+        while (pl->spent) { /* the row that needed them has been put out */
+            line_batch* const b = pl->spent;
+            pl->spent           = b->next;
+            if (!ringoffer(&pl->spare, b)) freebatch(b);
+        }
+    }
+    if (pl->done) { /* the END again, as the lexer returns it at the end of the input */
+        if (trp->lp >= trp->bp + trp->max) growtokenrow(trp);
+        *trp->lp++ = { END, 0, 0, 0, 0, 0, nothing };
+        prepstats.tokens++;
+        return 0;
+    }
+    if (!pl->batch || pl->row == pl->batch->nrows) {
+        if (pl->batch) {
+            pl->batch->next = pl->spent;
+            pl->spent       = pl->batch;
+        }
+        pl->batch = reinterpret_cast<line_batch*>(ringtake(&pl->rows));
+        pl->row   = 0;
+    }
+
+    const line_batch* const b     = pl->batch;
+    const ahead_row* const  r     = &b->rows[pl->row];
+    const size_t            first = pl->row ? r[-1].end : 0;
+    const size_t            n     = r->end - first;
+
+    for (size_t i = pl->row ? r[-1].ndiags : 0; i < r->ndiags; i++) error(b->diags[i].type, b->diags[i].message);
+    pl->row++;
+    s->lineinc += r->lineinc;
+    while (trp->lp + n > trp->bp + trp->max) growtokenrow(trp);
+    ::memcpy(trp->lp, b->tokens + first, n * sizeof(token));
+    for (token* tp = trp->lp; tp < trp->lp + n; tp++) {
+        if (tp->type != NAME) continue;
+        if (skipping) { /* a skipped line is dropped, or a directive */
+            tp->sym = 0;
+            continue;
+        }
+        const nlist* const np = findname(tp->t, tp->len, tp->sym);
+        if (np) { /* as lexrow() does */
+            tp->sym = np->sym;
+            nmac    = 1;
+        } else {
+            nmac    |= quicklook(tp->sym);
+            tp->sym  = 0;
+        }
+    }
+    trp->lp          += n;
+    prepstats.tokens += n;
+    if ((trp->lp - 1)->type == NL) prepstats.lines++;
+    if ((trp->lp - 1)->type == END) {
+        pl->done          = true;
+        prepstats.bytes  += b->bytes;
+        pl->lexer.join();
+    }
+    return nmac;
+}
+
+static void writeoutput(void) noexcept {
+    strbuf* b;
+
+    while ((b = reinterpret_cast<strbuf*>(ringtake(&pl->output))) != nullptr) {
+        long long n {};
+        for (const char* p = b->data; p < b->data + b->len; p += n)
+            if ((n = write(1, p, static_cast<unsigned>(b->data + b->len - p))) <= 0) break;
+        b->len = 0;
+        if (!ringoffer(&pl->spareout, b)) {
+            free(b->data);
+            free(b);
+        }
+        pl->written++;
+        wakering(&pl->output); /* drainoutput() may be waiting */
+    }
+}
+
+static void handoutput(void) noexcept {
+    if (!pl->out) return;
+    ringput(&pl->output, pl->out);
+    pl->out = nullptr;
+    pl->queued++;
+}
+
+// writeout() to stdout: len bytes for the writing thread, false when there is none
+bool emitoutput(_In_reads_(len) const char* const str, _In_ const size_t len) noexcept {
+    if (!emitting) return false;
+    if (!pl->out && (pl->out = reinterpret_cast<strbuf*>(ringpoll(&pl->spareout))) == nullptr) pl->out = _new_obj<strbuf>();
+    strbuf_append(pl->out, str, len);
+    if (pl->out->len >= OUTPUT_BATCH) handoutput();
+    return true;
+}
+
+// flushout(), returns once everything emitted so far is written
+void drainoutput(void) noexcept {
+    if (!emitting) return;
+    handoutput();
+    awaitring(&pl->output, [] { return pl->written == pl->queued; });
+}
+
+// starts the threads on s, the main file just opened
+void startpipeline(_Inout_ source* const s) noexcept {
+    if (pl || std::thread::hardware_concurrency() == 1) return;
+    pl               = new pipeline_state {};
+    pl->ahead        = _new_obj<source>();
+    *pl->ahead       = *s;
+    pl->ahead->next  = nullptr;
+    pl->ahead->ahead = AHEAD_LEXED;
+    s->ahead         = AHEAD_TAKEN; /* keeps the descriptor, which unsetsource() closes, and an empty buffer */
+    s->inb = s->inp = s->inl = _checked_malloc<unsigned char>(4);
+    s->ins = s->inw = 0;
+    s->retired      = nullptr;
+    pl->lexer       = std::thread { lexahead };
+    pl->writer      = std::thread { writeoutput };
+    emitting        = true;
+}
+
+// stops the writing thread once the output is written
+void stoppipeline(void) noexcept {
+    if (!emitting) return;
+    drainoutput();
+    ringput(&pl->output, nullptr);
+    pl->writer.join();
+    emitting = false;
+}
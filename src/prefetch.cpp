@@ -0,0 +1,203 @@
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <prep.hpp>
+
+/*
+ * -prefetch, warms the files the lexer is about to #include on a background thread.
+ * fillbuf() hands every block it reads to prefetchincludes(), which queues the names of the #include "file" and
+ * #include <file> lines in it. the thread resolves each one the way doinclude() will, reads the file so its pages are
+ * in memory by the time the directive runs, and goes on depth first into the files that one includes, which is the
+ * order the preprocessor is going to need them in. it shares nothing with the preprocessor but the queue, and
+ * includelist, which stays as setup() left it. a wrong guess, e.g. an #include in a group that is skipped, only costs
+ * a read.
+ */
+
+static constexpr size_t PREFETCH_SLOTS { 1024 };    // hash chains of the names already looked up
+static constexpr size_t PREFETCH_MAX_FILES { 8192 }; // stop guessing after so many files
+static constexpr int    PREFETCH_MAX_DEPTH { 20 };   // as deep as doinclude() lets #includes nest
+
+int prefetchflag {};
+
+struct prefetch_request final {
+        prefetch_request* next;
+        char*             name;
+        const char*       from; // the file with the #include, never freed by the preprocessor
+        bool              angled;
+};
+
+struct prefetched final {
+        prefetched* next;
+        char*       key; // the directory a quoted name was looked up from, a quote and the name, or <name>
+};
+
+// everything the thread uses, allocated once and never destroyed so exit() cannot pull it from under the thread
+struct prefetch_state final {
+        std::mutex              lock;
+        std::condition_variable wake;
+        std::thread             thread;
+        prefetch_request*       head;
+        prefetch_request*       tail;
+        bool                    stop;
+        prefetched*             seen[PREFETCH_SLOTS]; // the thread's own from here on
+        size_t                  nfiles;
+};
+
+static prefetch_state* pf {};
+
+using include_found = void (*)(const char*, int, bool, const char*);
+
+// calls found on every #include "file" and #include <file> line in [p, e), lines cut off at e are left out
+static void scanincludes(_In_ const unsigned char* p, _In_ const unsigned char* const e, _In_z_ const char* const from, _In_ const include_found found) noexcept {
+    while (p < e) {
+        const unsigned char* const nl   = reinterpret_cast<const unsigned char*>(::memchr(p, '\n', e - p));
+        const unsigned char* const eol  = nl ? nl : e;
+        const unsigned char*       q    = p;
+        unsigned char              last {};
+
+        p = nl ? nl + 1 : e;
+        if (!nl) break;
+        while (q < eol && (*q == ' ' || *q == '\t')) q++;
+        if (q == eol || *q++ != '#') continue;
+        while (q < eol && (*q == ' ' || *q == '\t')) q++;
+        if (eol - q < 8 || ::memcmp(q, "include", 7) != 0) continue;
+        for (q += 7; q < eol && (*q == ' ' || *q == '\t'); q++);
+        if (q == eol || (*q != '"' && *q != '<')) continue;
+        last = *q == '"' ? '"' : '>';
+        const unsigned char* const name = ++q;
+        while (q < eol && *q != last) q++;
+        if (q < eol && q > name) found(reinterpret_cast<const char*>(name), static_cast<int>(q - name), last == '>', from);
+    }
+}
+
+static void enqueue(_In_reads_(len) const char* const name, _In_ const int len, _In_ const bool angled, _In_z_ const char* const from) noexcept {
+    prefetch_request* const r = _new_obj<prefetch_request>();
+
+    r->name   = _checked_malloc<char>(len + 1); /* zeroed, so terminated */
+    ::memcpy(r->name, name, len);
+    r->from   = from;
+    r->angled = angled;
+    std::lock_guard<std::mutex> guard { pf->lock };
+    if (pf->tail)
+        pf->tail->next = r;
+    else
+        pf->head = r;
+    pf->tail = r;
+    pf->wake.notify_one();
+}
+
+// queues the #includes of the block just read into s, from the start of the line the block continues
+void prefetchincludes(_In_ const source* const s, _In_ const unsigned char* start, _In_ const unsigned char* const end) noexcept {
+    while (start > s->inb && start[-1] != '\n') start--;
+    scanincludes(start, end, s->filename, enqueue);
+}
+
+// true the first time key is seen
+static bool firstlook(_In_z_ const char* const key) noexcept {
+    size_t h { 5381 };
+
+    for (const char* k = key; *k; k++) h = h * 33 + static_cast<unsigned char>(*k);
+    h %= PREFETCH_SLOTS;
+    for (const prefetched* p = pf->seen[h]; p; p = p->next)
+        if (::strcmp(p->key, key) == 0) return false;
+    prefetched* const p = _new_obj<prefetched>();
+    p->key              = ::strdup(key);
+    p->next             = pf->seen[h];
+    pf->seen[h]         = p;
+    return true;
+}
+
+static void warm(_In_reads_(len) const char* const name, _In_ const int len, _In_ const bool angled, _In_z_ const char* const from, _In_ const int depth) noexcept;
+
+static void warmnested(_In_reads_(len) const char* const name, _In_ const int len, _In_ const bool angled, _In_z_ const char* const from) noexcept;
+
+static int nesting {}; // of warm() on the thread
+
+// reads the file at path through and goes on into the files it includes
+static void warmfile(_In_z_ const char* const path, _In_ const int fd) noexcept {
+    struct stat st {};
+    char*       data {};
+    long long   n {}, got {};
+
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0) return;
+    if (st.st_size > static_cast<long long>(WHOLE_FILE_MAX)) return; /* streamed, its pages are not worth holding on to */
+#if defined(POSIX_FADV_WILLNEED)
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    data = _checked_malloc<char>(st.st_size);
+    while (got < st.st_size && (n = ::read(fd, data + got, static_cast<unsigned>(st.st_size - got))) > 0) got += n;
+    if (nesting < PREFETCH_MAX_DEPTH) scanincludes(reinterpret_cast<unsigned char*>(data), reinterpret_cast<unsigned char*>(data) + got, path, warmnested);
+    free(data);
+}
+
+static void warmnested(_In_reads_(len) const char* const name, _In_ const int len, _In_ const bool angled, _In_z_ const char* const from) noexcept {
+    warm(name, len, angled, from, nesting + 1);
+}
+
+// looks name up the way doinclude() does and warms the file it finds there
+static void warm(_In_reads_(len) const char* const name, _In_ const int len, _In_ const bool angled, _In_z_ const char* const from, _In_ const int depth) noexcept {
+    char        path[256], key[512];
+    const char* slash = ::strrchr(from, '/');
+    int         fd { -1 };
+
+    if (len <= 0 || len >= static_cast<int>(sizeof(path)) || pf->nfiles >= PREFETCH_MAX_FILES) return;
+    if (angled)
+        ::snprintf(key, sizeof(key), "<%.*s>", len, name);
+    else
+        ::snprintf(key, sizeof(key), "%.*s\"%.*s", slash ? static_cast<int>(slash - from) : 0, from, len, name);
+    if (!firstlook(key)) return;
+    if (name[0] == '/') {
+        ::snprintf(path, sizeof(path), "%.*s", len, name);
+        fd = open(path, 0);
+    } else
+        for (int i = MAX_INCLUDE_DIRS - 1; fd < 0 && i >= 0; i--) {
+            const include_list* const ip = &includelist[i];
+            if (ip->file == nullptr || ip->deleted || (angled && ip->always == 0)) continue;
+            if (::snprintf(path, sizeof(path), "%s/%.*s", ip->file, len, name) >= static_cast<int>(sizeof(path))) continue;
+            fd = open(path, 0);
+        }
+    if (fd < 0 && slash && ::snprintf(path, sizeof(path), "%.*s/%.*s", static_cast<int>(slash - from), from, len, name) < static_cast<int>(sizeof(path)))
+        fd = open(path, 0);
+    if (fd < 0) return;
+    pf->nfiles++;
+    nesting = depth;
+    warmfile(path, fd);
+    nesting = depth - 1;
+    close(fd);
+}
+
+static void prefetchloop(void) noexcept {
+    for (;;) {
+        prefetch_request* r {};
+        {
+            std::unique_lock<std::mutex> guard { pf->lock };
+            pf->wake.wait(guard, [] { return pf->stop || pf->head != nullptr; });
+            if (pf->stop) return;
+            r        = pf->head;
+            pf->head = r->next;
+            if (!pf->head) pf->tail = nullptr;
+        }
+        warm(r->name, static_cast<int>(::strlen(r->name)), r->angled, r->from, 1);
+        free(r->name);
+        free(r);
+    }
+}
+
+// starts the thread, once the include directories are final
+void startprefetch(void) noexcept {
+    if (pf) return;
+    pf         = new prefetch_state {};
+    pf->thread = std::thread { prefetchloop };
+}
+
+// stops the thread, the queued names it did not get to are dropped
+void stopprefetch(void) noexcept {
+    if (!pf) return;
+    {
+        std::lock_guard<std::mutex> guard { pf->lock };
+        pf->stop = true;
+        pf->wake.notify_one();
+    }
+    pf->thread.join();
+}
@@ -0,0 +1,345 @@
+#include <csetjmp>
+#include <cstdarg>
+#include <ctime>
+
+#include <prep.hpp>
+
+static constexpr size_t TIMESTR_SIZE { 0xFF };
+
+source*  cursource {};
+int      nerrs {};
+token    nltoken { TKNTYPE::NL, 0, 0, 0, 1, 0, (unsigned char*) "\n" };
+char     current_time[TIMESTR_SIZE] {}; // a buffer to store the string representation of current time
+bool     clockread {};                 // __DATE__ or __TIME__ was expanded, so the output holds current_time
+int      incdepth {};
+int      ifdepth {};
+int      ifsatisfied[MAX_NESTED_IF_DEPTH] {};
+int      skipping {};
+jmp_buf* fatal_jump {};  // when set, FATAL errors unwind to this point instead of terminating the process (library mode)
+strbuf*  diagnostics {};     // when set, diagnostics are collected here instead of being written to stderr
+strbuf*  diagnosticscopy {}; // when set, the diagnostics written to stderr are also kept here, for -cache
+
+void (*toplevelinclude)(void) noexcept {}; // when set, called each time an #include of the main file has been read through
+
+// records the time of invocation, used by __DATE__ and __TIME__; SOURCE_DATE_EPOCH stands in for it, in UTC
+void settime(void) noexcept {
+    const char* const epoch = ::getenv("SOURCE_DATE_EPOCH");
+    char*             end {};
+    time_t            now { ::time(nullptr) };
+
+    if (epoch && *epoch) { /* so builds can be reproduced, see reproducible-builds.org */
+        const long long seconds = ::strtoll(epoch, &end, 10);
+        tm              utc {};
+        if (*end || seconds < 0) error(FATAL, "SOURCE_DATE_EPOCH is not a number of seconds: %s", epoch);
+        now = static_cast<time_t>(seconds);
+#ifdef _WIN32
+        ::_gmtime64_s(&utc, &now);
+        ::asctime_s(current_time, TIMESTR_SIZE, &utc);
+#else
+        ::gmtime_r(&now, &utc);
+        ::asctime_r(&utc, current_time);
+#endif
+        return;
+    }
+#ifdef _WIN32
+    ::_ctime64_s(current_time, TIMESTR_SIZE, &now);
+#else
+    ::ctime_r(&now, current_time);
+#endif
+}
+
+// handles rows until the main file ends, or with stop set, until the #include of the main file just entered has been read through
+static void processrows(_In_ token_row* const tknrw, _In_ const bool stop) noexcept {
+    int anymacros {};
+
+    for (;;) {
+        if (tknrw->tp >= tknrw->lp) {
+            tknrw->tp = tknrw->lp = tknrw->bp;
+            resetlinespace();
+            if (pendingrows)
+                anymacros |= pendingrow(tknrw);
+            else
+                anymacros |= gettokens(tknrw, 1);
+            tknrw->tp = tknrw->bp;
+            if (speculating && incdepth == 0 && joinincludes(tknrw)) anymacros = 1;
+        }
+
+        if (tknrw->tp->type == TKNTYPE::END) {
+            if (--incdepth >= 0) {
+                if (cursource->ifdepth) error(ERROR, "Unterminated conditional in #include");
+                unsetsource();
+                cursource->line += cursource->lineinc;
+                tknrw->tp        = tknrw->lp;
+                genline();
+                if (incdepth == 0 && toplevelinclude) toplevelinclude();
+                if (incdepth == 0 && stop) return;
+                continue;
+            }
+            if (ifdepth) error(ERROR, "Unterminated #if/#ifdef/#ifndef");
+            break;
+        }
+
+        if (configgroup > 1)
+            steprow(tknrw, anymacros); /* for every -config configuration still in step */
+        else {
+            processrow(tknrw, anymacros);
+            puttokens(tknrw);
+        }
+        anymacros        = 0;
+        cursource->line += cursource->lineinc;
+        if (cursource->lineinc > 1) genline();
+    }
+}
+
+void process(_In_ token_row* const tknrw) noexcept { processrows(tknrw, false); }
+
+// runs the directive of a row or expands its text, which is then ready to be put out
+void processrow(_Inout_ token_row* const tknrw, _In_ const int anymacros) noexcept {
+    phase_timer timer;
+
+    if (tknrw->tp->type == SHARP) {
+        timer.begin(PREP_PHASE_DIRECTIVE);
+        tknrw->tp += 1;
+        control(tknrw);
+        timer.end();
+    } else if (!skipping && anymacros) {
+        timer.begin(PREP_PHASE_EXPAND);
+        expandrow(tknrw, nullptr, NOT_IN_MACRO);
+        timer.end();
+    }
+
+    if (skipping) {
+        setempty(tknrw);
+        prepstats.skippedlines++;
+    }
+}
+
+void processinclude(_In_ token_row* const tknrw) noexcept { processrows(tknrw, true); }
+
+void control(token_row* tknrw) noexcept {
+    nlist* np {};
+    token* tknptr {};
+
+    tknptr = tknrw->tp;
+    if (tknptr->type != NAME) {
+        if (tknptr->type == NUMBER) goto kline;
+        if (tknptr->type != NL) error(ERROR, "Unidentifiable control line");
+        return; /* else empty line */
+    }
+
+    if ((np = lookup(tknptr, 0)) == nullptr || (np->flag & KEYWORD) == 0 && !skipping) {
+        error(WARNING, "Unknown preprocessor control %t", tknptr);
+        return;
+    }
+
+    if (skipping) {
+        if ((np->flag & KEYWORD) == 0) return;
+        switch (np->val) {
+            case KENDIF :
+                if (--ifdepth < skipping) skipping = 0;
+                --cursource->ifdepth;
+                setempty(tknrw);
+                return;
+
+            case KIFDEF :
+            case KIFNDEF :
+            case KIF :
+                if (++ifdepth >= MAX_NESTED_IF_DEPTH) error(FATAL, "#if too deeply nested");
+                ++cursource->ifdepth;
+                return;
+
+            case KELIF :
+            case KELSE :
+                if (ifdepth <= skipping) break;
+                return;
+
+            default : return;
+        }
+    }
+    switch (np->val) {
+        case KDEFINE : dodefine(tknrw); break;
+
+        case KUNDEF :
+            tknptr += 1;
+            if (tknptr->type != NAME || tknrw->lp - tknrw->bp != 4) {
+                error(ERROR, "Syntax error in #undef");
+                break;
+            }
+            if ((np = lookup(tknptr, 0))) {
+                if (np->flag & UNCHANGEABLE) {
+                    error(ERROR, "#defined token %t can't be undefined", tknptr);
+                    return;
+                }
+                changemacro(np);
+                np->flag &= ~DEFINED_VALUE;
+            }
+            break;
+
+        case KPRAGMA : return;
+
+        case KIFDEF :
+        case KIFNDEF :
+        case KIF :
+            if (++ifdepth >= MAX_NESTED_IF_DEPTH) error(FATAL, "#if too deeply nested");
+            ++cursource->ifdepth;
+            ifsatisfied[ifdepth] = 0;
+            if (eval(tknrw, np->val))
+                ifsatisfied[ifdepth] = 1;
+            else
+                skipping = ifdepth;
+            break;
+
+        case KELIF :
+            if (ifdepth == 0) {
+                error(ERROR, "#elif with no #if");
+                return;
+            }
+            if (ifsatisfied[ifdepth] == 2) error(ERROR, "#elif after #else");
+            if (eval(tknrw, np->val)) {
+                if (ifsatisfied[ifdepth])
+                    skipping = ifdepth;
+                else {
+                    skipping             = 0;
+                    ifsatisfied[ifdepth] = 1;
+                }
+            } else
+                skipping = ifdepth;
+            break;
+
+        case KELSE :
+            if (ifdepth == 0 || cursource->ifdepth == 0) {
+                error(ERROR, "#else with no #if");
+                return;
+            }
+            if (ifsatisfied[ifdepth] == 2) error(ERROR, "#else after #else");
+            if (tknrw->lp - tknrw->bp != 3) error(ERROR, "Syntax error in #else");
+            skipping             = ifsatisfied[ifdepth] ? ifdepth : 0;
+            ifsatisfied[ifdepth] = 2;
+            break;
+
+        case KENDIF :
+            if (ifdepth == 0 || cursource->ifdepth == 0) {
+                error(ERROR, "#endif with no #if");
+                return;
+            }
+            --ifdepth;
+            --cursource->ifdepth;
+            if (tknrw->lp - tknrw->bp != 3) error(WARNING, "Syntax error in #endif");
+            break;
+
+        case KERROR :
+            tknrw->tp = tknptr + 1;
+            error(ERROR, "#error directive: %r", tknrw);
+            break;
+
+        case KWARNING :
+            tknrw->tp = tknptr + 1;
+            error(WARNING, "#warning directive: %r", tknrw);
+            break;
+
+        case KLINE :
+            tknrw->tp = tknptr + 1;
+            expandrow(tknrw, "<line>", NOT_IN_MACRO);
+            tknptr = tknrw->bp + 2;
+kline:
+            if (tknptr + 1 >= tknrw->lp || tknptr->type != NUMBER || tknptr + 3 < tknrw->lp ||
+                (tknptr + 3 == tknrw->lp && ((tknptr + 1)->type != STRING) || *(tknptr + 1)->t == 'L')) {
+                error(ERROR, "Syntax error in #line");
+                return;
+            }
+            cursource->line = atol((char*) tknptr->t) - 1;
+            if (cursource->line < 0 || cursource->line >= 32768) error(WARNING, "#line specifies number out of range");
+            tknptr = tknptr + 1;
+            if (tknptr + 1 < tknrw->lp) cursource->filename = (char*) newstring(tknptr->t + 1, tknptr->len - 2, 0);
+            return;
+
+        case KDEFINED : error(ERROR, "Bad syntax for control line"); break;
+
+        case KINCLUDE :
+            if (specjobs && incdepth == 0 && speculateinclude(tknrw)) {
+                tknrw->lp = tknrw->bp;
+                return;
+            }
+            doinclude(tknrw);
+            tknrw->lp = tknrw->bp;
+            return;
+
+        case KEVAL : eval(tknrw, np->val); break;
+
+        default    : error(ERROR, "Preprocessor control `%t' not yet implemented", tknptr); break;
+    }
+    setempty(tknrw);
+    return;
+}
+
+// appends the printf style formatted string to the buffer
+static void __cdecl strbuf_printf(_Inout_ strbuf* const buf, _In_ const char* const format, ...) noexcept {
+    char    tmp[512] {};
+    va_list args {};
+
+    va_start(args, format);
+    const int len = ::vsnprintf(tmp, sizeof(tmp), format, args);
+    va_end(args);
+    if (len > 0) strbuf_append(buf, tmp, static_cast<size_t>(len) < sizeof(tmp) ? len : sizeof(tmp) - 1);
+}
+
+/*
+ * report a diagnostic, prefixed with the chain of active sources and the macro expansions in progress over them.
+ * the format understands %s, %d, %p, %t (a token) and %r (the rest of a token row, up to the newline).
+ */
+void __cdecl error(_In_ const ERRKIND type, _In_ const char* const format, ...) noexcept {
+    static strbuf message {};
+    const token*  tp {};
+    token_row*    trp {};
+    va_list       args {};
+
+    message.len = 0;
+    strbuf_append(&message, "cpp: ", 5);
+    for (const source* s = cursource; s; s = s->next) {
+        expansionlabels(&message, s);
+        if (*s->filename) strbuf_printf(&message, "%s:%d ", s->filename, s->line);
+    }
+
+    va_start(args, format);
+    for (const char* ep = format; *ep; ep++) {
+        if (*ep != '%') {
+            strbuf_append(&message, ep, 1);
+            continue;
+        }
+        switch (*++ep) {
+            case 's' : strbuf_printf(&message, "%s", va_arg(args, char*)); break;
+            case 'd' : strbuf_printf(&message, "%d", va_arg(args, int)); break;
+            case 'p' : strbuf_printf(&message, "%p", va_arg(args, void*)); break;
+            case 't' :
+                tp = va_arg(args, token*);
+                strbuf_append(&message, reinterpret_cast<const char*>(tp->t), tp->len);
+                break;
+            case 'r' :
+                trp = va_arg(args, token_row*);
+                for (tp = trp->tp; tp < trp->lp && tp->type != NL; tp++) {
+                    if (tp > trp->tp && tp->wslen) strbuf_append(&message, " ", 1);
+                    strbuf_append(&message, reinterpret_cast<const char*>(tp->t), tp->len);
+                }
+                break;
+            case '\0' : ep--; break;
+            default   : strbuf_append(&message, ep, 1); break;
+        }
+    }
+    va_end(args);
+    strbuf_append(&message, "\n", 1);
+
+    if (diagnostics)
+        strbuf_append(diagnostics, message.data, message.len);
+    else {
+        ::fwrite(message.data, sizeof(char), message.len, stderr);
+        ::fflush(stderr);
+        if (diagnosticscopy) strbuf_append(diagnosticscopy, message.data, message.len);
+    }
+
+    if (type != WARNING) nerrs++;
+    if (type == FATAL) {
+        if (fatal_jump) std::longjmp(*fatal_jump, 1);
+        flushout();
+        std::exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,223 @@
+#include <chrono>
+
+#include <prep.hpp>
+
+// the include tree profile behind -include-profile; every file source is timed from setsource() to unsetsource() and
+// charged the lines, tokens and macro expansions counted while it was open, both with and without its nested includes.
+// and the macro profile behind -macro-profile, which charges what expand() does to the macro being expanded
+
+static constexpr size_t MACRO_PROFILE_TOP { 30 }; // how many macros -macro-profile lists
+
+using profile_clock = std::chrono::steady_clock;
+
+char*  includeprofile {}; // where -include-profile writes its trace, nullptr when not profiling
+int    macroprofile {};
+double macronested {}; // inclusive seconds of the expansions nested in the one in progress
+int    macrodepth {};  // expand() calls in progress
+
+struct include_frame final {
+        const char*        name;
+        int                depth;
+        double             start;      // seconds since the first file was entered
+        double             children;   // inclusive seconds of the files it included
+        unsigned long long lines;      // counters at entry
+        unsigned long long tokens;
+        unsigned long long expansions;
+        unsigned long long childlines; // inclusive counters of the files it included
+        unsigned long long childtokens;
+        unsigned long long childexpansions;
+};
+
+struct include_record final {
+        const char*        name;
+        int                depth;
+        double             start;
+        double             inclusive;
+        double             exclusive;
+        unsigned long long lines, selflines;
+        unsigned long long tokens, selftokens;
+        unsigned long long expansions, selfexpansions;
+};
+
+static profile_clock::time_point origin {};
+static include_frame*            frames {}; // the files currently open, innermost last
+static size_t                    nframes {}, maxframes {};
+static include_record*           records {}; // the files already closed, in the order they were closed
+static size_t                    nrecords {}, maxrecords {};
+
+static const profile_clock::time_point epoch = profile_clock::now();
+
+// seconds on a monotonic clock
+double profileclock(void) noexcept { return std::chrono::duration<double>(profile_clock::now() - epoch).count(); }
+
+static double since_origin(void) noexcept { return std::chrono::duration<double>(profile_clock::now() - origin).count(); }
+
+// opens a frame for the file source that was just pushed
+void enterinclude(_In_ const source* const s) noexcept {
+    include_frame* f {};
+
+    if (nframes == 0 && nrecords == 0) origin = profile_clock::now();
+    if (nframes == maxframes) {
+        maxframes = maxframes ? 2 * maxframes : 32;
+        frames    = reinterpret_cast<include_frame*>(_checked_realloc(frames, maxframes * sizeof(include_frame)));
+    }
+    f = &frames[nframes++];
+    ::memset(f, 0, sizeof(include_frame));
+    f->name       = s->filename;
+    f->depth      = static_cast<int>(nframes) - 1;
+    f->start      = since_origin();
+    f->lines      = prepstats.lines;
+    f->tokens     = prepstats.tokens;
+    f->expansions = prepstats.expansions;
+}
+
+// closes the innermost frame and charges its inclusive cost to the file that included it
+void leaveinclude(void) noexcept {
+    include_frame*  f {};
+    include_record* r {};
+
+    if (nframes == 0) return;
+    f = &frames[--nframes];
+    if (nrecords == maxrecords) {
+        maxrecords = maxrecords ? 2 * maxrecords : 64;
+        records    = reinterpret_cast<include_record*>(_checked_realloc(records, maxrecords * sizeof(include_record)));
+    }
+    r                 = &records[nrecords++];
+    r->name           = f->name;
+    r->depth          = f->depth;
+    r->start          = f->start;
+    r->inclusive      = since_origin() - f->start;
+    r->exclusive      = r->inclusive - f->children;
+    r->lines          = prepstats.lines - f->lines;
+    r->tokens         = prepstats.tokens - f->tokens;
+    r->expansions     = prepstats.expansions - f->expansions;
+    r->selflines      = r->lines - f->childlines;
+    r->selftokens     = r->tokens - f->childtokens;
+    r->selfexpansions = r->expansions - f->childexpansions;
+    if (nframes) {
+        f                   = &frames[nframes - 1];
+        f->children        += r->inclusive;
+        f->childlines      += r->lines;
+        f->childtokens     += r->tokens;
+        f->childexpansions += r->expansions;
+    }
+}
+
+// file names may carry backslashes or quotes, neither of which can go into a JSON string as is
+static void jsonstring(_Inout_ FILE* const file, _In_z_ const char* s) noexcept {
+    ::fputc('"', file);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            ::fprintf(file, "\\%c", *s);
+        else if (static_cast<unsigned char>(*s) < 0x20)
+            ::fprintf(file, "\\u%04x", static_cast<unsigned char>(*s));
+        else
+            ::fputc(*s, file);
+    }
+    ::fputc('"', file);
+}
+
+// closes whatever is still open (the main file is never unset) and writes one complete event per file in the
+// Chrome trace event format, which chrome://tracing and Perfetto nest by time on their own
+void writeincludeprofile(_Inout_ FILE* const file) noexcept {
+    while (nframes) leaveinclude();
+    ::fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (size_t i = 0; i < nrecords; i++) {
+        const include_record* const r = &records[i];
+        ::fprintf(file, "%s\n  {\"name\": ", i ? "," : "");
+        jsonstring(file, r->name);
+        ::fprintf(file, ", \"cat\": \"include\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, ", r->start * 1e6, r->inclusive * 1e6);
+        ::fprintf(
+            file,
+            "\"args\": {\"depth\": %d, \"self_us\": %.3f, \"lines\": %llu, \"self_lines\": %llu, \"tokens\": %llu, \"self_tokens\": %llu, "
+            "\"expansions\": %llu, \"self_expansions\": %llu}}",
+            r->depth,
+            r->exclusive * 1e6,
+            r->lines,
+            r->selflines,
+            r->tokens,
+            r->selftokens,
+            r->expansions,
+            r->selfexpansions
+        );
+    }
+    ::fprintf(file, "\n]}\n");
+    free(records);
+    free(frames);
+    records  = nullptr;
+    frames   = nullptr;
+    nrecords = maxrecords = nframes = maxframes = 0;
+}
+
+// the figures of np, allocated the first time it is expanded
+macro_cost* macrocost(_Inout_ nlist* const np) noexcept {
+    if (!np->cost) np->cost = _checked_malloc<macro_cost>(1);
+    return np->cost;
+}
+
+struct macro_list final {
+        nlist** names;
+        size_t  count;
+        size_t  max;
+};
+
+static void listcosted(_In_ nlist* const np, _Inout_ void* const context) noexcept {
+    macro_list* const ml = reinterpret_cast<macro_list*>(context);
+
+    if (!np->cost || !np->cost->calls) return;
+    if (ml->count == ml->max) {
+        ml->max   = ml->max ? 2 * ml->max : 256;
+        ml->names = reinterpret_cast<nlist**>(_checked_realloc(ml->names, ml->max * sizeof(nlist*)));
+    }
+    ml->names[ml->count++] = np;
+}
+
+// most inclusive time first
+static int bycost(_In_ const void* const left, _In_ const void* const right) noexcept {
+    const double l = (*reinterpret_cast<nlist* const*>(left))->cost->time, r = (*reinterpret_cast<nlist* const*>(right))->cost->time;
+    return l < r ? 1 : l > r ? -1 : 0;
+}
+
+// writes the MACRO_PROFILE_TOP macros that took the most time, times in milliseconds
+void writemacroprofile(_Inout_ FILE* const file) noexcept {
+    macro_list ml {};
+
+    forallnames(listcosted, &ml);
+    if (ml.count) ::qsort(ml.names, ml.count, sizeof(nlist*), bycost);
+    ::fprintf(file, "macro profile: %zu macros expanded, times in ms\n", ml.count);
+    ::fprintf(
+        file,
+        "%-32s %10s %12s %5s %10s %10s %10s %10s %10s  %s\n",
+        "macro",
+        "calls",
+        "tokens",
+        "depth",
+        "total",
+        "self",
+        "args",
+        "subst",
+        "##",
+        "defined at"
+    );
+    for (size_t i = 0; i < ml.count && i < MACRO_PROFILE_TOP; i++) {
+        const nlist* const      np = ml.names[i];
+        const macro_cost* const c  = np->cost;
+        ::fprintf(
+            file,
+            "%-32.*s %10llu %12llu %5d %10.3f %10.3f %10.3f %10.3f %10.3f  %s:%d\n",
+            np->len,
+            np->name,
+            c->calls,
+            c->tokens,
+            c->maxdepth,
+            c->time * 1e3,
+            c->selftime * 1e3,
+            c->gathertime * 1e3,
+            c->substtime * 1e3,
+            c->concattime * 1e3,
+            np->deffile ? np->deffile : "?",
+            np->defline
+        );
+    }
+    free(ml.names);
+}
@@ -0,0 +1,374 @@
+#include <prep.hpp>
+
+/*
+ * -j<n>, speculative preprocessing of the #includes of the main file in up to n worker processes.
+ * the main file is read as usual, but a run of #include "file" or #include <file> lines, blank lines in between, is
+ * handed out to workers forked at the line of each #include, so every worker starts from a copy-on-write snapshot of the
+ * whole preprocessor. the first other line waits for them and takes their results in order: a worker's output and
+ * definitions are only accepted when none of the names it looked up was written since it was forked, by the workers
+ * accepted before it or by the #includes redone here. otherwise its #include is redone here, from the right state and
+ * at the right place in the output, so the result is always that of a sequential run.
+ */
+
+int specjobs {};    // -j, how many workers may run at once, 0 for none
+int speculating {}; // workers started and not yet taken in
+
+#ifdef _WIN32
+
+// there is no fork() to snapshot the preprocessor with, every #include is done in place
+bool speculateinclude(_Inout_ token_row* const) noexcept { return false; }
+
+bool joinincludes(_In_ const token_row* const) noexcept { return false; }
+
+#else
+
+    #include <sys/wait.h>
+
+static constexpr long long RESULT_COMPLETE { 0x5350454355 }; // the last number a worker writes, a result short of it is redone
+static constexpr size_t    NAME_SET_SLOTS { 4096 };          // initial size of a name_set, always a power of two
+
+// an open addressing hash set of names, the keys index into text, or of pointers, the keys are the pointers
+struct name_set final {
+        size_t* keys;  // 0 for a free slot
+        size_t  slots;
+        size_t  count;
+        strbuf  text;  // every name as an int length followed by its bytes, a key is an offset into it + 1
+};
+
+struct worker final {
+        pid_t      pid;
+        int        fd;      // the reading end of the pipe it writes its result to
+        size_t     at;      // how much output the main file had produced when it was started
+        size_t     mark;    // the savemacros() trail position it was started from
+        unsigned   ifepoch; // ifchanges when it was started
+        int        line;    // of its #include in the main file
+        int        lineinc;
+        token_row* row;     // a copy of the #include line, to redo it with
+};
+
+static worker*   workers {}; // in the order of their #include lines
+static bool      batching {};
+static strbuf    mainout {}; // the output of the main file itself while workers run
+static size_t    mainused {};
+static strbuf*   finalout {}; // where output went before the workers were started
+static size_t    batchmark {};
+static unsigned  ifchanges {}; // times an #include left the #if state changed, the workers started before are redone
+static token_row redorow {};
+static name_set  readnames {}; // the rest is the worker's side
+static size_t    workermark {};
+static int       workernerrs {};
+static strbuf    workerout {}, workerdiag {};
+static int       resultfd { -1 };
+
+static size_t hashbytes(_In_reads_(len) const unsigned char* const s, _In_ const int len) noexcept {
+    size_t h { 5381 };
+
+    for (int i = 0; i < len; i++) h = h * 33 + s[i];
+    return h;
+}
+
+static size_t hashpointer(_In_ const size_t p) noexcept { return p >> 4; }
+
+static int namelength(_In_ const name_set* const set, _In_ const size_t key) noexcept {
+    int len {};
+
+    ::memcpy(&len, set->text.data + key - 1, sizeof(int));
+    return len;
+}
+
+static const unsigned char* namebytes(_In_ const name_set* const set, _In_ const size_t key) noexcept {
+    return reinterpret_cast<const unsigned char*>(set->text.data + key - 1 + sizeof(int));
+}
+
+static void growset(_Inout_ name_set* const set, _In_ const bool names) noexcept {
+    size_t* const old   = set->keys;
+    const size_t  slots = set->slots;
+
+    set->slots = slots ? 2 * slots : NAME_SET_SLOTS;
+    set->keys  = _checked_malloc<size_t>(set->slots);
+    for (size_t i = 0; i < slots; i++) {
+        if (!old[i]) continue;
+        size_t j = (names ? hashbytes(namebytes(set, old[i]), namelength(set, old[i])) : hashpointer(old[i])) & (set->slots - 1);
+        while (set->keys[j]) j = (j + 1) & (set->slots - 1);
+        set->keys[j] = old[i];
+    }
+    free(old);
+}
+
+static void addname(_Inout_ name_set* const set, _In_reads_(len) const unsigned char* const name, _In_ const int len) noexcept {
+    size_t i;
+
+    if (2 * (set->count + 1) > set->slots) growset(set, true);
+    for (i = hashbytes(name, len) & (set->slots - 1); set->keys[i]; i = (i + 1) & (set->slots - 1))
+        if (namelength(set, set->keys[i]) == len && ::memcmp(namebytes(set, set->keys[i]), name, len) == 0) return;
+    set->keys[i] = set->text.len + 1;
+    strbuf_append(&set->text, reinterpret_cast<const char*>(&len), sizeof(int));
+    strbuf_append(&set->text, reinterpret_cast<const char*>(name), len);
+    set->count++;
+}
+
+static void addpointer(_In_ nlist* const np, _Inout_ void* const context) noexcept {
+    name_set* const set = reinterpret_cast<name_set*>(context);
+    const size_t    key = reinterpret_cast<size_t>(np);
+    size_t          i;
+
+    if (2 * (set->count + 1) > set->slots) growset(set, false);
+    for (i = hashpointer(key) & (set->slots - 1); set->keys[i]; i = (i + 1) & (set->slots - 1))
+        if (set->keys[i] == key) return;
+    set->keys[i] = key;
+    set->count++;
+}
+
+static bool haspointer(_In_ const name_set* const set, _In_opt_ const nlist* const np) noexcept {
+    if (!np || !set->count) return false;
+    for (size_t i = hashpointer(reinterpret_cast<size_t>(np)) & (set->slots - 1); set->keys[i]; i = (i + 1) & (set->slots - 1))
+        if (set->keys[i] == reinterpret_cast<size_t>(np)) return true;
+    return false;
+}
+
+static void recordname(_In_reads_(len) const unsigned char* const name, _In_ const int len) noexcept { addname(&readnames, name, len); }
+
+// the end of a worker: its output, diagnostics and #if state, the names it looked up and the macros it changed
+static void finishworker(void) noexcept {
+    strbuf    result {};
+    name_set  written {};
+    long long n {};
+
+    flushout();
+    putnumber(&result, nerrs - workernerrs);
+    putnumber(&result, ifdepth);
+    putnumber(&result, skipping);
+    strbuf_append(&result, reinterpret_cast<const char*>(ifsatisfied), sizeof(ifsatisfied));
+    putbytes(&result, workerout.data, workerout.len);
+    putbytes(&result, workerdiag.data, workerdiag.len);
+    putbytes(&result, readnames.text.data, readnames.text.len);
+    changedmacros(workermark, addpointer, &written);
+    putnumber(&result, static_cast<long long>(written.count));
+    for (size_t i = 0; i < written.slots; i++) {
+        const nlist* const np = reinterpret_cast<const nlist*>(written.keys[i]);
+        if (!np) continue;
+        putbytes(&result, np->name, np->len);
+        putnumber(&result, np->flag);
+        putnumber(&result, np->defline);
+        putbytes(&result, np->deffile ? np->deffile : "", np->deffile ? ::strlen(np->deffile) : 0);
+        putrow(&result, np->ap);
+        putrow(&result, np->vp);
+    }
+    putnumber(&result, RESULT_COMPLETE);
+    for (const char* p = result.data; p < result.data + result.len; p += n)
+        if ((n = ::write(resultfd, p, result.data + result.len - p)) <= 0) break;
+    _exit(EXIT_SUCCESS);
+}
+
+// the worker's side of the fork, it takes over the #include and goes on to the end of it
+static void startworker(_Inout_ token_row* const trp) noexcept {
+    for (int i = 0; i < speculating; i++) close(workers[i].fd);
+    speculating     = 0;
+    specjobs        = 0;
+    prefetchflag    = 0; /* the prefetch thread was not forked along, its lock may be held for good */
+    closeuring();        /* nor may the parent's io_uring be shared */
+    batching        = false;
+    workernerrs     = nerrs;
+    workermark      = savemacros();
+    outmemory       = &workerout;
+    diagnostics     = &workerdiag;
+    toplevelinclude = finishworker;
+    namelookup      = recordname;
+    passallnames(); /* names the main file may have defined since must not go by unseen */
+    doinclude(trp);
+    if (incdepth == 0) finishworker(); /* the file was not found */
+}
+
+// redoes the #include of w here, as if the main file had just reached it
+static void redo(_In_ const worker* const w) noexcept {
+    const int line = cursource->line, lineinc = cursource->lineinc, olddepth = ifdepth, oldskipping = skipping;
+
+    cursource->line    = w->line;
+    cursource->lineinc = w->lineinc;
+    w->row->tp         = w->row->bp + 1;
+    doinclude(w->row);
+    if (incdepth) {
+        if (!redorow.bp) maketokenrow(3, &redorow);
+        redorow.tp = redorow.lp = redorow.bp;
+        processinclude(&redorow);
+    }
+    cursource->line    = line;
+    cursource->lineinc = lineinc;
+    if (ifdepth != olddepth || skipping != oldskipping) ifchanges++;
+}
+
+// applies the result of w, or returns false when it is incomplete or w looked up a name that was written since it was started
+static bool acceptresult(_In_ const worker* const w, _In_ const strbuf* const result) noexcept {
+    byte_reader r { result->data, result->data + result->len, false };
+    name_set      written {};
+    long long     complete {};
+    size_t        outlen {}, diaglen {}, nameslen {};
+    const char*   deffile {};
+    bool          clash {};
+
+    if (result->len < sizeof(complete)) return false;
+    ::memcpy(&complete, result->data + result->len - sizeof(complete), sizeof(complete));
+    if (complete != RESULT_COMPLETE || w->ifepoch != ifchanges) return false;
+    const long long errors = getnumber(&r), depth = getnumber(&r), skip = getnumber(&r);
+    const char*     satisfied = r.p;
+    r.p                      += sizeof(ifsatisfied);
+    const char* const out     = getbytes(&r, &outlen);
+    const char* const diag    = getbytes(&r, &diaglen);
+    const char* const names   = getbytes(&r, &nameslen);
+    if (r.bad) return false;
+
+    changedmacros(w->mark, addpointer, &written);
+    for (const char* p = names; written.count && !clash && p < names + nameslen;) {
+        token t {};
+        int   len {};
+        ::memcpy(&len, p, sizeof(int));
+        t.len  = static_cast<unsigned>(len);
+        t.t    = reinterpret_cast<unsigned char*>(const_cast<char*>(p + sizeof(int)));
+        p     += sizeof(int) + len;
+        clash  = haspointer(&written, lookup(&t, 0));
+    }
+    free(written.keys);
+    if (clash) return false;
+
+    for (long long i = 0, nwrites = getnumber(&r); i < nwrites && !r.bad; i++) {
+        token  t {};
+        size_t len {}, filelen {};
+        t.t                        = reinterpret_cast<unsigned char*>(const_cast<char*>(getbytes(&r, &len)));
+        t.len                      = static_cast<unsigned>(len);
+        const char        flag     = static_cast<char>(getnumber(&r));
+        const int         defline  = static_cast<int>(getnumber(&r));
+        const char* const file     = getbytes(&r, &filelen);
+        token_row* const  ap       = getrow(&r);
+        token_row* const  vp       = getrow(&r);
+        nlist* const      np       = lookup(&t, 1);
+        if (filelen && (!deffile || ::strlen(deffile) != filelen || ::strncmp(deffile, file, filelen) != 0))
+            deffile = reinterpret_cast<char*>(newstring(reinterpret_cast<const unsigned char*>(file), filelen, 0));
+        changemacro(np);
+        setdefinition(np, vp, ap);
+        np->flag    = flag;
+        np->deffile = filelen ? deffile : nullptr;
+        np->defline = defline;
+    }
+    nerrs += static_cast<int>(errors);
+    if (depth != ifdepth || skip != skipping) ifchanges++;
+    ifdepth  = static_cast<int>(depth);
+    skipping = static_cast<int>(skip);
+    ::memcpy(ifsatisfied, satisfied, sizeof(ifsatisfied));
+    if (outlen) writeout(out, outlen);
+    if (!diaglen) return true;
+    if (diagnostics)
+        strbuf_append(diagnostics, diag, diaglen);
+    else {
+        ::fwrite(diag, sizeof(char), diaglen, stderr);
+        ::fflush(stderr);
+    }
+    return true;
+}
+
+// takes in the oldest worker: the output of the main file up to its #include, then its result or a redo of it
+static void takeworker(void) noexcept {
+    worker* const w = &workers[0];
+    strbuf        result {};
+    char          chunk[OUTPUT_BUFFER_SIZE];
+    long long     n {};
+
+    flushout();
+    outmemory = finalout;
+    if (w->at > mainused) writeout(mainout.data + mainused, w->at - mainused);
+    mainused = w->at;
+    while ((n = ::read(w->fd, chunk, sizeof(chunk))) > 0) strbuf_append(&result, chunk, static_cast<size_t>(n));
+    close(w->fd);
+    ::waitpid(w->pid, nullptr, 0);
+    if (!acceptresult(w, &result)) {
+        redo(w);
+        flushout();
+    }
+    free(result.data);
+    freemacros(w->mark);
+    for (token* tp = w->row->bp; tp < w->row->lp; tp++)
+        if (tp->len) free(tp->t - 1);
+    free(w->row->bp);
+    free(w->row);
+    ::memmove(workers, workers + 1, --speculating * sizeof(worker));
+    outmemory = &mainout;
+}
+
+// takes in every worker, the main file goes on alone
+static void takeall(void) noexcept {
+    while (speculating) takeworker();
+    flushout();
+    outmemory = finalout;
+    if (mainout.len > mainused) writeout(mainout.data + mainused, mainout.len - mainused);
+    mainout.len = mainused = 0;
+    freemacros(batchmark);
+    batching = false;
+}
+
+// the lines of the main file that may go by while workers run: blank ones and #includes of a plain file name
+static bool speculable(_In_ const token_row* const trp) noexcept {
+    const token* tp = trp->bp;
+
+    if (trp->lp - tp == 1 && tp->type == NL) return true;
+    if (cursource->lineinc > 1 || trp->lp - tp < 4 || tp->type != SHARP || tp[1].type != NAME) return false;
+    if (tp[1].len != 7 || ::strncmp(reinterpret_cast<const char*>(tp[1].t), "include", 7) != 0) return false;
+    if (tp[2].type == STRING) return trp->lp - tp == 4 && tp[3].type == NL;
+    if (tp[2].type != LT) return false;
+    for (tp += 3; tp < trp->lp - 2 && tp->type != GT; tp++);
+    return tp->type == GT && tp + 2 == trp->lp && tp[1].type == NL;
+}
+
+// process() calls this on every line of the main file while workers run, any line but the above waits for them; returns
+// whether it did, the definitions taken in may make macros of names the row was read without
+bool joinincludes(_In_ const token_row* const trp) noexcept {
+    if (speculable(trp)) return false;
+    takeall();
+    return true;
+}
+
+// called on an #include of the main file under -j, starts a worker on it or returns false when it is to be done here
+bool speculateinclude(_Inout_ token_row* const trp) noexcept {
+    int     fds[2] {};
+    worker* w {};
+
+    if (!speculable(trp)) return false;
+    if (speculating == specjobs) takeworker();
+    if (::pipe(fds) != 0) {
+        if (batching) takeall();
+        return false;
+    }
+    flushout();
+    if (!batching) {
+        if (!workers) workers = _checked_malloc<worker>(specjobs);
+        finalout  = outmemory;
+        outmemory = &mainout;
+        batchmark = savemacros();
+        batching  = true;
+    }
+    w          = &workers[speculating];
+    w->at      = mainout.len;
+    w->mark    = savemacros();
+    w->ifepoch = ifchanges;
+    w->line    = cursource->line;
+    w->lineinc = cursource->lineinc;
+    w->fd      = fds[0];
+    w->pid     = ::fork();
+    if (w->pid == 0) {
+        close(fds[0]);
+        resultfd = fds[1];
+        startworker(trp);
+        return true;
+    }
+    close(fds[1]);
+    if (w->pid < 0) {
+        close(fds[0]);
+        freemacros(w->mark);
+        takeall();
+        return false;
+    }
+    trp->tp = trp->bp;
+    w->row  = normtokenrow(trp);
+    speculating++;
+    return true;
+}
+
+#endif
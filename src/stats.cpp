@@ -0,0 +1,96 @@
+#include <chrono>
+
+#include <prep.hpp>
+
+// the counters behind -stats; bumping them is cheap enough to leave them on the hot paths unconditionally,
+// only the wall clock is read exclusively when statistics were asked for
+
+static constexpr size_t STATS_TOP_MACROS { 20 }; // how many of the most expanded macros -stats lists
+
+using stats_clock = std::chrono::steady_clock;
+
+prep_stats prepstats {};
+int        statsflag {};
+prep_phase curphase { PREP_PHASE_OTHER };
+
+static stats_clock::time_point phasestart {}; // when curphase was entered
+static stats_clock::time_point runstart {};
+
+static constexpr const char* phase_names[PREP_NPHASES] = { "other", "lex", "directive", "eval", "expand", "include", "output" };
+
+// zeroes the counters and starts the clocks
+void startstats(void) noexcept {
+    ::memset(&prepstats, 0, sizeof(prep_stats));
+    curphase   = PREP_PHASE_OTHER;
+    phasestart = runstart = stats_clock::now();
+}
+
+// charges the time since the last switch to the current phase and makes phase current
+void switchphase(_In_ const prep_phase phase) noexcept {
+    const stats_clock::time_point now  = stats_clock::now();
+    prepstats.phase[curphase]         += std::chrono::duration<double>(now - phasestart).count();
+    phasestart                         = now;
+    curphase                           = phase;
+}
+
+// closes the books on the run, called once before the numbers are reported
+void stopstats(void) noexcept {
+    if (!statsflag) return;
+    switchphase(curphase);
+    prepstats.total = std::chrono::duration<double>(stats_clock::now() - runstart).count();
+}
+
+struct macro_count final {
+        nlist* top[STATS_TOP_MACROS];
+        size_t count;
+};
+
+// keeps the STATS_TOP_MACROS most expanded names, ordered by decreasing expansion count
+static void rankmacro(_In_ nlist* const np, _Inout_ void* const context) noexcept {
+    macro_count* const mc = reinterpret_cast<macro_count*>(context);
+    size_t             i {};
+
+    if (np->nexpand == 0) return;
+    if (mc->count == STATS_TOP_MACROS && mc->top[STATS_TOP_MACROS - 1]->nexpand >= np->nexpand) return;
+    if (mc->count < STATS_TOP_MACROS) mc->count++;
+    for (i = mc->count - 1; i > 0 && mc->top[i - 1]->nexpand < np->nexpand; i--) mc->top[i] = mc->top[i - 1];
+    mc->top[i] = np;
+}
+
+// writes the counters as a single JSON object
+void writestats(_Inout_ FILE* const file) noexcept {
+    macro_count              mc {};
+    const unsigned long long negatives = prepstats.filterchecks - (prepstats.filterpasses - prepstats.filtermisses); // names that are no macro
+
+    stopstats();
+    forallnames(rankmacro, &mc);
+    ::fprintf(file, "{\n");
+    if (cachedir) ::fprintf(file, "  \"cache\": \"%s\",\n", cachehit ? "hit" : "miss"); /* a hit counts nothing below */
+    ::fprintf(file, "  \"bytes\": %llu,\n", prepstats.bytes);
+    ::fprintf(file, "  \"lines\": %llu,\n", prepstats.lines);
+    ::fprintf(file, "  \"tokens\": %llu,\n", prepstats.tokens);
+    ::fprintf(file, "  \"skipped_lines\": %llu,\n", prepstats.skippedlines);
+    ::fprintf(file, "  \"lookups\": %llu,\n", prepstats.lookups);
+    ::fprintf(file, "  \"chain_walks\": %llu,\n", prepstats.chainwalks);
+    ::fprintf(
+        file, "  \"lookup_average_chain\": %.3f,\n", prepstats.chainwalks ? static_cast<double>(prepstats.chainsteps) / prepstats.chainwalks : 0.0
+    );
+    ::fprintf(file, "  \"prefilter_checks\": %llu,\n", prepstats.filterchecks);
+    ::fprintf(file, "  \"prefilter_passes\": %llu,\n", prepstats.filterpasses);
+    ::fprintf(file, "  \"prefilter_false_positives\": %llu,\n", prepstats.filtermisses);
+    ::fprintf(file, "  \"prefilter_false_positive_rate\": %.4f,\n", negatives ? static_cast<double>(prepstats.filtermisses) / negatives : 0.0);
+    ::fprintf(file, "  \"expansions\": %llu,\n", prepstats.expansions);
+    ::fprintf(file, "  \"hidesets\": %llu,\n", prepstats.hidesets);
+    ::fprintf(file, "  \"hideset_lookups\": %llu,\n", prepstats.hidesetlookups);
+    ::fprintf(file, "  \"hideset_hits\": %llu,\n", prepstats.hidesethits);
+    ::fprintf(file, "  \"includes\": %llu,\n", prepstats.includes);
+    ::fprintf(file, "  \"include_failures\": %llu,\n", prepstats.includefailures);
+    ::fprintf(file, "  \"include_probes\": %llu,\n", prepstats.includeprobes);
+    ::fprintf(file, "  \"seconds\": {");
+    for (size_t i = 0; i < PREP_NPHASES; i++) ::fprintf(file, "%s\"%s\": %.6f", i ? ", " : " ", phase_names[i], prepstats.phase[i]);
+    ::fprintf(file, ", \"total\": %.6f },\n", prepstats.total);
+    ::fprintf(file, "  \"top_expanded\": [");
+    for (size_t i = 0; i < mc.count; i++)
+        ::fprintf(file, "%s\n    { \"name\": \"%.*s\", \"expansions\": %lu }", i ? "," : "", mc.top[i]->len, mc.top[i]->name, mc.top[i]->nexpand);
+    ::fprintf(file, "%s]\n}\n", mc.count ? "\n  " : "");
+}
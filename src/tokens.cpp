@@ -1,9 +1,127 @@
 #include <array>
+#include <cstddef>
 
 #include <prep.hpp>
 
-static char        writebuffer[OUTPUT_BUFFER_SIZE << 1];
-static char* const _ptrwritebuffer = writebuffer;
+static constexpr size_t LINE_CHUNK_SIZE { 16'384 };
+
+static char  writebuffer[OUTPUT_BUFFER_SIZE << 1];
+static char* _ptrwritebuffer = writebuffer;
+
+// a block of the per line storage, the bytes follow the header
+struct line_chunk final {
+        line_chunk* next;
+        size_t      size;
+        size_t      used;
+};
+
+static line_chunk* linechunks {}; // every chunk ever allocated, they are reused from the first one on every line
+static line_chunk* linechunk {};  // the one being filled
+
+strbuf*         outmemory {};  // when set, the preprocessed output is collected here instead of being written to stdout
+strbuf*         outputcopy {}; // when set, the output is also kept here as it is written, for -cache
+prep_token_sink tokensink {}; // when set, output lines are handed over as tokens and never serialized
+void*           tokensinkcontext {};
+
+static prep_token* sinktokens {}; // what a row is copied into for the tokensink, kept from one row to the next
+static size_t      nsinktokens {};
+
+static_assert(static_cast<unsigned>(PREP_NAME) == NAME && static_cast<unsigned>(PREP_UMINUS) == UMINUS, "prep_tokentype must mirror TKNTYPE");
+
+// appends len bytes to the growable buffer
+void strbuf_append(_Inout_ strbuf* const buf, _In_reads_(len) const char* const str, _In_ const size_t len) noexcept {
+    if (buf->len + len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : OUTPUT_BUFFER_SIZE;
+        while (buf->len + len + 1 > cap) cap *= 2;
+        buf->data = reinterpret_cast<char*>(_checked_realloc(buf->data, cap));
+        buf->cap  = cap;
+    }
+    ::memcpy(buf->data + buf->len, str, len);
+    buf->len            += len;
+    buf->data[buf->len]  = '\0'; // keep it usable as a C string
+}
+
+// binary records, e.g. a -j worker's result, are numbers and length prefixed byte strings in the host's byte order
+void putnumber(_Inout_ strbuf* const buf, _In_ const long long n) noexcept { strbuf_append(buf, reinterpret_cast<const char*>(&n), sizeof(n)); }
+
+void putbytes(_Inout_ strbuf* const buf, _In_reads_(len) const void* const data, _In_ const size_t len) noexcept {
+    putnumber(buf, static_cast<long long>(len));
+    if (len) strbuf_append(buf, reinterpret_cast<const char*>(data), len);
+}
+
+// a token row, nullptr included
+void putrow(_Inout_ strbuf* const buf, _In_opt_ const token_row* const trp) noexcept {
+    if (!trp) {
+        putnumber(buf, -1);
+        return;
+    }
+    putnumber(buf, tokenrow_len(trp));
+    for (const token* tp = trp->bp; tp < trp->lp; tp++) {
+        putnumber(buf, tp->type);
+        putnumber(buf, tp->flag);
+        putnumber(buf, tp->wslen);
+        putbytes(buf, tp->t, tp->len);
+    }
+}
+
+long long getnumber(_Inout_ byte_reader* const r) noexcept {
+    long long n {};
+
+    if (r->end - r->p < static_cast<ptrdiff_t>(sizeof(n))) {
+        r->bad = true;
+        return 0;
+    }
+    ::memcpy(&n, r->p, sizeof(n));
+    r->p += sizeof(n);
+    return n;
+}
+
+// a byte string, where it lies in the record
+const char* getbytes(_Inout_ byte_reader* const r, _Out_ size_t* const len) noexcept {
+    const long long n = getnumber(r);
+
+    *len = 0;
+    if (r->bad || n < 0 || r->end - r->p < n) {
+        r->bad = true;
+        return r->p;
+    }
+    *len  = static_cast<size_t>(n);
+    r->p += n;
+    return r->p - n;
+}
+
+// a definition as newdefinition() made it, held by nobody yet
+token_row* getrow(_Inout_ byte_reader* const r) noexcept {
+    const long long n = getnumber(r);
+    token_row       row {};
+    token_row*      trp {};
+
+    if (r->bad || n < 0) return nullptr;
+    maketokenrow(n ? n : 1, &row);
+    for (long long i = 0; i < n && !r->bad; i++) {
+        token* const tp = row.lp++;
+        size_t       len {};
+        const long long type = getnumber(r);
+        tp->type             = static_cast<TKNTYPE>(type >= 0 && type <= UMINUS ? type : UNCLASS);
+        tp->flag             = static_cast<unsigned char>(getnumber(r));
+        tp->wslen            = getnumber(r) ? 1 : 0;
+        tp->t                = reinterpret_cast<unsigned char*>(const_cast<char*>(getbytes(r, &len)));
+        tp->len              = static_cast<unsigned>(len);
+    }
+    row.tp = row.bp;
+    trp    = newdefinition(&row);
+    free(row.bp);
+    return trp;
+}
+
+// the single exit point for preprocessed text
+void writeout(_In_reads_(len) const char* const str, _In_ const size_t len) noexcept {
+    if (outputcopy) strbuf_append(outputcopy, str, len);
+    if (outmemory)
+        strbuf_append(outmemory, str, len);
+    else if (!emitoutput(str, len))
+        ::write(1, str, len);
+}
 
 // true for tokens that don't need whitespace when they get inserted by macro expansion
 static constexpr std::array<bool, 60> whitespace_table {
@@ -73,7 +191,7 @@ static constexpr std::array<bool, 60> whitespace_table {
 void maketokenrow(_In_ const long long size, _Inout_ token_row* const tknrow) noexcept {
     tknrow->max = size;
     if (size > 0)
-        tknrow->bp = reinterpret_cast<token*>(_checked_malloc(size * sizeof(token)));
+        tknrow->bp = _checked_malloc<token>(size);
     else
         tknrow->bp = nullptr;
 
@@ -99,7 +217,7 @@ int comparetokens(token_row* tknrow_0, token_row* tknrow_1) noexcept {
 
     for (; tp1 < tknrow_0->lp; tp1++, tp2++)
         if (tp1->type != tp2->type || (tp1->wslen == 0) != (tp2->wslen == 0) || tp1->len != tp2->len ||
-            ::strncmp(tp1->t, tp2->t, tp1->len) != 0)
+            ::strncmp(reinterpret_cast<const char*>(tp1->t), reinterpret_cast<const char*>(tp2->t), tp1->len) != 0)
             return 1;
 
     return 0;
@@ -110,7 +228,7 @@ int comparetokens(token_row* tknrow_0, token_row* tknrow_1) noexcept {
  * tp ends up pointing just beyond the replacement.
  * Canonical whitespace is assured on each side.
  */
-void insertrow(token_row* dest, size_t ntokens, token_row* src) {
+void insertrow(token_row* dest, int ntokens, token_row* src) {
     int nrtok  = tokenrow_len(src);
 
     dest->tp  += ntokens;
@@ -139,11 +257,13 @@ void makespace(token_row* trp) {
         return;
     }
     if (whitespace_table[tp->type] || trp->tp > trp->bp && whitespace_table[(tp - 1)->type]) return;
-    tt         = newstring(tp->t, tp->len, 1);
-    *tt++      = ' ';
-    tp->t      = tt;
-    tp->wslen  = 1;
-    tp->flag  |= XPWS;
+    tt = linespace(tp->len + 2); /* the token lives as long as its line */
+    memcpy(tt + 1, tp->t, tp->len);
+    tt[tp->len + 1]  = '\0';
+    *tt++            = ' ';
+    tp->t            = tt;
+    tp->wslen        = 1;
+    tp->flag        |= XPWS;
 }
 
 /*
@@ -156,7 +276,7 @@ void movetokenrow(token_row* dtr, token_row* str) {
 
     /* nby = sizeof(token) * (src->lp - src->bp); */
     nby = (char*) str->lp - (char*) str->bp;
-    memmove(dtr->tp, str->bp, nby);
+    if (nby) memmove(dtr->tp, str->bp, nby);
 }
 
 /*
@@ -216,10 +336,75 @@ token_row* normtokenrow(token_row* trp) {
     return ntrp;
 }
 
+/*
+ * a definition of the tokens from trp->tp on, spaced the way normtokenrow() spaces them and held by nobody yet. the
+ * spellings share one block, each with a blank before it and a nul after it.
+ */
+token_row* newdefinition(_In_ const token_row* const trp) noexcept {
+    macro_definition* const def = _new_obj<macro_definition>();
+    const long long         len = trp->lp - trp->tp;
+    size_t                  size {};
+    unsigned char*          p;
+
+    for (const token* tp = trp->tp; tp < trp->lp; tp++)
+        if (tp->len) size += tp->len + 2;
+    maketokenrow(len > 0 ? len : 1, &def->row);
+    def->text = p = _checked_malloc<unsigned char>(size ? size : 1);
+    def->refs     = 0;
+    for (const token* tp = trp->tp; tp < trp->lp; tp++) {
+        token* const ntp = def->row.lp++;
+        *ntp             = *tp;
+        if (!tp->len) continue;
+        *p++ = ' ';
+        ::memcpy(p, tp->t, tp->len);
+        ntp->t      = p;
+        p          += tp->len;
+        *p++        = '\0';
+        if (tp->wslen) ntp->wslen = 1;
+    }
+    if (def->row.lp > def->row.bp) def->row.bp->wslen = 0;
+    return &def->row;
+}
+
+// one more holder of a definition, returns it
+token_row* holddefinition(_In_opt_ token_row* const trp) noexcept {
+    if (trp) reinterpret_cast<macro_definition*>(trp)->refs++;
+    return trp;
+}
+
+// np lets go of one of its definitions, the last holder frees it along with what np worked out from it
+void dropdefinition(_Inout_ nlist* const np, _In_opt_ token_row* const trp) noexcept {
+    macro_definition* const def = reinterpret_cast<macro_definition*>(trp);
+
+    if (!def || --def->refs) return;
+    if (np->tpl && np->tpl->vp == trp) np->tpl->vp = nullptr; /* a later definition may get the same address */
+    if (np->inertvp == trp) np->inertvp = nullptr;
+    free(def->text);
+    free(def->row.bp);
+    free(def);
+}
+
+/*
+ * Give the tokens of a macro argument, in place, the white space normtokenrow() gives a copy:
+ * none before the first and a single blank before the others that had any.
+ * The argument's tokens are about to be replaced by the expansion, so nobody else sees the change.
+ */
+void normargument(token_row* trp) {
+    token* tp;
+
+    for (tp = trp->bp; tp < trp->lp; tp++) {
+        if (tp->len && tp->wslen) {
+            tp->wslen = 1;
+            tp->t[-1] = ' ';
+        }
+    }
+    if (trp->lp > trp->bp) trp->bp->wslen = 0;
+}
+
 /*
  * Debugging
  */
-void peektokens(token_row* trp, char* str) {
+void peektokens(token_row* trp, const char* str) {
     token* tp;
     int    c;
 
@@ -249,8 +434,25 @@ void puttokens(token_row* trp) {
     token*         tp;
     int            len;
     unsigned char* p;
+    phase_timer    timer;
 
+    timer.begin(PREP_PHASE_OUTPUT);
     if (verbose) peektokens(trp, "");
+    if (tokensink) {
+        const token* lp = trp->lp;
+        if (lp > trp->bp && (lp - 1)->type == NL) lp--;
+        const size_t n = lp - trp->bp;
+        if (n > nsinktokens) {
+            nsinktokens = 2 * n;
+            sinktokens  = reinterpret_cast<prep_token*>(_checked_realloc(sinktokens, nsinktokens * sizeof(prep_token)));
+        }
+        for (tp = trp->bp; tp < lp; tp++)
+            sinktokens[tp - trp->bp] = { static_cast<prep_tokentype>(tp->type), tp->wslen, tp->len, reinterpret_cast<const char*>(tp->t) };
+        if (n) tokensink(tokensinkcontext, sinktokens, n, cursource->filename, cursource->line);
+        trp->tp = trp->lp;
+        timer.end();
+        return;
+    }
     tp = trp->bp;
     for (; tp < trp->lp; tp++) {
         len = tp->len + tp->wslen;
@@ -261,8 +463,8 @@ void puttokens(token_row* trp) {
         }
         if (Mflag == 0) {
             if (len > OUTPUT_BUFFER_SIZE / 2) { /* handle giant token */
-                if (_ptrwritebuffer > writebuffer) write(1, writebuffer, _ptrwritebuffer - writebuffer);
-                write(1, p, len);
+                if (_ptrwritebuffer > writebuffer) writeout(writebuffer, _ptrwritebuffer - writebuffer);
+                writeout(reinterpret_cast<const char*>(p), len);
                 _ptrwritebuffer = writebuffer;
             } else {
                 memcpy(_ptrwritebuffer, p, len);
@@ -270,7 +472,7 @@ void puttokens(token_row* trp) {
             }
         }
         if (_ptrwritebuffer >= &writebuffer[OUTPUT_BUFFER_SIZE]) {
-            write(1, writebuffer, OUTPUT_BUFFER_SIZE);
+            writeout(writebuffer, OUTPUT_BUFFER_SIZE);
             if (_ptrwritebuffer > &writebuffer[OUTPUT_BUFFER_SIZE])
                 memcpy(writebuffer, writebuffer + OUTPUT_BUFFER_SIZE, _ptrwritebuffer - &writebuffer[OUTPUT_BUFFER_SIZE]);
             _ptrwritebuffer -= OUTPUT_BUFFER_SIZE;
@@ -278,13 +480,19 @@ void puttokens(token_row* trp) {
     }
     trp->tp = tp;
     if (cursource->fd == 0) flushout();
+    timer.end();
 }
 
 void flushout(void) {
+    phase_timer timer;
+
+    timer.begin(PREP_PHASE_OUTPUT);
     if (_ptrwritebuffer > writebuffer) {
-        write(1, writebuffer, _ptrwritebuffer - writebuffer);
+        writeout(writebuffer, _ptrwritebuffer - writebuffer);
         _ptrwritebuffer = writebuffer;
     }
+    drainoutput();
+    timer.end();
 }
 
 // turn a row into just a newline
@@ -307,8 +515,42 @@ char* outnum(char* p, int n) {
  * allocate and initialize a new string from string, of length length, at offset offset
  * Null terminated.
  */
-char* newstring(_In_ const char* const string, _In_ const size_t length, _In_ const size_t offset) noexcept {
-    char* str            = reinterpret_cast<char*>(::_checked_malloc(length + offset + 1));
+unsigned char* newstring(_In_ const unsigned char* const string, _In_ const size_t length, _In_ const size_t offset) noexcept {
+    unsigned char* str   = _checked_malloc<unsigned char>(length + offset + 1);
     str[length + offset] = '\0';
-    return ::strncpy((char*) str + offset, (char*) string, length) - offset;
+    return reinterpret_cast<unsigned char*>(::strncpy(reinterpret_cast<char*>(str) + offset, reinterpret_cast<const char*>(string), length)) - offset;
+}
+
+/*
+ * n bytes of storage for spellings made up while a line is expanded, e.g. by # and the builtin macros.
+ * They stay put until the next line is read, when resetlinespace() hands them out again; nothing is freed.
+ */
+unsigned char* linespace(_In_ const size_t n) noexcept {
+    line_chunk* c = linechunk;
+
+    while (c && c->used + n > c->size) c = c->next;
+    if (!c) {
+        const size_t size = n > LINE_CHUNK_SIZE ? n : LINE_CHUNK_SIZE;
+        c                 = reinterpret_cast<line_chunk*>(_checked_malloc<unsigned char>(sizeof(line_chunk) + size));
+        c->size           = size;
+        c->used           = 0;
+        if (linechunk) {
+            c->next         = linechunk->next;
+            linechunk->next = c;
+        } else {
+            c->next    = linechunks;
+            linechunks = c;
+        }
+    }
+    linechunk  = c;
+    c->used   += n;
+    return reinterpret_cast<unsigned char*>(c + 1) + c->used - n;
+}
+
+void resetlinespace(void) noexcept {
+    for (line_chunk* c = linechunks; c; c = c->next) {
+        c->used = 0;
+        if (c == linechunk) break;
+    }
+    linechunk = linechunks;
 }
@@ -0,0 +1,225 @@
+#include <prep.hpp>
+
+/*
+ * -uring, resolves and reads #included files through io_uring.
+ * doinclude() hands over every path a name may be found under, in search order. one submission opens and statx()es a
+ * window of them at once, a second reads the first one that opened, whole, and closes every descriptor the first one
+ * got, so an #include costs two trips into the kernel however many directories it misses in, where opening, reading in
+ * INPUT_BUFFER_SIZE / 8 blocks and closing costs one each. where io_uring cannot be set up, an older kernel or a
+ * sandbox that forbids it, loadinclude() says so and doinclude() opens the files itself as before; it does the same
+ * for a file over WHOLE_FILE_MAX, which is streamed rather than read whole.
+ */
+
+int uringflag {};
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+    #include <cerrno>
+
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+
+    #ifndef __NR_io_uring_setup
+        #define __NR_io_uring_setup 425
+    #endif
+    #ifndef __NR_io_uring_enter
+        #define __NR_io_uring_enter 426
+    #endif
+
+static constexpr unsigned RING_ENTRIES { 64 };
+static constexpr int      PROBE_WINDOW { 16 }; // candidate paths opened at once, an openat and a statx each
+
+// the mappings of one io_uring instance, see io_uring_setup(2)
+struct uring final {
+        int           fd;
+        unsigned*     sqtail;
+        unsigned*     sqmask;
+        unsigned*     sqarray;
+        io_uring_sqe* sqes;
+        unsigned*     cqhead;
+        unsigned*     cqtail;
+        unsigned*     cqmask;
+        io_uring_cqe* cqes;
+        void*         sqmap;
+        size_t        sqmapsize;
+        void*         cqmap;
+        size_t        cqmapsize;
+        size_t        sqessize;
+        unsigned      queued; // entries filled in since the last submission
+};
+
+static uring ring {};
+static int   ringstate {}; // 0 not tried yet, 1 up, -1 unavailable for good
+
+static void unmapring(void) noexcept {
+    if (ring.sqes && ring.sqes != MAP_FAILED) ::munmap(ring.sqes, ring.sqessize);
+    if (ring.cqmap && ring.cqmap != MAP_FAILED && ring.cqmap != ring.sqmap) ::munmap(ring.cqmap, ring.cqmapsize);
+    if (ring.sqmap && ring.sqmap != MAP_FAILED) ::munmap(ring.sqmap, ring.sqmapsize);
+    if (ring.fd >= 0) close(ring.fd);
+    ::memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+// sets the ring up on first use, false when io_uring is not there to be had
+static bool setupring(void) noexcept {
+    io_uring_params p {};
+
+    if (ringstate) return ringstate > 0;
+    ringstate = -1;
+    ring.fd   = static_cast<int>(::syscall(__NR_io_uring_setup, RING_ENTRIES, &p));
+    if (ring.fd < 0) return false;
+    ring.sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    ring.sqessize  = p.sq_entries * sizeof(io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) ring.sqmapsize = ring.cqmapsize = ring.sqmapsize > ring.cqmapsize ? ring.sqmapsize : ring.cqmapsize;
+    ring.sqmap = ::mmap(nullptr, ring.sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cqmap = p.features & IORING_FEAT_SINGLE_MMAP
+                     ? ring.sqmap
+                     : ::mmap(nullptr, ring.cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes  = reinterpret_cast<io_uring_sqe*>(
+        ::mmap(nullptr, ring.sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES));
+    if (ring.sqmap == MAP_FAILED || ring.cqmap == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        unmapring();
+        return false;
+    }
+    unsigned char* const sq = reinterpret_cast<unsigned char*>(ring.sqmap);
+    unsigned char* const cq = reinterpret_cast<unsigned char*>(ring.cqmap);
+    ring.sqtail             = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    ring.sqmask             = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    ring.sqarray            = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    ring.cqhead             = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    ring.cqtail             = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    ring.cqmask             = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    ring.cqes               = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    ringstate               = 1;
+    return true;
+}
+
+// drops the ring, a forked worker must not share its parent's; the next loadinclude() sets up one of its own
+void closeuring(void) noexcept {
+    if (ringstate > 0) unmapring();
+    ringstate = 0;
+}
+
+// the next free submission entry, cleared, with key as its user_data
+static io_uring_sqe* queue(_In_ const unsigned char op, _In_ const unsigned key) noexcept {
+    const unsigned      index = (*ring.sqtail + ring.queued++) & *ring.sqmask;
+    io_uring_sqe* const sqe   = &ring.sqes[index];
+
+    ::memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode         = op;
+    sqe->user_data      = key;
+    ring.sqarray[index] = index;
+    return sqe;
+}
+
+// submits what was queued and waits for all of it, results[key] gets the result of every entry
+static bool submit(_Out_ int* const results) noexcept {
+    const unsigned n = ring.queued;
+    unsigned       done {}, tosubmit = n;
+
+    __atomic_store_n(ring.sqtail, *ring.sqtail + n, __ATOMIC_RELEASE);
+    ring.queued = 0;
+    while (done < n) {
+        const long r = ::syscall(__NR_io_uring_enter, ring.fd, tosubmit, n - done, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ringstate = -1; /* what is in flight is anybody's guess, keep off the ring from here on */
+            return false;
+        }
+        if (r > 0) tosubmit -= static_cast<unsigned>(r) < tosubmit ? static_cast<unsigned>(r) : tosubmit;
+        unsigned       head = *ring.cqhead;
+        const unsigned tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, done++) {
+            const io_uring_cqe* const cqe = &ring.cqes[head & *ring.cqmask];
+            if (cqe->user_data < RING_ENTRIES) results[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+/*
+ * loads the first of paths that opens into a sourcebuffer() and returns its index, -1 when none does, IO_UNAVAILABLE
+ * when the caller has to open them itself. a file that grows while it is read is cut at the size statx saw.
+ */
+int loadinclude(_In_reads_(npaths) const char* const* const paths, _In_ const int npaths, _Out_ unsigned char** const data, _Out_ size_t* const len) noexcept {
+    static struct statx st[PROBE_WINDOW]; /* the kernel writes to it until the submission completes */
+    int                 results[RING_ENTRIES];
+
+    *data = nullptr;
+    *len  = 0;
+    if (!setupring()) return IO_UNAVAILABLE;
+    for (int first = 0; first < npaths; first += PROBE_WINDOW) {
+        const int n = npaths - first < PROBE_WINDOW ? npaths - first : PROBE_WINDOW;
+        int       hit { -1 };
+
+        for (int i = 0; i < n; i++) {
+            io_uring_sqe* const opening = queue(IORING_OP_OPENAT, 2 * i);
+            opening->fd                 = AT_FDCWD;
+            opening->addr               = reinterpret_cast<unsigned long long>(paths[first + i]);
+            opening->open_flags         = O_RDONLY;
+            io_uring_sqe* const sizing  = queue(IORING_OP_STATX, 2 * i + 1);
+            sizing->fd                  = AT_FDCWD;
+            sizing->addr                = reinterpret_cast<unsigned long long>(paths[first + i]);
+            sizing->len                 = STATX_SIZE;
+            sizing->off                 = reinterpret_cast<unsigned long long>(&st[i]);
+        }
+        if (!submit(results)) return IO_UNAVAILABLE;
+        for (int i = 0; i < n; i++)
+            if (results[2 * i] == -EINVAL || results[2 * i + 1] == -EINVAL) { /* a kernel without these operations */
+                for (int j = 0; j < n; j++)
+                    if (results[2 * j] >= 0) close(results[2 * j]);
+                closeuring();
+                ringstate = -1;
+                return IO_UNAVAILABLE;
+            }
+        for (int i = 0; hit < 0 && i < n; i++)
+            if (results[2 * i] >= 0) hit = i;
+        if (hit < 0) continue;
+
+        const int fd   = results[2 * hit];
+        long long size = results[2 * hit + 1] == 0 ? static_cast<long long>(st[hit].stx_size) : -1;
+        if (size < 0) { /* it opened but statx failed, ask the descriptor */
+            struct stat fst {};
+            size = ::fstat(fd, &fst) == 0 ? fst.st_size : 0;
+        }
+        if (size > static_cast<long long>(WHOLE_FILE_MAX)) { /* to be streamed, doinclude() opens it again */
+            for (int i = hit; i < n; i++)
+                if (results[2 * i] >= 0) queue(IORING_OP_CLOSE, 1 + i)->fd = results[2 * i];
+            submit(results);
+            return IO_UNAVAILABLE;
+        }
+        *data = sourcebuffer(static_cast<size_t>(size));
+        if (size) {
+            io_uring_sqe* const reading = queue(IORING_OP_READ, 0);
+            reading->fd                 = fd;
+            reading->addr               = reinterpret_cast<unsigned long long>(*data);
+            reading->len                = static_cast<unsigned>(size);
+            reading->flags              = IOSQE_IO_HARDLINK; /* the close below waits for the read, whatever it returns */
+        }
+        for (int i = hit; i < n; i++)
+            if (results[2 * i] >= 0) queue(IORING_OP_CLOSE, 1 + i)->fd = results[2 * i];
+        results[0] = 0; /* for a file with nothing to read */
+        if (!submit(results)) { /* the read may still land in the buffer, so it is left be and done over synchronously */
+            *data = nullptr;
+            return IO_UNAVAILABLE;
+        }
+        *len = results[0] > 0 ? static_cast<size_t>(results[0]) : 0;
+        return first + hit;
+    }
+    return -1;
+}
+
+#else
+
+// no io_uring here, doinclude() opens and reads the files itself
+int loadinclude(_In_reads_(npaths) const char* const* const, _In_ const int, _Out_ unsigned char** const data, _Out_ size_t* const len) noexcept {
+    *data = nullptr;
+    *len  = 0;
+    return IO_UNAVAILABLE;
+}
+
+void closeuring(void) noexcept { }
+
+#endif
@@ -0,0 +1,317 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+#include <libprep.hpp>
+
+#ifndef _WIN32
+    #include <sys/resource.h>
+#endif
+
+// the library entry point, preprocess() and what it hands back
+
+// a preprocess() run, its result released when it goes out of scope
+struct run final {
+        prep_result result;
+        int         nerrors;
+
+        run(const char* const text, const prep_options* const options = nullptr) noexcept {
+            nerrors = preprocess(text, ::strlen(text), options, &result);
+        }
+
+        ~run() noexcept { prep_freeresult(&result); }
+
+        run(const run&)            = delete;
+        run& operator=(const run&) = delete;
+
+        std::string output(void) const { return std::string(result.output, result.outlen); }
+        std::string diagnostics(void) const { return std::string(result.diagnostics, result.diaglen); }
+};
+
+static prep_options plain(void) noexcept {
+    prep_options options {};
+    options.filename   = "test.c";
+    options.nolineinfo = true;
+    return options;
+}
+
+static constexpr char MACROS[] { "#define CAT(a, b) a##b\n"
+                                 "#define STR(x) #x\n"
+                                 "#define F(x, ...) g(x, __VA_ARGS__)\n"
+                                 "#if defined(CAT) && CAT(1, 0) == 10\n"
+                                 "CAT(x, y) STR(a + b) F(1, 2, 3)\n"
+                                 "#else\n"
+                                 "wrong\n"
+                                 "#endif\n" };
+
+TEST(preprocess, expandsmacros) {
+    const prep_options options = plain();
+    const run          r { MACROS, &options };
+
+    EXPECT_EQ(r.nerrors, 0);
+    EXPECT_EQ(r.result.nerrors, 0);
+    EXPECT_NE(r.output().find("xy \"a + b\" g(1,2, 3)"), std::string::npos) << r.output();
+    EXPECT_EQ(r.output().find("wrong"), std::string::npos);
+    EXPECT_EQ(r.diagnostics(), "");
+}
+
+// # of an argument of some kilobytes, with strings and character constants whose quotes and backslashes it escapes
+TEST(preprocess, stringifieslongarguments) {
+    const prep_options options = plain();
+    std::string        text = "#define STR(x) #x\nSTR(", expected = "\n \""; /* the line of the #define, then the expansion */
+
+    for (int i = 0; i < 100; i++) {
+        const std::string n = std::to_string(i);
+        text     += (i ? " \t " : "") + ("n" + n + " + \"s\\\"" + n + "\" '\\\\'");
+        expected += (i ? " " : "") + ("n" + n + " + \\\"s\\\\\\\"" + n + "\\\" '\\\\\\\\'");
+    }
+    expected += "\"\n";
+    const run r { (text + ")\n").c_str(), &options };
+
+    ASSERT_GT(expected.size(), 1024U);
+    EXPECT_EQ(r.nerrors, 0) << r.diagnostics();
+    EXPECT_EQ(r.output(), expected);
+}
+
+static constexpr char CONFIG_H[] { "#define LIMIT 42\n#include \"gen/inner.h\"\n" };
+static constexpr char INNER_H[] { "int inner = LIMIT;\n" };
+static constexpr char SELF_H[] { "#define DEEP 1\n#include \"self.h\"\n" };
+
+TEST(preprocess, includesfilesinmemory) {
+    const prep_file files[] = {
+        { "gen/config.h", CONFIG_H, sizeof(CONFIG_H) - 1 },
+        {  "gen/inner.h",  INNER_H,  sizeof(INNER_H) - 1 },
+    };
+    prep_options options = plain();
+    options.files        = files;
+    options.nfiles       = 2;
+    const run r { "#include \"gen/config.h\"\nint outer = LIMIT;\n", &options };
+
+    EXPECT_EQ(r.nerrors, 0);
+    EXPECT_NE(r.output().find("int inner = 42;"), std::string::npos) << r.output();
+    EXPECT_NE(r.output().find("int outer = 42;"), std::string::npos) << r.output();
+    ASSERT_EQ(r.result.ndependencies, 2U);
+    EXPECT_STREQ(r.result.dependencies[0], "gen/config.h");
+    EXPECT_STREQ(r.result.dependencies[1], "gen/inner.h");
+}
+
+TEST(preprocess, reportsdiagnostics) {
+    const prep_options options = plain();
+    const run          r { "#warning careful\n#include \"nowhere.h\"\n#error stop\nint x;\n", &options };
+
+    EXPECT_EQ(r.nerrors, 2);
+    EXPECT_EQ(r.result.nerrors, 2);
+    EXPECT_NE(r.diagnostics().find("careful"), std::string::npos) << r.diagnostics();
+    EXPECT_NE(r.diagnostics().find("nowhere.h"), std::string::npos) << r.diagnostics();
+    EXPECT_NE(r.diagnostics().find("stop"), std::string::npos) << r.diagnostics();
+    EXPECT_NE(r.diagnostics().find("test.c"), std::string::npos) << r.diagnostics();
+    EXPECT_NE(r.output().find("int x;"), std::string::npos);
+    EXPECT_EQ(r.result.ndependencies, 0U);
+}
+
+TEST(preprocess, recoversfromfatalerrors) {
+    const prep_file files[] = {
+        { "self.h", SELF_H, sizeof(SELF_H) - 1 },
+    };
+    prep_options options = plain();
+    options.files        = files;
+    options.nfiles       = 1;
+    options.timephases   = true;
+    const run before { MACROS, &options };
+    {
+        const run fatal { "#if 1\n#define CAT(a, b) broken\n#include \"self.h\"\n", &options };
+        EXPECT_GT(fatal.nerrors, 0);
+        EXPECT_NE(fatal.diagnostics().find("too deeply nested"), std::string::npos) << fatal.diagnostics();
+    }
+    {
+        const run fatal { "#define S(x) #x\nS(\"unterminated", &options };
+        EXPECT_GT(fatal.nerrors, 0);
+    }
+    const run after { MACROS, &options };
+
+    EXPECT_EQ(after.nerrors, 0);
+    EXPECT_EQ(after.output(), before.output());
+    EXPECT_EQ(after.diagnostics(), "");
+    EXPECT_EQ(after.result.ndependencies, 0U);
+    for (size_t i = 0; i < PREP_NPHASES; i++) EXPECT_LE(after.result.stats.phase[i], after.result.stats.total);
+}
+
+TEST(preprocess, repeatsitself) {
+    const char* const defines[] = { "EXTRA=CAT(p, q)" };
+    prep_options      options   = plain();
+    const run         first { MACROS, &options };
+    {
+        options.defines  = defines;
+        options.ndefines = 1;
+        const run defined { "#include \"missing.h\"\n#define LOCAL 1\nEXTRA LOCAL\n", &options };
+        EXPECT_NE(defined.output().find("CAT(p, q)"), std::string::npos) << defined.output(); // CAT is not defined in this run
+        options.defines  = nullptr;
+        options.ndefines = 0;
+    }
+    const run second { MACROS, &options };
+    const run third { MACROS, &options };
+    const run leftover { "EXTRA LOCAL\n", &options };
+
+    EXPECT_EQ(second.output(), first.output());
+    EXPECT_EQ(third.output(), first.output());
+    EXPECT_EQ(second.diagnostics(), first.diagnostics());
+    EXPECT_EQ(second.result.stats.tokens, first.result.stats.tokens);
+    EXPECT_EQ(second.result.stats.expansions, first.result.stats.expansions);
+    EXPECT_NE(leftover.output().find("EXTRA LOCAL"), std::string::npos) << leftover.output();
+}
+
+// backslash-newlines, with or without a CR, and ??/ before a newline splice the lines wherever they fall in a token
+TEST(preprocess, splicesandtrigraphs) {
+    const prep_options options = plain();
+    const run          r { "int ab\\\ncd = 1\\\r\n2\\\n3;\nchar* s = \"x\\\ny\";\n#define L 1 ?\?/\n+ 2\nL ?\?= ?\?( ?\?) ?\?<\\\n?\?>\n", &options };
+
+    EXPECT_EQ(r.nerrors, 0) << r.diagnostics();
+    EXPECT_EQ(r.output(), "int abcd = 123;\nchar* s = \"xy\";\n\n 1 + 2 # [ ] {}\n");
+}
+
+// the filter lookup() goes through is rebuilt larger as names come in: a name defined before a rebuild, after the last
+// one, or only after its text went by as no macro, expands, and one #undefined and #defined again takes its new value
+TEST(preprocess, filtersnames) {
+    const prep_options options = plain();
+    std::string        text = "late M0 M4999\n#define early 1\n";
+    char               line[64];
+
+    for (int i = 0; i < 5000; i++) {
+        ::snprintf(line, sizeof(line), "#define M%d %d\n", i, i);
+        text += line;
+    }
+    text += "#define late 2\nearly late M0 M4999\n#undef M0\nM0\n#define M0 again\nM0 M4999\n#undef late\nlate\n";
+    const run r { text.c_str(), &options };
+
+    EXPECT_EQ(r.nerrors, 0) << r.diagnostics();
+    EXPECT_EQ(r.output(), "late M0 M4999\n" + std::string(5002, '\n') + " 1 2 0 4999\n\nM0\n\n again 4999\n\nlate\n");
+}
+
+// the head of a body that cannot expand is not rescanned, until a name in it becomes a macro: f, only a call once the
+// argument after the expansion is read, and long in a body of nothing but names
+static constexpr char INERT[] { "#define PRE f\n"
+                                "#define ARG(x) f x\n"
+                                "#define BOTH(x) g PRE(x)\n"
+                                "#define KEYS int long\n"
+                                "PRE(1) ARG((2)) BOTH(3) KEYS\n"
+                                "#define f(x) [x]\n"
+                                "#define long wide\n"
+                                "PRE(1) ARG((2)) BOTH(3) KEYS\n"
+                                "#undef f\n"
+                                "#define f(x) <x>\n"
+                                "#define g(y) {y}\n"
+                                "PRE(1) ARG((2)) BOTH(3) KEYS\n"
+                                "#undef f\n"
+                                "PRE(1) ARG((2)) BOTH(3) KEYS\n" };
+
+TEST(preprocess, rescansinertheads) {
+    const prep_options options = plain();
+    const run          r { INERT, &options };
+
+    EXPECT_EQ(r.nerrors, 0) << r.diagnostics();
+    EXPECT_EQ(r.output(), "\n\n\n\n f(1)f(2)g f(3)int long\n\n\n[1][2]g[3]int wide\n\n\n\n < 1 > < 2 > g < 3 > int wide\n\n f(1)f(2)g f(3)int wide\n");
+}
+
+TEST(preprocess, countsexpansions) {
+    const prep_options options = plain();
+    std::string        text    = "#define A 1\n#if defined(A)\nA defined(B) defined B\n#endif\n";
+    char               line[64];
+
+    for (int i = 0; i < 5000; i++) {
+        ::snprintf(line, sizeof(line), "int v%d;\n", i);
+        text += line;
+    }
+    const run r { text.c_str(), &options };
+
+    EXPECT_EQ(r.nerrors, 0);
+    EXPECT_EQ(r.result.stats.expansions, 1U); // defined outside #if stands for itself, it expands nothing
+    ASSERT_GT(r.result.stats.chainwalks, 5000U);
+    EXPECT_LT(static_cast<double>(r.result.stats.chainsteps) / r.result.stats.chainwalks, 2.0);
+}
+
+// writes the tokens back out the way they were spaced, a NAME in brackets
+static void spelllines(void* const context, const prep_token* const tokens, const size_t ntokens, const char* const, const int) {
+    std::string& text = *static_cast<std::string*>(context);
+
+    for (size_t i = 0; i < ntokens; i++) {
+        text.append(tokens[i].spelling - tokens[i].wslen, tokens[i].wslen);
+        text += tokens[i].type == PREP_NAME ? "[" + std::string(tokens[i].spelling, tokens[i].len) + "]" : std::string(tokens[i].spelling, tokens[i].len);
+    }
+    text += '\n';
+}
+
+TEST(preprocess, handstokenstoasink) {
+    prep_options options = plain();
+    std::string  text;
+    options.tokensink   = spelllines;
+    options.sinkcontext = &text;
+    const run r { "#define TWO a  b\nTWO TWO;\n", &options };
+
+    EXPECT_EQ(r.nerrors, 0);
+    EXPECT_EQ(text, " [a] [b] [a] [b];\n"); // a definition keeps one blank between its tokens
+    EXPECT_EQ(r.result.outlen, 0U);
+}
+
+#ifndef _WIN32
+// a SOURCE_DATE_EPOCH that is no number fails the run it is read in, not the program that called preprocess()
+TEST(preprocess, reportsbadsourcedate) {
+    const prep_options options = plain();
+    ::setenv("SOURCE_DATE_EPOCH", "yesterday", 1);
+    const run bad { "__DATE__\n", &options };
+    ::unsetenv("SOURCE_DATE_EPOCH");
+    const run good { "__DATE__\n", &options };
+
+    EXPECT_GT(bad.nerrors, 0);
+    EXPECT_NE(bad.diagnostics().find("SOURCE_DATE_EPOCH is not a number of seconds: yesterday"), std::string::npos) << bad.diagnostics();
+    EXPECT_EQ(good.nerrors, 0) << good.diagnostics();
+    EXPECT_EQ(good.diagnostics(), "");
+}
+
+static long peakkb(void) noexcept {
+    struct rusage usage {};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// names that never become macros must not pile up in the symbol table from one call to the next
+TEST(preprocess, forgetsidentifiers) {
+    const prep_options options = plain();
+    long               settled {};
+    char               line[64];
+
+    for (int call = 0; call < 10; call++) {
+        std::string text;
+        for (int i = 0; i < 100000; i++) {
+            ::snprintf(line, sizeof(line), "int v%d_%d;\n", call, i);
+            text += line;
+        }
+        const run r { text.c_str(), &options };
+        EXPECT_EQ(r.nerrors, 0);
+        if (call == 1) settled = peakkb();
+    }
+    EXPECT_LT(peakkb(), settled + 8192) << "eight calls of distinct identifiers took " << peakkb() - settled << " KB more";
+}
+
+// nor may the definitions of one call outlive it
+TEST(preprocess, forgetsdefinitions) {
+    const prep_options options = plain();
+    long               settled {};
+    char               line[256];
+
+    for (int call = 0; call < 10; call++) {
+        std::string text;
+        for (int i = 0; i < 5000; i++) {
+            ::snprintf(line, sizeof(line), "#define M%d(a, b) a + b * %d - (a) / (b) + %d * a * b - %d\n", i, call, i, call);
+            text += line;
+            ::snprintf(line, sizeof(line), "#undef M%d\n#define M%d(a, b) M%d(b, a)\nM%d(1, 2)\n", i, i, i + 1, i);
+            text += line;
+        }
+        const run r { text.c_str(), &options };
+        EXPECT_EQ(r.nerrors, 0);
+        if (call == 1) settled = peakkb();
+    }
+    EXPECT_LT(peakkb(), settled + 4096) << "eight calls of new definitions took " << peakkb() - settled << " KB more";
+}
+#endif
@@ -0,0 +1,637 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// the prep executable, run the way a build or an editor runs it; only where it can be forked and watched
+
+#ifndef _WIN32
+    #include <climits>
+    #include <cstdio>
+    #include <cstdlib>
+    #include <cstring>
+    #include <ftw.h>
+    #include <poll.h>
+    #include <sys/resource.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+    #include <utime.h>
+
+// what a run of prep left behind
+struct outcome final {
+        int         status; // its exit status, -1 when it did not exit
+        std::string out;
+        std::string err;
+        long        peakkb; // its peak resident set size
+};
+
+// runs prep with args, input on its standard input and env added to its environment
+static outcome runprep(const std::vector<std::string>& args, const std::string& input = "", const std::vector<std::string>& env = {}) {
+    outcome            o { -1, "", "", 0 };
+    int                in[2], out[2], err[2];
+    std::vector<char*> argv;
+    struct rusage      usage {};
+    int                status {};
+    size_t             written {};
+
+    argv.push_back(const_cast<char*>(PREP_EXECUTABLE));
+    for (const std::string& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+    if (::pipe(in) || ::pipe(out) || ::pipe(err)) return o;
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+        ::dup2(in[0], 0);
+        ::dup2(out[1], 1);
+        ::dup2(err[1], 2);
+        for (const int fd : { in[0], in[1], out[0], out[1], err[0], err[1] }) ::close(fd);
+        for (const std::string& e : env) ::putenv(const_cast<char*>(e.c_str()));
+        ::execv(argv[0], argv.data());
+        ::_exit(127);
+    }
+    ::close(in[0]);
+    ::close(out[1]);
+    ::close(err[1]);
+    if (input.empty()) ::close(in[1]);
+    struct pollfd fds[3] = {
+        { out[0],  POLLIN, 0 },
+        { err[0],  POLLIN, 0 },
+        { input.empty() ? -1 : in[1], POLLOUT, 0 }
+    };
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        char buffer[65536];
+        if (::poll(fds, 3, -1) < 0) break;
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+            const ssize_t n = ::read(fds[i].fd, buffer, sizeof(buffer));
+            if (n > 0)
+                (i ? o.err : o.out).append(buffer, static_cast<size_t>(n));
+            else {
+                ::close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+        if (fds[2].fd >= 0 && fds[2].revents) {
+            const size_t  chunk = std::min(input.size() - written, static_cast<size_t>(PIPE_BUF)); /* all that is sure to fit */
+            const ssize_t n     = fds[2].revents & POLLOUT ? ::write(in[1], input.data() + written, chunk) : -1;
+            if (n > 0) written += static_cast<size_t>(n);
+            if (n <= 0 || written == input.size()) {
+                ::close(in[1]);
+                fds[2].fd = -1;
+            }
+        }
+    }
+    if (fds[2].fd >= 0) ::close(in[1]);
+    if (::wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status)) o.status = WEXITSTATUS(status);
+    o.peakkb = usage.ru_maxrss;
+    return o;
+}
+
+// sets the times of the file at path an hour back, so -cache takes it for one that was not written while it ran
+static void age(const std::string& path) {
+    const time_t  past = ::time(nullptr) - 3600;
+    struct utimbuf times { past, past };
+    ::utime(path.c_str(), &times);
+}
+
+static int removeentry(const char* const path, const struct stat*, int, struct FTW*) { return ::remove(path); }
+
+// a directory of its own for the files of a test, removed with everything in it
+struct scratch final {
+        std::string dir;
+
+        scratch() {
+            const char* const tmp = ::getenv("TMPDIR");
+            std::string       name = std::string(tmp && *tmp ? tmp : "/tmp") + "/preptestXXXXXX";
+            if (::mkdtemp(&name[0])) dir = name;
+        }
+
+        ~scratch() {
+            if (!dir.empty()) ::nftw(dir.c_str(), removeentry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+
+        scratch(const scratch&)            = delete;
+        scratch& operator=(const scratch&) = delete;
+
+        // writes text to name in the directory and returns its path
+        std::string write(const std::string& name, const std::string& text) const {
+            const std::string path = dir + "/" + name;
+            FILE* const       file = ::fopen(path.c_str(), "wb");
+            if (file) {
+                ::fwrite(text.data(), 1, text.size(), file);
+                ::fclose(file);
+            }
+            return path;
+        }
+};
+
+// options put in front of args
+static std::vector<std::string> with(const std::vector<std::string>& options, const std::vector<std::string>& args) {
+    std::vector<std::string> all = options;
+
+    all.insert(all.end(), args.begin(), args.end());
+    return all;
+}
+
+// o exited, wrote and diagnosed what the plain run of the same input did, byte for byte
+static void expectplain(const outcome& o, const outcome& plain, const std::string& what) {
+    EXPECT_EQ(o.status, plain.status) << what << ": " << o.err;
+    EXPECT_EQ(o.out, plain.out) << what;
+    EXPECT_EQ(o.err, plain.err) << what;
+}
+
+// the contents of the file at path, empty when there is none
+static std::string contents(const std::string& path) {
+    std::string text;
+    char        buffer[4096];
+    FILE* const file = ::fopen(path.c_str(), "rb");
+
+    if (!file) return text;
+    for (size_t n; (n = ::fread(buffer, 1, sizeof(buffer), file)) > 0;) text.append(buffer, n);
+    ::fclose(file);
+    return text;
+}
+
+// n lines declaring an identifier each, all of them different or all the same one, the same number of bytes either way
+static std::string declarations(const size_t n, const bool distinct) {
+    std::string text;
+    char        line[64];
+
+    for (size_t i = 0; i < n; i++) {
+        ::snprintf(line, sizeof(line), "int a%08zu = %zu;\n", distinct ? i : 0, i);
+        text += line;
+    }
+    return text;
+}
+
+// a -daemon request for name, with text as its contents
+static std::string request(const std::string& name, const std::string& text) { return "run " + std::to_string(text.size()) + " " + name + "\n" + text; }
+
+// one answer of -daemon, as the plain run it stands for would have ended
+struct answer final {
+        outcome run; // the exit status a plain run with as many errors has, the output and the diagnostics
+        int     resumed;
+};
+
+// every answer in what -daemon wrote
+static std::vector<answer> answers(const std::string& out) {
+    std::vector<answer> all;
+    size_t              at {}, outlen {}, diaglen {};
+    int                 errors {}, resumed {};
+
+    while (at < out.size() && ::sscanf(out.c_str() + at, "ok errors=%d output=%zu diagnostics=%zu resumed=%d", &errors, &outlen, &diaglen, &resumed) == 4) {
+        const size_t eol = out.find('\n', at);
+        if (eol == std::string::npos) break;
+        all.push_back({ { errors ? 1 : 0, out.substr(eol + 1, outlen), out.substr(eol + 1 + outlen, diaglen), 0 }, resumed });
+        at = eol + 1 + outlen + diaglen;
+    }
+    return all;
+}
+
+// 2000 function-like macros and their uses after an #include, what the daemon does again on every request
+static std::string defining(const char* const extra) {
+    std::string text = "#include \"defs.h\"\n";
+    char        line[128];
+
+    for (int i = 0; i < 2000; i++) {
+        ::snprintf(line, sizeof(line), "#define F%d(a, b) a * b + %d%s\nint v%d = F%d(1, H(2));\n", i, i, extra, i, i);
+        text += line;
+    }
+    return text;
+}
+
+static constexpr char DEFS_H[] { "#define H(x) x + 1\nint h = H(2);\n" };
+
+// an edit after the #include resumes from the checkpoint there, one before it starts from the top; either way the
+// answer is what a plain run of the edited file puts out
+TEST(daemon, resumesafteredit) {
+    const scratch                  dir;
+    const std::string              name = dir.write("main.c", "");
+    const std::vector<std::string> texts { defining(""), defining("") + "int added = F7(1, 2);\n#warning added\n", defining(" - 1"), "int nothing;\n" + defining("") };
+    const int                      resumed[] { 0, 2, 2, 0 };
+    std::string                    requests;
+    std::vector<outcome>           plain;
+
+    dir.write("defs.h", DEFS_H);
+    for (const std::string& text : texts) {
+        dir.write("main.c", text);
+        plain.push_back(runprep({ "-P", name }));
+        requests += request(name, text);
+    }
+    const outcome daemon = runprep({ "-P", "-daemon" }, requests + "quit\n");
+    ASSERT_EQ(daemon.status, 0) << daemon.err;
+    const std::vector<answer> got = answers(daemon.out);
+    ASSERT_EQ(got.size(), texts.size()) << daemon.out.substr(0, 200);
+    for (size_t i = 0; i < got.size(); i++) {
+        expectplain(got[i].run, plain[i], "request " + std::to_string(i));
+        EXPECT_EQ(got[i].resumed, resumed[i]) << "request " << i;
+    }
+}
+
+// -stats, which says whether the run came out of the cache, reports on the run after the diagnostics
+static bool cached(const outcome& o, const outcome& plain) {
+    EXPECT_EQ(o.status, plain.status) << o.err;
+    EXPECT_EQ(o.out, plain.out);
+    EXPECT_EQ(o.err.find(plain.err), 0U) << o.err;
+    EXPECT_NE(o.err.find("\"cache\": \""), std::string::npos) << o.err;
+    return o.err.find("\"cache\": \"hit\"") != std::string::npos;
+}
+
+// a run the cache hands back puts out what a plain run does, reports included, until a header it read is edited: a new
+// mtime alone keeps the hit, the headers are known by their contents, but new contents miss and are preprocessed again
+TEST(cache, missesafterheaderedit) {
+    const scratch     dir;
+    const std::string name    = dir.write("main.c", "#warning kept\n" + defining(""));
+    const std::string header  = dir.write("defs.h", DEFS_H);
+    const std::string trace   = dir.dir + "/trace.json";
+    const std::string store   = dir.dir + "/cache";
+    const auto        cacheon = [&](const std::vector<std::string>& options) { return runprep(with(with({ "-P", "-cache", store }, options), { name })); };
+
+    age(header);
+    age(name);
+    const outcome plain = runprep({ "-P", name });
+    EXPECT_NE(plain.err.find("kept"), std::string::npos) << plain.err;
+    EXPECT_FALSE(cached(cacheon({ "-stats" }), plain));
+    expectplain(cacheon({}), plain, "the hit");
+    const outcome reports = cacheon({ "-stats", "-macro-profile", "-include-profile", trace });
+    EXPECT_TRUE(cached(reports, plain));
+    EXPECT_NE(reports.err.find("macro profile:"), std::string::npos) << reports.err;
+    EXPECT_NE(contents(trace).find("\"traceEvents\""), std::string::npos) << "no include profile on a hit";
+
+    const struct utimbuf touched { ::time(nullptr) - 7200, ::time(nullptr) - 7200 };
+    ::utime(header.c_str(), &touched);
+    EXPECT_TRUE(cached(cacheon({ "-stats" }), plain)) << "the same contents under another mtime";
+
+    age(dir.write("defs.h", "#define H(x) x + 2\nint h = H(2);\n"));
+    const outcome edited = runprep({ "-P", name });
+    EXPECT_NE(edited.out, plain.out);
+    EXPECT_FALSE(cached(cacheon({ "-stats" }), edited)) << "the edited header";
+    EXPECT_TRUE(cached(cacheon({ "-stats" }), edited)) << "the edited header, kept";
+}
+
+// -j puts out what a plain run does, also where the headers it hands to workers depend on each other
+TEST(speculation, matchesplainrun) {
+    const scratch dir;
+    std::string   many;
+    char          line[128];
+
+    for (int i = 0; i < 500; i++) {
+        ::snprintf(line, sizeof(line), "#define D%d(a) (a) + D%d\nint d%d = D%d(COMMON);\n", i, i > 0 ? i - 1 : 0, i, i);
+        many += line;
+    }
+    dir.write("common.h", "#ifndef COMMON_H\n#define COMMON_H\n#define COMMON 7\n#endif\n");
+    dir.write("a.h", "#include \"common.h\"\n#define A 1\nint a = A + COMMON;\n");
+    dir.write("b.h", "#include \"common.h\"\n#undef A\n#define A 2\nint b = A;\n#if A == 2\n#define LATE 3\n#endif\n");
+    dir.write("c.h", "int c = A + LATE;\n#warning in c\n");
+    dir.write("d.h", many);
+    const std::string name = dir.write("main.c", "#include \"a.h\"\n#include \"b.h\"\n\n#include \"c.h\"\n#include \"d.h\"\n#include \"missing.h\"\n"
+                                                 "#include \"common.h\"\nint m = A + LATE + D499(1);\n");
+    for (const std::vector<std::string>& args : { std::vector<std::string> { "-P", name }, std::vector<std::string> { name } }) {
+        const outcome plain = runprep(args);
+        EXPECT_NE(plain.status, 0) << "missing.h was found";
+        EXPECT_NE(plain.err.find("in c"), std::string::npos) << plain.err;
+        for (const char* const jobs : { "-j1", "-j2", "-j4" }) expectplain(runprep(with({ jobs }, args)), plain, jobs + std::string(args.size() > 1 ? " -P" : ""));
+    }
+}
+
+// a worker forked ahead of the #include before it guesses the definitions that #include makes wrong: its output, its
+// definitions and the #if it took are thrown away and its #include is redone with the right ones
+TEST(speculation, rollsbackmisprediction) {
+    const scratch dir;
+
+    dir.write("a.h", "#define X 1\n#undef GONE\n");
+    dir.write("b.h", "int b = X;\n#if X == 1\n#define Y 2\n#else\n#define Y 3\n#warning guessed\n#endif\n#define Z GONE\n");
+    const std::string name = dir.write("main.c", "#define GONE 4\n#include \"a.h\"\n#include \"b.h\"\nint y = Y, z = Z;\n");
+    const outcome     plain = runprep({ "-P", name });
+    ASSERT_EQ(plain.status, 0) << plain.err;
+    EXPECT_NE(plain.out.find("int b = 1;"), std::string::npos) << plain.out;
+    EXPECT_NE(plain.out.find("int y = 2, z = GONE;"), std::string::npos) << plain.out;
+    for (const char* const jobs : { "-j2", "-j4" }) expectplain(runprep({ jobs, "-P", name }), plain, jobs);
+}
+
+// -defines-file, in text or as -save-defines wrote it, defines what the same -D and -U arguments do, and the -D and -U
+// arguments after it override what it saved as they would the same arguments given before them
+TEST(definesfile, overriddenbyarguments) {
+    const scratch                  dir;
+    const std::vector<std::string> overrides { "-UV5", "-DW6=six", "-UEMPTY" };
+    std::vector<std::string>       args { "-P" };
+    std::string                    text, uses;
+    char                           line[128];
+
+    for (int i = 0; i < 300; i++) {
+        args.push_back("-DV" + std::to_string(i) + "=" + std::to_string(i));
+        args.push_back("-DW" + std::to_string(i) + "=(V" + std::to_string(i) + " * 2 - " + std::to_string(i) + ")");
+        if (i % 3 == 0)
+            ::snprintf(line, sizeof(line), "V%d=%d\n-DW%d=(V%d * 2 - %d)\n", i, i, i, i, i);
+        else
+            ::snprintf(line, sizeof(line), "-DV%d=%d -DW%d=(V%d * 2 - %d)\n", i, i, i, i, i);
+        text += line;
+        ::snprintf(line, sizeof(line), "int v%d = W%d;\n", i, i);
+        uses += line;
+    }
+    for (const char* const rest : { "-UV7", "-DV8=eight words here", "-DEMPTY", "-UNEVER" }) {
+        args.push_back(rest);
+        text += std::string(rest) + "\n";
+    }
+    const std::string name  = dir.write("main.c", uses + "V7 V8 EMPTY NEVER\n#if EMPTY == 1\nempty\n#endif\n");
+    const std::string file  = dir.write("defines.txt", text);
+    const std::string saved = dir.dir + "/defines.bin";
+    const outcome     plain = runprep(with(args, { name }));
+    ASSERT_EQ(plain.status, 0) << plain.err;
+    EXPECT_NE(plain.out.find("int v299 =(299 * 2 - 299);"), std::string::npos) << plain.out.substr(plain.out.size() - 200);
+    EXPECT_NE(plain.out.find("V7 eight words here 1 NEVER"), std::string::npos);
+    expectplain(runprep({ "-P", "-defines-file", file, "-save-defines", saved, name }), plain, "text");
+    expectplain(runprep({ "-P", "-defines-file", saved, name }), plain, "saved");
+
+    const outcome overridden = runprep(with(with(args, overrides), { name }));
+    ASSERT_EQ(overridden.status, 0) << overridden.err;
+    EXPECT_NE(overridden.out.find("int v5 =(V5 * 2 - 5);"), std::string::npos);
+    EXPECT_NE(overridden.out.find("int v6 = six;"), std::string::npos);
+    EXPECT_NE(overridden.out.find("V7 eight words here EMPTY NEVER"), std::string::npos);
+    EXPECT_EQ(overridden.out.find("empty"), std::string::npos);
+    expectplain(runprep(with(with({ "-P", "-defines-file", file }, overrides), { name })), overridden, "text, overridden");
+    expectplain(runprep(with(with({ "-P", "-defines-file", saved }, overrides), { name })), overridden, "saved, overridden");
+}
+
+// every output of -config is what a run with its defines file alone puts out, for configurations that differ in
+// everything and for ones that differ only in the value of one define, which go in step until a line tells them apart
+TEST(configs, differinadefine) {
+    const scratch                                dir;
+    const std::vector<std::vector<std::string>> sets { { "X=1\nHDR=\"a.h\"\n", "X=2\nY=3\nHDR=\"b.h\"\n", "-UCOMMON\nHDR=\"a.h\"\n", "Y=4\nHDR=\"b.h\"\n" },
+                                                       { "X=1\nY=3\nHDR=\"b.h\"\n", "X=2\nY=3\nHDR=\"b.h\"\n" } };
+    std::string                                  text = "int x = COMMON;\n#ifdef Y\n#define G(a, b) a + b\n#endif\nint g = G\n(1,\n2);\n";
+
+    for (int i = 0; i < 200; i++) text += "int shared" + std::to_string(i) + " = COMMON;\n";
+    text += "#if X == 1\nint one;\n#endif\n#ifdef Y\n#include \"defs.h\"\nint y = Y + H(X);\n#endif\n#include HDR\nint last = X + Y + AB;\n";
+    dir.write("defs.h", DEFS_H);
+    dir.write("a.h", "#define AB 1\nint a = X;\n");
+    dir.write("b.h", "#define AB 2\nint b = X;\n#include \"defs.h\"\n");
+    const std::string name = dir.write("main.c", text);
+    for (size_t set = 0; set < sets.size(); set++)
+        for (const bool lineinfo : { false, true }) {
+            const std::vector<std::string> common = lineinfo ? std::vector<std::string> { "-DCOMMON=5" } : std::vector<std::string> { "-P", "-DCOMMON=5" };
+            std::vector<std::string>       args = common;
+            std::vector<outcome>           plain;
+            for (size_t i = 0; i < sets[set].size(); i++) {
+                const std::string file = dir.write("config" + std::to_string(i) + ".txt", sets[set][i]);
+                plain.push_back(runprep(with(common, { "-defines-file", file, name })));
+                ASSERT_EQ(plain.back().status, 0) << plain.back().err;
+                args.push_back("-config");
+                args.push_back(dir.dir + "/out" + std::to_string(i) + "=" + file);
+            }
+            const outcome o = runprep(with(args, { name }));
+            ASSERT_EQ(o.status, 0) << o.err;
+            for (size_t i = 0; i < plain.size(); i++)
+                EXPECT_EQ(contents(dir.dir + "/out" + std::to_string(i)), plain[i].out) << "set " << set << (lineinfo ? " with" : " without") << " line info, configuration " << i;
+        }
+}
+
+// a SOURCE_DATE_EPOCH that is no number fails every request that starts from the top, and the daemon keeps serving
+TEST(daemon, survivesbadsourcedate) {
+    const scratch     dir;
+    const std::string name = dir.write("main.c", "");
+    const outcome     o    = runprep({ "-P", "-daemon" }, request(name, "__DATE__\n") + request(name, "int x;\n") + "quit\n", { "SOURCE_DATE_EPOCH=soon" });
+
+    ASSERT_EQ(o.status, 0) << o.err;
+    EXPECT_EQ(answers(o.out).size(), 2U) << o.out;
+    EXPECT_NE(o.out.find("SOURCE_DATE_EPOCH is not a number of seconds: soon"), std::string::npos) << o.out;
+    EXPECT_EQ(o.out.find("ok errors=0"), std::string::npos) << o.out;
+}
+
+// the definitions a request makes again are freed when the next one goes back to a checkpoint
+TEST(memory, daemonrequests) {
+    const scratch     dir;
+    const std::string text = defining("");
+    const std::string name = dir.write("main.c", text);
+    std::string       few, many;
+
+    dir.write("defs.h", DEFS_H);
+    for (int i = 0; i < 200; i++) {
+        if (i < 20) few += request(name, text);
+        many += request(name, text);
+    }
+    few  += "quit\n";
+    many += "quit\n";
+    const outcome a = runprep({ "-P", "-daemon" }, few); /* both forked from the same test process, which counts in the peak */
+    const outcome b = runprep({ "-P", "-daemon" }, many);
+
+    ASSERT_EQ(a.status, 0) << a.err;
+    ASSERT_EQ(b.status, 0) << b.err;
+    EXPECT_EQ(answers(b.out).size(), 200U);
+    EXPECT_LT(b.peakkb, a.peakkb + 2048) << "180 more requests took " << b.peakkb - a.peakkb << " KB more";
+}
+
+TEST(memory, distinctidentifiers) {
+    const scratch     dir;
+    const std::string distinct = dir.write("distinct.c", declarations(1000000, true));
+    const std::string same     = dir.write("same.c", declarations(1000000, false));
+    const outcome     a        = runprep({ "-P", distinct, "/dev/null" });
+    const outcome     b        = runprep({ "-P", same, "/dev/null" });
+
+    ASSERT_EQ(a.status, 0) << a.err;
+    ASSERT_EQ(b.status, 0) << b.err;
+    EXPECT_LT(a.peakkb, b.peakkb + 4096) << "a million distinct identifiers took " << a.peakkb - b.peakkb << " KB more";
+}
+
+// a file streams through its input window, eight times the input may not take more memory
+TEST(memory, streamsinput) {
+    const scratch     dir;
+    const std::string small = dir.write("small.c", declarations(250000, true));
+    const std::string large = dir.write("large.c", declarations(2000000, true));
+
+    for (const char* const option : { "-P", "-pipeline" }) {
+        const outcome a = runprep({ "-P", option, small, "/dev/null" });
+        const outcome b = runprep({ "-P", option, large, "/dev/null" });
+        ASSERT_EQ(a.status, 0) << a.err;
+        ASSERT_EQ(b.status, 0) << b.err;
+        EXPECT_LT(b.peakkb, a.peakkb + 2048) << option << ": 44 MB of input took " << b.peakkb - a.peakkb << " KB more than 5.5 MB";
+    }
+}
+
+// one event of an -include-profile trace
+struct include_event final {
+        std::string        name;
+        double             ts, dur;
+        int                depth;
+        unsigned long long lines, selflines, expansions, selfexpansions;
+};
+
+// the events of an -include-profile trace, in the order the files were closed
+static std::vector<include_event> includeevents(const std::string& json) {
+    std::vector<include_event> events;
+    const std::string          start = "{\"name\": \"";
+
+    for (size_t at = json.find(start); at != std::string::npos; at = json.find(start, at + 1)) {
+        include_event e {};
+        const size_t  end = json.find('"', at + start.size());
+        e.name            = json.substr(at + start.size(), end - at - start.size());
+        if (::sscanf(json.c_str() + end,
+                     "\", \"cat\": \"include\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %lf, \"dur\": %lf, \"args\": {\"depth\": %d, \"self_us\": %*f, "
+                     "\"lines\": %llu, \"self_lines\": %llu, \"tokens\": %*u, \"self_tokens\": %*u, \"expansions\": %llu, \"self_expansions\": %llu}}",
+                     &e.ts, &e.dur, &e.depth, &e.lines, &e.selflines, &e.expansions, &e.selfexpansions) != 7)
+            ADD_FAILURE() << "malformed event " << json.substr(at, 300);
+        events.push_back(e);
+    }
+    return events;
+}
+
+// every #include is an event inside the one of the file that included it, which is charged what its includes cost
+TEST(profile, nestsincludes) {
+    const scratch     dir;
+    const std::string trace = dir.dir + "/trace.json";
+
+    dir.write("a.h", "#define ONE 1\nint a = ONE;\n#include \"b.h\"\n");
+    dir.write("b.h", "int b = ONE + ONE;\n");
+    const std::string name = dir.write("main.c", "#include \"a.h\"\n#include \"b.h\"\nint m = ONE;\n");
+    const outcome     o    = runprep({ "-P", "-include-profile", trace, name });
+    ASSERT_EQ(o.status, 0) << o.err;
+    const std::vector<include_event> events = includeevents(contents(trace));
+    const char* const                names[] { "b.h", "a.h", "b.h", "main.c" };
+    const int                        depths[] { 2, 1, 1, 0 };
+    const unsigned long long         selfexpansions[] { 2, 1, 2, 1 };
+
+    ASSERT_EQ(events.size(), 4U) << contents(trace);
+    for (size_t i = 0; i < events.size(); i++) {
+        unsigned long long lines {}, expansions {};
+        EXPECT_EQ(events[i].name.substr(events[i].name.size() - ::strlen(names[i])), names[i]) << i;
+        EXPECT_EQ(events[i].depth, depths[i]) << i;
+        EXPECT_EQ(events[i].selfexpansions, selfexpansions[i]) << i;
+        for (size_t j = 0; j < i; j++) {
+            size_t parent = j + 1; /* a file is closed before the one that included it, and after its siblings before it */
+            while (parent < events.size() && events[parent].depth >= events[j].depth) parent++;
+            if (parent != i) continue;
+            EXPECT_EQ(events[j].depth, events[i].depth + 1) << j;
+            EXPECT_LE(events[i].ts, events[j].ts) << j << " starts outside " << i;
+            EXPECT_LE(events[j].ts + events[j].dur, events[i].ts + events[i].dur + 0.002) << j << " ends outside " << i; /* rounded to ns */
+            lines      += events[j].lines;
+            expansions += events[j].expansions;
+        }
+        EXPECT_EQ(events[i].lines, events[i].selflines + lines) << i;
+        EXPECT_EQ(events[i].expansions, events[i].selfexpansions + expansions) << i;
+    }
+}
+
+// -macro-profile counts the calls of every macro, the tokens they put in and how deep they nested, defined not included
+TEST(profile, countsmacros) {
+    const scratch dir;
+
+    dir.write("a.h", "#define ONE 1\nint a = ONE;\n#include \"b.h\"\n");
+    dir.write("b.h", "int b = ONE + ONE;\n");
+    const std::string name = dir.write("main.c", "#define TWICE(x) x + x\n#include \"a.h\"\n#include \"b.h\"\n#if defined(ONE) && defined TWICE\nint m = TWICE(ONE);\n#endif\n");
+    const outcome     o    = runprep({ "-P", "-macro-profile", name });
+    ASSERT_EQ(o.status, 0) << o.err;
+    const size_t header = o.err.find("macro profile: 2 macros expanded");
+    ASSERT_NE(header, std::string::npos) << o.err;
+    const char* const        names[] { "ONE", "TWICE" };
+    const unsigned long long calls[] { 6, 1 }, tokens[] { 6, 3 }; /* the argument of TWICE is expanded once for both uses */
+    const int                depths[] { 1, 0 };
+    const char* const        defined[] { "a.h:1", "main.c:1" };
+
+    for (size_t i = 0; i < 2; i++) {
+        const size_t at = o.err.find("\n" + std::string(names[i]) + " ", header);
+        ASSERT_NE(at, std::string::npos) << names[i] << " missing from " << o.err;
+        const std::string  row = o.err.substr(at + 1, o.err.find('\n', at + 1) - at - 1);
+        unsigned long long c {}, t {};
+        int                d {};
+        EXPECT_EQ(::sscanf(row.c_str() + ::strlen(names[i]), "%llu %llu %d", &c, &t, &d), 3) << row;
+        EXPECT_EQ(c, calls[i]) << row;
+        EXPECT_EQ(t, tokens[i]) << row;
+        EXPECT_EQ(d, depths[i]) << row;
+        EXPECT_EQ(row.substr(row.size() - ::strlen(defined[i])), defined[i]) << row;
+    }
+}
+
+// -pipeline puts out what a plain run does for inputs that fill no batch of rows, one, a row short of one, one and a row
+// more, several, and for a row too long for any batch, with the diagnostics of the lexer and of the directives in place
+TEST(pipeline, matchesplainrun) {
+    const scratch dir;
+    const size_t                   rows[] { 0, 1, 4095, 4096, 4097, 50000 };
+    const std::vector<std::string> tails { "", "char c = 'x;\n#error stopped here\nint after = P(2);\n", "int wide = " + std::string(0x50000, '1') + ";\n" };
+
+    for (const size_t n : rows) {
+        std::string text = "#define P(x) (x + 1)\n";
+        for (size_t i = 0; text.size() < 64 || i < n; i++) text += "int p" + std::to_string(i) + " = P(" + std::to_string(i) + ");\n";
+        for (const std::string& tail : tails) {
+            const std::string name = dir.write("main.c", text + tail);
+            for (const std::vector<std::string>& args : { std::vector<std::string> { "-P", name }, std::vector<std::string> { name } }) {
+                const outcome plain = runprep(args);
+                EXPECT_EQ(plain.status != 0, tail.find("#error") != std::string::npos) << plain.err;
+                expectplain(runprep(with({ "-pipeline" }, args)), plain, std::to_string(n) + " rows, " + std::to_string(tail.size()) + " bytes after them" + (args.size() > 1 ? ", -P" : ""));
+            }
+        }
+    }
+}
+
+// F(F(...F(1)...)) n deep
+static std::string nestedcalls(const size_t n) {
+    std::string text = "#define F(x) x\n";
+
+    for (size_t i = 0; i < n; i++) text += "F(";
+    text += "1";
+    return text + std::string(n, ')') + "\n";
+}
+
+TEST(expansion, stopsrunawaynesting) {
+    const scratch     dir;
+    const std::string deep = dir.write("deep.c", nestedcalls(20000));
+    const outcome     o    = runprep({ "-P", deep, "/dev/null" });
+
+    EXPECT_NE(o.status, 0);
+    EXPECT_NE(o.err.find("Macro expansion holds more than 16777216 tokens"), std::string::npos) << o.err.substr(o.err.size() > 200 ? o.err.size() - 200 : 0);
+    EXPECT_LT(o.peakkb, 512 * 1024) << "it took " << o.peakkb << " KB before it stopped";
+}
+
+TEST(expansion, takesamaximumsize) {
+    const scratch     dir;
+    const std::string nested = dir.write("nested.c", nestedcalls(40));
+    const outcome     fits   = runprep({ "-P", "-max-expansion-size", "100000", nested });
+    const outcome     stops  = runprep({ "-P", "-max-expansion-size", "1000", nested });
+    const outcome     bad    = runprep({ "-max-expansion-size", "none", nested });
+
+    EXPECT_EQ(fits.status, 0) << fits.err;
+    EXPECT_EQ(fits.out, "\n 1\n");
+    EXPECT_NE(stops.status, 0);
+    EXPECT_NE(stops.err.find("Macro expansion holds more than 1000 tokens, see -max-expansion-size"), std::string::npos) << stops.err;
+    EXPECT_NE(bad.status, 0);
+    EXPECT_NE(bad.err.find("-max-expansion-size takes a number"), std::string::npos) << bad.err;
+}
+
+// chains of object-like macros take no room on the work stack, however long
+TEST(expansion, followslongchains) {
+    const scratch dir;
+    std::string   text;
+    char          line[64];
+
+    for (int i = 0; i < 20000; i++) {
+        ::snprintf(line, sizeof(line), "#define A%d A%d\n", i, i + 1);
+        text += line;
+    }
+    text += "#define A20000 done\nA0\n";
+    const outcome o = runprep({ "-P", dir.write("chain.c", text) });
+
+    EXPECT_EQ(o.status, 0) << o.err;
+    EXPECT_NE(o.out.find("done"), std::string::npos);
+}
+
+// a file is read a block at a time, an eighth of its input window: splices whose backslash, ??/, CR or newline end one
+// block or start the next join the identifier they cut in two all the same
+TEST(lexer, splicesacrossblocks) {
+    const scratch     dir;
+    const char* const splices[] { "\\\n", "\\\n", "\\\n", "\\\r\n", "\\\r\n", "?\?/\n", "?\?/\n" };
+    const int         offsets[] { -2, -1, 0, -2, -1, -3, -1 }; // of the splice from the end of a block
+    std::string       text;
+
+    for (size_t k = 1; k <= sizeof(splices) / sizeof(*splices); k++) {
+        const std::string head = "int sp" + std::to_string(k) + "ab";
+        const size_t      at   = k * 4096 + offsets[k - 1] - head.size();
+        while (at - text.size() > 80) text += "int fill;\n";
+        text += std::string(at - text.size() - 1, ' ') + "\n" + head + splices[k - 1] + "cd = " + std::to_string(k) + ";\n";
+    }
+    ASSERT_LE(text.size(), 32768U) << "the input window would grow past 32 KB and its blocks with it";
+    const outcome o = runprep({ "-P", dir.write("blocks.c", text) });
+    ASSERT_EQ(o.status, 0) << o.err;
+    for (size_t k = 1; k <= sizeof(splices) / sizeof(*splices); k++)
+        EXPECT_NE(o.out.find("int sp" + std::to_string(k) + "abcd = " + std::to_string(k) + ";"), std::string::npos) << "splice " << k;
+}
+
+#endif